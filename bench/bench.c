@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ewok.h"
+
+/*
+ * Throughput benchmarks over a few realistic bit distributions.
+ *
+ * Usage: bench [log2 of the bitmap size, default 24]
+ *
+ * Results are printed to stdout as a JSON array with one record per
+ * (distribution, benchmark) pair, for comparing runs across versions.
+ */
+
+#define MIN_SECONDS 0.2
+#define MIN_RUNS 3
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t random_below(size_t n)
+{
+	return ((size_t)rand() * RAND_MAX + rand()) % n;
+}
+
+/* each bit set with probability 1/1000 */
+static void gen_uniform_sparse(size_t size, void (*set)(size_t, void *), void *payload)
+{
+	size_t pos = random_below(2000);
+
+	while (pos < size) {
+		set(pos, payload);
+		pos += 1 + random_below(2000);
+	}
+}
+
+/* dense clusters of up to 4K bits, far apart */
+static void gen_clustered(size_t size, void (*set)(size_t, void *), void *payload)
+{
+	size_t pos = random_below(1 << 16);
+
+	while (pos < size) {
+		size_t end = pos + random_below(1 << 12);
+
+		for (; pos < end && pos < size; ++pos) {
+			if (rand() % 4)
+				set(pos, payload);
+		}
+
+		pos += random_below(1 << 16);
+	}
+}
+
+/* alternating runs of ones and zeros, tens of thousands of bits long */
+static void gen_long_runs(size_t size, void (*set)(size_t, void *), void *payload)
+{
+	size_t pos = random_below(1 << 16);
+
+	while (pos < size) {
+		size_t end = pos + random_below(1 << 16);
+
+		for (; pos < end && pos < size; ++pos)
+			set(pos, payload);
+
+		pos += random_below(1 << 16);
+	}
+}
+
+/* everything set but for 1% of the bits */
+static void gen_dense_holes(size_t size, void (*set)(size_t, void *), void *payload)
+{
+	size_t pos;
+
+	for (pos = 0; pos < size; ++pos) {
+		if (rand() % 100)
+			set(pos, payload);
+	}
+}
+
+/*
+ * Reachability bitmap of a packfile: objects are sorted by age, so old
+ * history is almost entirely reachable, while recent objects are only
+ * reachable in scattered bursts (the tips of a few branches).
+ */
+static void gen_reachability(size_t size, void (*set)(size_t, void *), void *payload)
+{
+	size_t old = size / 10 * 8, pos;
+
+	for (pos = 0; pos < old; ++pos) {
+		if (rand() % 64)
+			set(pos, payload);
+	}
+
+	while (pos < size) {
+		size_t end = pos + random_below(256);
+
+		for (; pos < end && pos < size; ++pos)
+			set(pos, payload);
+
+		pos += random_below(4096);
+	}
+}
+
+struct distribution {
+	const char *name;
+	void (*generate)(size_t, void (*)(size_t, void *), void *);
+};
+
+static const struct distribution distributions[] = {
+	{"uniform-sparse", &gen_uniform_sparse},
+	{"clustered", &gen_clustered},
+	{"long-runs", &gen_long_runs},
+	{"dense-holes", &gen_dense_holes},
+	{"reachability", &gen_reachability},
+};
+
+struct positions {
+	size_t *pos;
+	size_t count, alloc;
+};
+
+static void cb__collect(size_t pos, void *payload)
+{
+	struct positions *p = payload;
+
+	if (p->count == p->alloc) {
+		p->alloc = p->alloc ? p->alloc * 2 : 1024;
+		p->pos = realloc(p->pos, p->alloc * sizeof(size_t));
+	}
+
+	p->pos[p->count++] = pos;
+}
+
+static void cb__count(size_t pos, void *payload)
+{
+	(*(size_t *)payload)++;
+}
+
+struct fixture {
+	struct positions bits;
+	uint64_t *ids;
+	struct ewah_bitmap *a, *b;
+	struct bitmap *plain;
+	FILE *file;
+};
+
+static struct ewah_bitmap *build(const struct positions *bits)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+	size_t i;
+
+	for (i = 0; i < bits->count; ++i)
+		ewah_set(bitmap, bits->pos[i]);
+
+	return bitmap;
+}
+
+/* benchmarks; each returns the number of operations it performed */
+
+static size_t run_set(struct fixture *f)
+{
+	ewah_free(build(&f->bits));
+	return f->bits.count;
+}
+
+static size_t run_add_sorted(struct fixture *f)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+
+	ewah_add_sorted(bitmap, f->ids, f->bits.count);
+	ewah_free(bitmap);
+	return f->bits.count;
+}
+
+#define DEFINE_OP_BENCH(op) \
+static size_t run_##op(struct fixture *f) \
+{ \
+	struct ewah_bitmap *out = ewah_new(); \
+	ewah_##op(f->a, f->b, out); \
+	ewah_free(out); \
+	return 1; \
+}
+
+DEFINE_OP_BENCH(or)
+DEFINE_OP_BENCH(and)
+DEFINE_OP_BENCH(xor)
+DEFINE_OP_BENCH(and_not)
+
+static size_t run_and_cardinality(struct fixture *f)
+{
+	volatile size_t count = ewah_and_cardinality(f->a, f->b);
+	(void)count;
+	return 1;
+}
+
+static size_t run_bitmap_or(struct fixture *f)
+{
+	bitmap_or_ewah(f->plain, f->a);
+	return 1;
+}
+
+static size_t run_iterate(struct fixture *f)
+{
+	struct ewah_iterator it;
+	volatile eword_t sink = 0;
+	eword_t word;
+	size_t words = 0;
+
+	ewah_iterator_init(&it, f->a);
+
+	while (ewah_iterator_next(&word, &it)) {
+		sink ^= word;
+		words++;
+	}
+
+	return words;
+}
+
+static size_t run_each_bit(struct fixture *f)
+{
+	size_t count = 0;
+	ewah_each_bit(f->a, &cb__count, &count);
+	return count;
+}
+
+static size_t run_decode(struct fixture *f)
+{
+	struct ewah_decode_cursor cursor;
+	uint64_t pos[1024];
+	size_t n, count = 0;
+
+	ewah_decode_init(&cursor);
+
+	while ((n = ewah_decode_positions(f->a, pos, 1024, &cursor)) > 0)
+		count += n;
+
+	return count;
+}
+
+#define QUERIES 1000
+
+static size_t run_rank(struct fixture *f)
+{
+	volatile size_t sink = 0;
+	size_t i;
+
+	for (i = 0; i < QUERIES; ++i)
+		sink += ewah_rank(f->a, random_below(f->a->bit_size + 1));
+
+	return QUERIES;
+}
+
+static size_t run_select(struct fixture *f)
+{
+	volatile size_t sink = 0;
+	size_t i, pos;
+
+	for (i = 0; i < QUERIES; ++i) {
+		if (ewah_select(f->a, random_below(f->bits.count + 1), &pos))
+			sink += pos;
+	}
+
+	return QUERIES;
+}
+
+static size_t run_serialize(struct fixture *f)
+{
+	rewind(f->file);
+	ewah_serialize(f->a, fileno(f->file));
+	return 1;
+}
+
+static size_t run_deserialize(struct fixture *f)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+
+	lseek(fileno(f->file), 0, SEEK_SET);
+	ewah_deserialize(bitmap, fileno(f->file));
+	ewah_free(bitmap);
+	return 1;
+}
+
+struct benchmark {
+	const char *name;
+	const char *unit;
+	size_t (*run)(struct fixture *);
+};
+
+static const struct benchmark benchmarks[] = {
+	{"set", "bit", &run_set},
+	{"add_sorted", "bit", &run_add_sorted},
+	{"or", "op", &run_or},
+	{"and", "op", &run_and},
+	{"xor", "op", &run_xor},
+	{"and_not", "op", &run_and_not},
+	{"and_cardinality", "op", &run_and_cardinality},
+	{"bitmap_or", "op", &run_bitmap_or},
+	{"iterate", "word", &run_iterate},
+	{"each_bit", "bit", &run_each_bit},
+	{"decode", "bit", &run_decode},
+	{"rank", "query", &run_rank},
+	{"select", "query", &run_select},
+	{"serialize", "op", &run_serialize},
+	{"deserialize", "op", &run_deserialize},
+};
+
+static bool first_record = true;
+
+static void record(const char *distribution, size_t size, const char *name,
+	const char *unit, double ns, size_t ops)
+{
+	printf("%s\n  {\"distribution\": \"%s\", \"bits\": %zu, \"benchmark\": \"%s\", "
+		"\"unit\": \"%s\", \"ns_per_op\": %.3f, \"ops\": %zu}",
+		first_record ? "" : ",", distribution, size, name, unit, ns, ops);
+	first_record = false;
+}
+
+static void bench_distribution(const struct distribution *d, size_t size)
+{
+	struct fixture f;
+	size_t t, set_bits;
+	double bytes;
+
+	memset(&f, 0x0, sizeof(f));
+	d->generate(size, &cb__collect, &f.bits);
+	f.a = build(&f.bits);
+
+	f.ids = malloc((f.bits.count + 1) * sizeof(uint64_t));
+	for (t = 0; t < f.bits.count; ++t)
+		f.ids[t] = f.bits.pos[t];
+
+	/* a second, independent bitmap of the same kind for the operations */
+	{
+		struct positions other;
+
+		memset(&other, 0x0, sizeof(other));
+		d->generate(size, &cb__collect, &other);
+		f.b = build(&other);
+		free(other.pos);
+	}
+
+	f.plain = ewah_to_bitmap(f.b);
+
+	f.file = tmpfile();
+	if (f.file == NULL) {
+		perror("tmpfile");
+		exit(1);
+	}
+	ewah_serialize(f.a, fileno(f.file));
+
+	set_bits = f.bits.count;
+	bytes = (double)f.a->buffer_size * sizeof(eword_t);
+
+	printf("%s\n  {\"distribution\": \"%s\", \"bits\": %zu, \"benchmark\": \"compression\", "
+		"\"set_bits\": %zu, \"compressed_words\": %zu, \"bytes_per_bit\": %.6f, "
+		"\"bytes_per_set_bit\": %.6f}",
+		first_record ? "" : ",", d->name, size, set_bits, f.a->buffer_size,
+		bytes / size, set_bits ? bytes / set_bits : 0.0);
+	first_record = false;
+
+	for (t = 0; t < sizeof(benchmarks)/sizeof(benchmarks[0]); ++t) {
+		const struct benchmark *b = &benchmarks[t];
+		size_t runs = 0, ops = 0;
+		double start = now(), elapsed;
+
+		do {
+			ops += b->run(&f);
+			runs++;
+			elapsed = now() - start;
+		} while (elapsed < MIN_SECONDS || runs < MIN_RUNS);
+
+		record(d->name, size, b->name, b->unit,
+			ops ? elapsed * 1e9 / ops : 0.0, ops);
+	}
+
+	fclose(f.file);
+	ewah_free(f.a);
+	ewah_free(f.b);
+	bitmap_free(f.plain);
+	free(f.bits.pos);
+	free(f.ids);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = (size_t)1 << (argc > 1 ? atoi(argv[1]) : 24);
+	size_t i;
+
+	srand(42);
+
+	printf("[");
+	for (i = 0; i < sizeof(distributions)/sizeof(distributions[0]); ++i) {
+		bench_distribution(&distributions[i], size);
+		fflush(stdout);
+	}
+	printf("\n]\n");
+
+	return 0;
+}
@@ -22,30 +22,57 @@
 #include <string.h>
 
 #include "ewok.h"
+#include "ewok_rlw.h"
 
 #define MASK(x) ((eword_t)1 << (x % BITS_IN_WORD))
 #define BLOCK(x) (x / BITS_IN_WORD)
 
-struct bitmap *bitmap_new(void)
+struct bitmap *bitmap_new_with_allocator(const struct ewah_allocator *allocator)
 {
-	struct bitmap *bitmap = ewah_malloc(sizeof(struct bitmap));
-	bitmap->words = ewah_calloc(32, sizeof(eword_t));
+	struct bitmap *bitmap = ewah_alloc_mem(allocator, sizeof(struct bitmap));
+	if (bitmap == NULL)
+		return NULL;
+
+	bitmap->words = ewah_alloc_mem(allocator, 32 * sizeof(eword_t));
+	if (bitmap->words == NULL) {
+		ewah_release_mem(allocator, bitmap);
+		return NULL;
+	}
+
+	memset(bitmap->words, 0x0, 32 * sizeof(eword_t));
 	bitmap->word_alloc = 32;
+	bitmap->allocator = allocator;
 	return bitmap;
 }
 
+struct bitmap *bitmap_new(void)
+{
+	return bitmap_new_with_allocator(NULL);
+}
+
+int bitmap_grow(struct bitmap *self, size_t word_alloc)
+{
+	size_t old_size = self->word_alloc;
+	eword_t *words = ewah_resize_mem(self->allocator,
+		self->words, word_alloc * sizeof(eword_t));
+
+	if (words == NULL)
+		return -1;
+
+	self->words = words;
+	self->word_alloc = word_alloc;
+
+	memset(self->words + old_size, 0x0,
+		(self->word_alloc - old_size) * sizeof(eword_t));
+	return 0;
+}
+
 void bitmap_set(struct bitmap *self, size_t pos)
 {
 	size_t block = BLOCK(pos);
 
-	if (block >= self->word_alloc) {
-		size_t old_size = self->word_alloc;
-		self->word_alloc = block * 2;
-		self->words = ewah_realloc(self->words, self->word_alloc * sizeof(eword_t));
-
-		memset(self->words + old_size, 0x0,
-			(self->word_alloc - old_size) * sizeof(eword_t));
-	}
+	if (block >= self->word_alloc)
+		bitmap_grow(self, block * 2);
 
 	self->words[block] |= MASK(pos);
 }
@@ -64,9 +91,87 @@ bool bitmap_get(struct bitmap *self, size_t pos)
 	return block < self->word_alloc && (self->words[block] & MASK(pos)) != 0;
 }
 
+/*
+ * Fold a compressed bitmap into an uncompressed one, walking its RLW
+ * stream: runs become a memset or nothing at all, and literal blocks are
+ * combined in place with the vectorized kernels.
+ */
+static void bitmap_fold_ewah(
+	struct bitmap *self, struct ewah_bitmap *other, enum ewah_literal_op op)
+{
+	size_t pointer = 0, pos = 0;
+
+	if (op == EWAH_LITERAL_OR) {
+		size_t words = 0;
+
+		while (pointer < other->buffer_size) {
+			words += rlw_size(other->buffer + pointer);
+			pointer += 1 + rlw_get_literal_words(other->buffer + pointer);
+		}
+
+		if (words > self->word_alloc)
+			bitmap_grow(self, words);
+
+		pointer = 0;
+	}
+
+	while (pointer < other->buffer_size && pos < self->word_alloc) {
+		const eword_t *word = other->buffer + pointer;
+		const size_t literals = rlw_get_literal_words(word);
+		size_t len = min_size(rlw_get_running_len(word), self->word_alloc - pos);
+		bool clear = false, fill = false;
+
+		switch (op) {
+		case EWAH_LITERAL_OR:
+			fill = rlw_get_run_bit(word);
+			break;
+		case EWAH_LITERAL_AND:
+			clear = !rlw_get_run_bit(word);
+			break;
+		case EWAH_LITERAL_AND_NOT:
+			clear = rlw_get_run_bit(word);
+			break;
+		default:
+			assert(!"unsupported operation");
+		}
+
+		if (fill)
+			memset(self->words + pos, 0xFF, len * sizeof(eword_t));
+		else if (clear)
+			memset(self->words + pos, 0x0, len * sizeof(eword_t));
+
+		pos += len;
+		len = min_size(literals, self->word_alloc - pos);
+
+		ewah_combine_words(self->words + pos, self->words + pos, word + 1, len, op);
+
+		pos += len;
+		pointer += 1 + literals;
+	}
+
+	/* past the end of `other` everything is zero */
+	if (op == EWAH_LITERAL_AND && pos < self->word_alloc)
+		memset(self->words + pos, 0x0, (self->word_alloc - pos) * sizeof(eword_t));
+}
+
+void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other)
+{
+	bitmap_fold_ewah(self, other, EWAH_LITERAL_OR);
+}
+
+void bitmap_and_ewah(struct bitmap *self, struct ewah_bitmap *other)
+{
+	bitmap_fold_ewah(self, other, EWAH_LITERAL_AND);
+}
+
+void bitmap_andnot_ewah(struct bitmap *self, struct ewah_bitmap *other)
+{
+	bitmap_fold_ewah(self, other, EWAH_LITERAL_AND_NOT);
+}
+
 struct ewah_bitmap *bitmap_compress(struct bitmap *bitmap)
 {
-	struct ewah_bitmap *ewah = ewah_new();
+	struct ewah_bitmap *ewah = ewah_new_with_allocator(bitmap->allocator);
 	size_t i, running_empty_words = 0;
 	eword_t last_word = 0;
 
@@ -94,7 +199,7 @@ struct ewah_bitmap *bitmap_compress(struct bitmap *bitmap)
 
 struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah)
 {
-	struct bitmap *bitmap = bitmap_new();
+	struct bitmap *bitmap = bitmap_new_with_allocator(ewah->allocator);
 	struct ewah_iterator it;
 	eword_t blowup;
 	size_t i = 0;
@@ -104,7 +209,7 @@ struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah)
 	while (ewah_iterator_next(&blowup, &it)) {
 		if (i >= bitmap->word_alloc) {
 			bitmap->word_alloc *= 1.5;
-			bitmap->words = ewah_realloc(
+			bitmap->words = ewah_resize_mem(bitmap->allocator,
 				bitmap->words, bitmap->word_alloc * sizeof(eword_t));
 		}
 
@@ -117,6 +222,6 @@ struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah)
 
 void bitmap_free(struct bitmap *bitmap)
 {
-	free(bitmap->words);
-	free(bitmap);
+	ewah_release_mem(bitmap->allocator, bitmap->words);
+	ewah_release_mem(bitmap->allocator, bitmap);
 }
@@ -0,0 +1,185 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Bump arena. Every allocation is preceded by its size, so it can be
+ * grown (by copying) without the caller having to remember it; the most
+ * recent allocation can also be grown or released in place, which is
+ * what a bitmap being built does all the time.
+ */
+
+#define ARENA_DEFAULT_CHUNK (1 << 20)
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ARENA_ALIGN
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[];
+};
+
+struct ewah_arena {
+	/* most recent chunk first; the last one is kept on reset */
+	struct arena_chunk *chunks;
+	size_t chunk_size;
+
+	/* most recent allocation, or NULL if it was released */
+	unsigned char *last;
+
+	struct ewah_allocator allocator;
+};
+
+static inline size_t *size_of(void *ptr)
+{
+	return (size_t *)((unsigned char *)ptr - sizeof(size_t));
+}
+
+/* offset in `chunk` where the next allocation would start */
+static inline size_t payload_offset(struct arena_chunk *chunk)
+{
+	uintptr_t top = (uintptr_t)(chunk->data + chunk->used) + ARENA_HEADER;
+	top = (top + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+	return top - (uintptr_t)chunk->data;
+}
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+	struct ewah_arena *arena = ctx;
+	struct arena_chunk *chunk = arena->chunks;
+	size_t offset;
+
+	if (chunk == NULL || payload_offset(chunk) + size > chunk->size) {
+		size_t chunk_size = max_size(arena->chunk_size,
+			size + ARENA_HEADER + ARENA_ALIGN);
+
+		chunk = ewah_malloc(sizeof(struct arena_chunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->next = arena->chunks;
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		arena->chunks = chunk;
+	}
+
+	offset = payload_offset(chunk);
+	chunk->used = offset + size;
+
+	arena->last = chunk->data + offset;
+	*size_of(arena->last) = size;
+	return arena->last;
+}
+
+static void *arena_resize(void *ctx, void *ptr, size_t size)
+{
+	struct ewah_arena *arena = ctx;
+	struct arena_chunk *chunk = arena->chunks;
+	void *grown;
+
+	if (ptr == NULL)
+		return arena_alloc(ctx, size);
+
+	if (size <= *size_of(ptr)) {
+		*size_of(ptr) = size;
+		return ptr;
+	}
+
+	/* the top of the current chunk can grow in place */
+	if (ptr == arena->last &&
+		(unsigned char *)ptr - chunk->data + size <= chunk->size) {
+		chunk->used = (unsigned char *)ptr - chunk->data + size;
+		*size_of(ptr) = size;
+		return ptr;
+	}
+
+	grown = arena_alloc(ctx, size);
+	if (grown)
+		memcpy(grown, ptr, *size_of(ptr));
+
+	return grown;
+}
+
+static void arena_release(void *ctx, void *ptr)
+{
+	struct ewah_arena *arena = ctx;
+
+	if (ptr != NULL && ptr == arena->last) {
+		struct arena_chunk *chunk = arena->chunks;
+
+		chunk->used = (unsigned char *)ptr - ARENA_HEADER - chunk->data;
+		arena->last = NULL;
+	}
+}
+
+struct ewah_arena *ewah_arena_new(size_t chunk_size)
+{
+	struct ewah_arena *arena = ewah_malloc(sizeof(struct ewah_arena));
+	if (arena == NULL)
+		return NULL;
+
+	arena->chunks = NULL;
+	arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK;
+	arena->last = NULL;
+
+	arena->allocator.alloc = &arena_alloc;
+	arena->allocator.resize = &arena_resize;
+	arena->allocator.release = &arena_release;
+	arena->allocator.ctx = arena;
+
+	return arena;
+}
+
+const struct ewah_allocator *ewah_arena_allocator(struct ewah_arena *arena)
+{
+	return &arena->allocator;
+}
+
+void ewah_arena_reset(struct ewah_arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks;
+
+	if (chunk == NULL)
+		return;
+
+	while (chunk->next) {
+		struct arena_chunk *next = chunk->next;
+		ewah_dealloc(chunk);
+		chunk = next;
+	}
+
+	chunk->used = 0;
+	arena->chunks = chunk;
+	arena->last = NULL;
+}
+
+void ewah_arena_free(struct ewah_arena *arena)
+{
+	ewah_arena_reset(arena);
+	ewah_dealloc(arena->chunks);
+	ewah_dealloc(arena);
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+#define APPEND_BLOCK_WORDS 256
+
+/*
+ * Append every word of `src` shifted left by `shift` bits (0 < shift <
+ * BITS_IN_WORD), with the low bits of the first one taken from `carry`.
+ * Runs stay runs: only their first word mixes with the carry.
+ *
+ * Returns the bits of the last word that spill over into the next one.
+ */
+static eword_t append_shifted(
+	struct ewah_bitmap *dst, struct ewah_bitmap *src,
+	unsigned shift, eword_t carry, size_t *words)
+{
+	eword_t block[APPEND_BLOCK_WORDS];
+	struct rlw_iterator it;
+
+	rlwit_init(&it, src);
+
+	while (rlwit_word_size(&it) > 0) {
+		size_t run = it.rlw.running_len, literals = it.rlw.literal_words, k;
+		const eword_t *in = it.buffer + it.literal_word_start;
+
+		if (run > 0) {
+			eword_t v = it.rlw.running_bit ? (eword_t)(~0) : 0;
+
+			ewah_add(dst, carry | (v << shift));
+			ewah_add_empty_words(dst, it.rlw.running_bit, run - 1);
+			carry = v >> (BITS_IN_WORD - shift);
+		}
+
+		for (k = 0; k < literals; ++k) {
+			eword_t w = in[k];
+
+			block[k % APPEND_BLOCK_WORDS] = carry | (w << shift);
+			carry = w >> (BITS_IN_WORD - shift);
+
+			if (k % APPEND_BLOCK_WORDS == APPEND_BLOCK_WORDS - 1)
+				ewah_add_words(dst, block, APPEND_BLOCK_WORDS);
+		}
+
+		ewah_add_words(dst, block, literals % APPEND_BLOCK_WORDS);
+
+		*words += run + literals;
+		rlwit_discard_first_words(&it, run + literals);
+	}
+
+	return carry;
+}
+
+int ewah_append(struct ewah_bitmap *dst, struct ewah_bitmap *src, size_t bit_offset)
+{
+	const size_t word_offset = bit_offset / BITS_IN_WORD;
+	const unsigned shift = bit_offset % BITS_IN_WORD;
+	const size_t total_bits = bit_offset + src->bit_size;
+	const size_t total_words = (total_bits + BITS_IN_WORD - 1) / BITS_IN_WORD;
+	size_t words = (dst->bit_size + BITS_IN_WORD - 1) / BITS_IN_WORD;
+	eword_t carry = 0;
+
+	assert(dst != src);
+
+	if (bit_offset < dst->bit_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/*
+	 * The gap after `dst->bit_size` is zero-filled, so the padding of
+	 * a partial last word (e.g. left by `ewah_not`) must not carry over
+	 */
+	if (dst->bit_size % BITS_IN_WORD) {
+		const eword_t mask =
+			((eword_t)1 << (dst->bit_size % BITS_IN_WORD)) - 1;
+
+		carry = ewah_pop_word(dst) & mask;
+		words--;
+
+		/* unless the first word of `src` lands on it, put it back */
+		if (words < word_offset) {
+			ewah_add(dst, carry);
+			carry = 0;
+			words++;
+		}
+	}
+
+	ewah_add_empty_words(dst, false, word_offset - words);
+	words = word_offset;
+
+	if (shift == 0) {
+		struct rlw_iterator it;
+
+		rlwit_init(&it, src);
+		words += rlwit_discharge(&it, dst, SIZE_MAX, false);
+	} else {
+		carry = append_shifted(dst, src, shift, carry, &words);
+	}
+
+	if (words < total_words) {
+		ewah_add(dst, carry);
+		words++;
+	}
+
+	ewah_add_empty_words(dst, false, total_words - min_size(words, total_words));
+
+	dst->bit_size = total_bits;
+	return 0;
+}
@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -26,32 +27,150 @@
 #include "ewok.h"
 #include "ewok_rlw.h"
 
-static inline size_t min_size(size_t a, size_t b)
+/* reference count of a word buffer shared between clones */
+struct ewah_shared {
+	size_t refs;
+
+	/* skip index of the words, complete and only ever read */
+	struct ewah_index *index;
+};
+
+/*
+ * Let go of the words of a bitmap, and of their index if it is shared
+ * with them; only the last clone to let go of shared words frees them.
+ * The mapping of a view is never freed.
+ */
+static void buffer_release(struct ewah_bitmap *self)
 {
-	return a < b ? a : b;
+	struct ewah_shared *shared = self->shared;
+
+	if (shared) {
+		self->shared = NULL;
+		self->index = NULL;
+
+		if (__atomic_sub_fetch(&shared->refs, 1, __ATOMIC_ACQ_REL) > 0)
+			return;
+
+		ewah_index_free(shared->index);
+		ewah_release_mem(self->allocator, shared);
+	}
+
+	if (self->alloc_size)
+		ewah_release_mem(self->allocator, self->buffer);
 }
 
-static inline size_t max_size(size_t a, size_t b)
+void ewah_release_words(struct ewah_bitmap *self)
 {
-	return a > b ? a : b;
+	buffer_release(self);
+}
+
+/*
+ * Shared words, and the words of a view, are read-only: give the bitmap
+ * its own copy of them before writing. A bitmap whose clones are all
+ * gone takes the words and their index back without copying them.
+ *
+ * Returns -1, with the bitmap left as it was, if the copy could not be
+ * allocated.
+ */
+static int buffer_unshare(struct ewah_bitmap *self)
+{
+	const size_t rlw_offset = self->rlw - self->buffer;
+	size_t alloc_size = self->alloc_size;
+	eword_t *buffer;
+
+	if (self->shared &&
+		__atomic_load_n(&self->shared->refs, __ATOMIC_ACQUIRE) == 1) {
+		ewah_release_mem(self->allocator, self->shared);
+		self->shared = NULL;
+
+		if (self->alloc_size)
+			return 0;
+	}
+
+	/* a view owns nothing, its mapping stays where it is */
+	if (alloc_size == 0)
+		alloc_size = self->buffer_size + 1;
+
+	buffer = ewah_alloc_mem(self->allocator, alloc_size * sizeof(eword_t));
+	if (buffer == NULL)
+		return -1;
+
+	memcpy(buffer, self->buffer, self->buffer_size * sizeof(eword_t));
+
+	buffer_release(self);
+
+	self->buffer = buffer;
+	self->alloc_size = alloc_size;
+	self->rlw = self->buffer + rlw_offset;
+	return 0;
+}
+
+static inline int buffer_own(struct ewah_bitmap *self)
+{
+	if (self->shared || self->alloc_size == 0)
+		return buffer_unshare(self);
+	return 0;
+}
+
+/*
+ * Hand the words before the last RLW to the sink of the bitmap, and
+ * move the last group to the start of the buffer.
+ */
+static size_t sink_flush(struct ewah_bitmap *self)
+{
+	const size_t n = self->rlw - self->buffer;
+
+	if (n == 0)
+		return 0;
+
+	self->sink->flush(self->sink, self->buffer, n);
+	self->sink->flushed += n;
+
+	memmove(self->buffer, self->rlw, (self->buffer_size - n) * sizeof(eword_t));
+	self->buffer_size -= n;
+	self->rlw = self->buffer;
+	return n;
+}
+
+void ewah_sink_finish(struct ewah_bitmap *self)
+{
+	sink_flush(self);
+
+	self->sink->flush(self->sink, self->buffer, self->buffer_size);
+	self->sink->flushed += self->buffer_size;
+	self->buffer_size = 0;
 }
 
 static inline void buffer_grow(struct ewah_bitmap *self, size_t new_size)
 {
-	size_t rlw_offset = (uint8_t *)self->rlw - (uint8_t *)self->buffer;
+	size_t rlw_offset;
+
+	/* views into a mapped file are read-only */
+	assert(self->alloc_size > 0);
 
 	if (self->alloc_size >= new_size)
 		return;
 
+	/* `new_size` counts the words that are about to be flushed */
+	if (self->sink) {
+		new_size -= sink_flush(self);
+
+		if (self->alloc_size >= new_size)
+			return;
+	}
+
+	rlw_offset = (uint8_t *)self->rlw - (uint8_t *)self->buffer;
+
 	self->alloc_size = new_size;
-	self->buffer = ewah_realloc(self->buffer, self->alloc_size * sizeof(eword_t));
-	self->rlw = self->buffer + (rlw_offset / sizeof(size_t));
+	self->buffer = ewah_resize_mem(self->allocator,
+		self->buffer, self->alloc_size * sizeof(eword_t));
+	self->rlw = self->buffer + (rlw_offset / sizeof(eword_t));
 }
 
 static inline void buffer_push(struct ewah_bitmap *self, eword_t value)
 {
 	if (self->buffer_size + 1 >= self->alloc_size) {
-		buffer_grow(self, self->buffer_size * 1.5);
+		buffer_grow(self, (self->buffer_size + 2) * 1.5);
 	}
 
 	self->buffer[self->buffer_size++] = value;
@@ -63,6 +182,83 @@ static void buffer_push_rlw(struct ewah_bitmap *self, eword_t value)
 	self->rlw = self->buffer + self->buffer_size - 1;
 }
 
+/* uncompressed word where the next appended word will land */
+static inline size_t append_word(struct ewah_bitmap *self)
+{
+	return (self->bit_size + BITS_IN_WORD - 1) / BITS_IN_WORD;
+}
+
+/*
+ * Account for `count` bits being appended, the lowest of them at `first`
+ * and the highest at `last`.
+ */
+static inline void count_bits(
+	struct ewah_bitmap *self, size_t count, size_t first, size_t last)
+{
+	if (self->cardinality == 0)
+		self->first_bit = first;
+
+	self->cardinality += count;
+	self->last_bit = last;
+}
+
+static void count_words(struct ewah_bitmap *self,
+	size_t pos, const eword_t *words, size_t n, bool negate)
+{
+	const eword_t flip = negate ? (eword_t)(~0) : 0;
+	size_t count, first = 0, lo = 0, hi = n - 1;
+
+	if (n == 0)
+		return;
+
+	count = ewah_popcount_words(words, n);
+	if (negate)
+		count = n * BITS_IN_WORD - count;
+
+	if (count == 0)
+		return;
+
+	/* literal words are rarely empty, so these scans stop right away;
+	 * the first bit only matters if there is none yet */
+	if (self->cardinality == 0) {
+		while ((words[lo] ^ flip) == 0)
+			lo++;
+
+		first = (pos + lo) * BITS_IN_WORD + word_low_bit(words[lo] ^ flip);
+	}
+
+	while ((words[hi] ^ flip) == 0)
+		hi--;
+
+	count_bits(self, count, first,
+		(pos + hi) * BITS_IN_WORD + word_high_bit(words[hi] ^ flip));
+}
+
+void ewah_recount(struct ewah_bitmap *self)
+{
+	size_t pointer = 0, pos = 0;
+
+	self->cardinality = 0;
+	self->first_bit = 0;
+	self->last_bit = 0;
+
+	while (pointer < self->buffer_size) {
+		const eword_t *word = &self->buffer[pointer];
+		const size_t run = rlw_get_running_len(word);
+		const size_t literals = rlw_get_literal_words(word);
+
+		if (run && rlw_get_run_bit(word)) {
+			count_bits(self, run * BITS_IN_WORD,
+				pos * BITS_IN_WORD, (pos + run) * BITS_IN_WORD - 1);
+		}
+
+		count_words(self, pos + run, word + 1, literals, false);
+
+		pos += run + literals;
+		pointer += 1 + literals;
+	}
+}
+
 static size_t add_empty_words(struct ewah_bitmap *self, bool v, size_t number)
 {
 	size_t added = 0;
@@ -105,18 +301,31 @@ static size_t add_empty_words(struct ewah_bitmap *self, bool v, size_t number)
 
 size_t ewah_add_empty_words(struct ewah_bitmap *self, bool v, size_t number)
 {
-	if (number == 0)
+	const size_t pos = append_word(self);
+
+	if (number == 0 || buffer_own(self) < 0)
 		return 0;
 
+	if (v) {
+		count_bits(self, number * BITS_IN_WORD,
+			pos * BITS_IN_WORD, (pos + number) * BITS_IN_WORD - 1);
+	}
+
 	self->bit_size += number * BITS_IN_WORD;
 	return add_empty_words(self, v, number);
 }
 
+/* bitmaps written out to a sink keep their groups short */
+static inline size_t largest_literal_count(struct ewah_bitmap *self)
+{
+	return self->sink ? EWAH_SINK_GROUP_WORDS : RLW_LARGEST_LITERAL_COUNT;
+}
+
 static size_t add_literal(struct ewah_bitmap *self, eword_t new_data)
 {
 	eword_t current_num = rlw_get_literal_words(self->rlw); 
 
-	if (current_num >= RLW_LARGEST_LITERAL_COUNT) {
+	if (current_num >= largest_literal_count(self)) {
 		buffer_push_rlw(self, 0);
 
 		rlw_set_literal_words(self->rlw, 1);
@@ -133,14 +342,16 @@ static size_t add_literal(struct ewah_bitmap *self, eword_t new_data)
 	return 1;
 }
 
-void ewah_add_dirty_words(
+static void add_dirty_words(
 	struct ewah_bitmap *self, const eword_t *buffer, size_t number, bool negate)
 {
 	size_t literals, can_add;
 
+	count_words(self, append_word(self), buffer, number, negate);
+
 	while (1) {
 		literals = rlw_get_literal_words(self->rlw);
-		can_add = min_size(number, RLW_LARGEST_LITERAL_COUNT - literals);
+		can_add = min_size(number, largest_literal_count(self) - literals);
 
 		rlw_set_literal_words(self->rlw, literals + can_add);
 
@@ -168,6 +379,90 @@ void ewah_add_dirty_words(
 	}
 }
 
+void ewah_add_dirty_words(
+	struct ewah_bitmap *self, const eword_t *buffer, size_t number, bool negate)
+{
+	size_t i = 0;
+
+	if (buffer_own(self) < 0)
+		return;
+
+	if (!self->canonical) {
+		add_dirty_words(self, buffer, number, negate);
+		return;
+	}
+
+	/* empty words in the input are runs, not literals */
+	while (i < number) {
+		size_t j = i + 1;
+
+		if (buffer[i] == 0 || buffer[i] == (eword_t)(~0)) {
+			while (j < number && buffer[j] == buffer[i])
+				j++;
+			ewah_add_empty_words(self, (buffer[i] != 0) != negate, j - i);
+		} else {
+			while (j < number && buffer[j] != 0 && buffer[j] != (eword_t)(~0))
+				j++;
+			add_dirty_words(self, buffer + i, j - i, negate);
+		}
+
+		i = j;
+	}
+}
+
+void ewah_splice(struct ewah_bitmap *self, struct ewah_bitmap *src)
+{
+	const size_t pos = append_word(self);
+	const size_t cardinality = self->cardinality;
+	size_t pointer = 0, rest;
+
+	while (pointer < src->buffer_size) {
+		const eword_t *word = src->buffer + pointer;
+		const size_t literals = rlw_get_literal_words(word);
+
+		ewah_add_empty_words(self,
+			rlw_get_run_bit(word), rlw_get_running_len(word));
+		ewah_add_dirty_words(self, word + 1, literals, false);
+		pointer += 1 + literals;
+
+		/*
+		 * Once a group lands in an RLW of its own, exactly as in `src`,
+		 * the writer is in the same state it was in there: the groups
+		 * that follow would come out the same, so copy them instead.
+		 */
+		if (*self->rlw == *word &&
+			self->rlw + 1 + literals == self->buffer + self->buffer_size)
+			break;
+	}
+
+	rest = src->buffer_size - pointer;
+	if (rest == 0 || self->sink ||
+		ewah_reserve(self, self->buffer_size + rest) < 0) {
+		struct rlw_iterator it;
+
+		/* replay whatever is left instead */
+		if (rest) {
+			rlwit_init_range(&it, src, append_word(self) - pos, SIZE_MAX);
+			rlwit_discharge(&it, self, SIZE_MAX, false);
+		}
+		return;
+	}
+
+	memcpy(self->buffer + self->buffer_size,
+		src->buffer + pointer, rest * sizeof(eword_t));
+	self->rlw = self->buffer + self->buffer_size + (src->rlw - src->buffer - pointer);
+	self->buffer_size += rest;
+	self->bit_size = (pos + append_word(src)) * BITS_IN_WORD;
+
+	if (src->cardinality) {
+		if (cardinality == 0)
+			self->first_bit = pos * BITS_IN_WORD + src->first_bit;
+		self->last_bit = pos * BITS_IN_WORD + src->last_bit;
+	}
+
+	self->cardinality = cardinality + src->cardinality;
+}
+
 static size_t add_empty_word(struct ewah_bitmap *self, bool v)
 {
 	bool no_literal = (rlw_get_literal_words(self->rlw) == 0);
@@ -204,6 +499,17 @@ static size_t add_empty_word(struct ewah_bitmap *self, bool v)
 
 size_t ewah_add(struct ewah_bitmap *self, eword_t word)
 {
+	const size_t pos = append_word(self);
+
+	if (buffer_own(self) < 0)
+		return 0;
+
+	if (word != 0) {
+		count_bits(self, __builtin_popcountll(word),
+			pos * BITS_IN_WORD + word_low_bit(word),
+			pos * BITS_IN_WORD + word_high_bit(word));
+	}
+
 	self->bit_size += BITS_IN_WORD;
 
 	if (word == 0)
@@ -223,6 +529,10 @@ void ewah_set(struct ewah_bitmap *self, size_t i)
 
 	assert(i >= self->bit_size);
 
+	if (buffer_own(self) < 0)
+		return;
+
+	count_bits(self, 1, i, i);
 	self->bit_size = i + 1;
 
 	if (dist > 0) {
@@ -249,6 +559,145 @@ void ewah_set(struct ewah_bitmap *self, size_t i)
 	}
 }
 
+static eword_t uncount_word(struct ewah_bitmap *self, eword_t word)
+{
+	const size_t words = append_word(self);
+
+	self->cardinality -= __builtin_popcountll(word);
+	self->bit_size = words ? (words - 1) * BITS_IN_WORD : 0;
+	return word;
+}
+
+eword_t ewah_pop_word(struct ewah_bitmap *self)
+{
+	eword_t literals = rlw_get_literal_words(self->rlw);
+	eword_t running_len = rlw_get_running_len(self->rlw);
+
+	if (buffer_own(self) < 0)
+		return 0;
+
+	if (literals > 0) {
+		rlw_set_literal_words(self->rlw, literals - 1);
+		return uncount_word(self, self->buffer[--self->buffer_size]);
+	}
+
+	if (running_len > 0) {
+		rlw_set_running_len(self->rlw, running_len - 1);
+		return uncount_word(self,
+			rlw_get_run_bit(self->rlw) ? (eword_t)(~0) : 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Start writing at the word holding bit `i`: returns the current value
+ * of that word, taken back out of the bitmap if it was its partially
+ * filled last word, or 0 after padding the gap with an empty run.
+ */
+static eword_t start_word(struct ewah_bitmap *self, size_t i)
+{
+	const size_t words = (self->bit_size + BITS_IN_WORD - 1) / BITS_IN_WORD;
+
+	if (i / BITS_IN_WORD < words)
+		return ewah_pop_word(self);
+
+	ewah_add_empty_words(self, false, i / BITS_IN_WORD - words);
+	return 0;
+}
+
+void ewah_set_range(struct ewah_bitmap *self, size_t start, size_t end)
+{
+	const size_t first = start / BITS_IN_WORD, last = (end - 1) / BITS_IN_WORD;
+	eword_t word;
+
+	assert(start >= self->bit_size);
+
+	if (start >= end)
+		return;
+
+	word = start_word(self, start);
+	word |= (eword_t)(~0) << (start % BITS_IN_WORD);
+
+	if (first == last) {
+		if (end % BITS_IN_WORD)
+			word &= ((eword_t)1 << (end % BITS_IN_WORD)) - 1;
+
+		ewah_add(self, word);
+	} else {
+		ewah_add(self, word);
+		ewah_add_empty_words(self, true, last - first - 1);
+
+		if (end % BITS_IN_WORD)
+			ewah_add(self, ((eword_t)1 << (end % BITS_IN_WORD)) - 1);
+		else
+			ewah_add_empty_words(self, true, 1);
+	}
+
+	self->bit_size = end;
+}
+
+/*
+ * Bits are ORed into a local word until the ids move on to another
+ * word; finished words are buffered and appended in blocks (which folds
+ * the full and empty ones into runs), and gaps become empty runs.
+ */
+#define SORTED_BLOCK_WORDS 256
+
+#define DEFINE_ADD_SORTED(name, type) \
+int name(struct ewah_bitmap *self, const type *ids, size_t n) \
+{ \
+	eword_t block[SORTED_BLOCK_WORDS]; \
+	size_t i, count = 0, current; \
+	eword_t word; \
+\
+	if (n == 0) \
+		return 0; \
+\
+	if (ids[0] < self->bit_size) { \
+		errno = EINVAL; \
+		return -1; \
+	} \
+\
+	for (i = 1; i < n; ++i) { \
+		if (ids[i] < ids[i - 1]) { \
+			errno = EINVAL; \
+			return -1; \
+		} \
+	} \
+\
+	current = ids[0] / BITS_IN_WORD; \
+	word = start_word(self, ids[0]); \
+\
+	for (i = 0; i < n; ++i) { \
+		const size_t w = ids[i] / BITS_IN_WORD; \
+\
+		if (w != current) { \
+			block[count++] = word; \
+\
+			if (count == SORTED_BLOCK_WORDS || w > current + 1) { \
+				ewah_add_words(self, block, count); \
+				count = 0; \
+			} \
+\
+			ewah_add_empty_words(self, false, w - current - 1); \
+			current = w; \
+			word = 0; \
+		} \
+\
+		word |= (eword_t)1 << (ids[i] % BITS_IN_WORD); \
+	} \
+\
+	block[count++] = word; \
+	ewah_add_words(self, block, count); \
+\
+	self->bit_size = (size_t)ids[n - 1] + 1; \
+	return 0; \
+}
+
+DEFINE_ADD_SORTED(ewah_add_sorted, uint64_t)
+DEFINE_ADD_SORTED(ewah_add_sorted32, uint32_t)
+
 void ewah_each_bit(struct ewah_bitmap *self, void (*callback)(size_t, void*), void *payload)
 {
 	size_t pos = 0;
@@ -270,48 +719,347 @@ void ewah_each_bit(struct ewah_bitmap *self, void (*callback)(size_t, void*), vo
 		++pointer;
 
 		for (k = 0; k < rlw_get_literal_words(word); ++k) {
-			int c;
+			eword_t bits = self->buffer[pointer];
 
-			/* todo: zero count optimization */
-			for (c = 0; c < BITS_IN_WORD; ++c, ++pos) {
-				if ((self->buffer[pointer] & ((eword_t)1 << c)) != 0) {
-					callback(pos, payload);
-				}
+			while (bits) {
+				callback(pos + __builtin_ctzll(bits), payload);
+				bits &= bits - 1;
 			}
 
+			pos += BITS_IN_WORD;
 			++pointer;
 		}
 	}
 }
 
-struct ewah_bitmap *ewah_new(void)
+void ewah_decode_init(struct ewah_decode_cursor *cursor)
+{
+	memset(cursor, 0x0, sizeof(struct ewah_decode_cursor));
+}
+
+/*
+ * Resumable decoder: the cursor keeps the bits of the literal word being
+ * decoded, the bits left in the current run of ones and the literal words
+ * left in the current RLW group, so decoding can stop as soon as the
+ * output buffer is full and pick up from the same bit on the next call.
+ *
+ * Set bits in literal words are extracted with count-trailing-zeros and
+ * cleared with `w & (w - 1)`, which compile down to TZCNT and BLSR.
+ */
+#define DEFINE_DECODE_POSITIONS(name, type) \
+size_t name(struct ewah_bitmap *self, type *out, size_t cap, \
+	struct ewah_decode_cursor *cursor) \
+{ \
+	size_t n = 0; \
+\
+	while (n < cap) { \
+		if (cursor->word) { \
+			eword_t word = cursor->word; \
+			const size_t base = cursor->base; \
+\
+			while (word && n < cap) { \
+				out[n++] = (type)(base + __builtin_ctzll(word)); \
+				word &= word - 1; \
+			} \
+\
+			cursor->word = word; \
+			continue; \
+		} \
+\
+		if (cursor->ones_left) { \
+			size_t k, len = min_size(cursor->ones_left, cap - n); \
+\
+			for (k = 0; k < len; ++k) \
+				out[n++] = (type)(cursor->base + k); \
+\
+			cursor->base += len; \
+			cursor->ones_left -= len; \
+			continue; \
+		} \
+\
+		if (cursor->literals_left) { \
+			cursor->word = self->buffer[cursor->pointer++]; \
+			cursor->base = cursor->word_pos; \
+			cursor->word_pos += BITS_IN_WORD; \
+			cursor->literals_left--; \
+			continue; \
+		} \
+\
+		if (cursor->pointer >= self->buffer_size) \
+			break; \
+\
+		{ \
+			const eword_t *rlw = &self->buffer[cursor->pointer++]; \
+			size_t run = rlw_get_running_len(rlw) * BITS_IN_WORD; \
+\
+			if (rlw_get_run_bit(rlw)) { \
+				cursor->base = cursor->word_pos; \
+				cursor->ones_left = run; \
+			} \
+\
+			cursor->word_pos += run; \
+			cursor->literals_left = rlw_get_literal_words(rlw); \
+		} \
+	} \
+\
+	return n; \
+}
+
+DEFINE_DECODE_POSITIONS(ewah_decode_positions, uint64_t)
+DEFINE_DECODE_POSITIONS(ewah_decode_positions32, uint32_t)
+
+struct ewah_bitmap *ewah_new_with_allocator(const struct ewah_allocator *allocator)
 {
 	struct ewah_bitmap *bitmap;
 
-	bitmap = ewah_malloc(sizeof(struct ewah_bitmap));
+	bitmap = ewah_alloc_mem(allocator, sizeof(struct ewah_bitmap));
 	if (bitmap == NULL)
 		return NULL;
 
-	bitmap->buffer = ewah_malloc(32 * sizeof(eword_t));
+	bitmap->buffer = ewah_alloc_mem(allocator, 32 * sizeof(eword_t));
+	if (bitmap->buffer == NULL) {
+		ewah_release_mem(allocator, bitmap);
+		return NULL;
+	}
+
 	bitmap->alloc_size = 32;
+	bitmap->index = NULL;
+	bitmap->allocator = allocator;
+	bitmap->sink = NULL;
+	bitmap->canonical = false;
+	bitmap->shared = NULL;
 
 	ewah_clear(bitmap);
 
 	return bitmap;
 }
 
+struct ewah_bitmap *ewah_new(void)
+{
+	return ewah_new_with_allocator(NULL);
+}
+
 void ewah_clear(struct ewah_bitmap *bitmap)
 {
+	/* none of the read-only words are worth copying */
+	if (bitmap->shared || bitmap->alloc_size == 0) {
+		const size_t buffer_size = bitmap->buffer_size;
+		eword_t *rlw = bitmap->rlw;
+
+		bitmap->buffer_size = 0;
+		bitmap->rlw = bitmap->buffer;
+
+		if (buffer_unshare(bitmap) < 0) {
+			bitmap->buffer_size = buffer_size;
+			bitmap->rlw = rlw;
+			return;
+		}
+	}
+
 	bitmap->buffer_size = 1;
 	bitmap->buffer[0] = 0;
 	bitmap->bit_size = 0;
 	bitmap->rlw = bitmap->buffer;
+
+	bitmap->cardinality = 0;
+	bitmap->first_bit = 0;
+	bitmap->last_bit = 0;
+
+	if (bitmap->index)
+		ewah_index_reset(bitmap->index);
 }
 
 void ewah_free(struct ewah_bitmap *bitmap)
 {
-	free(bitmap->buffer);
-	free(bitmap);
+	buffer_release(bitmap);
+	ewah_index_free(bitmap->index);
+	ewah_release_mem(bitmap->allocator, bitmap);
+}
+
+struct ewah_bitmap *ewah_clone(struct ewah_bitmap *self)
+{
+	struct ewah_shared *shared = NULL;
+	struct ewah_bitmap *clone;
+
+	/* the words already handed to the sink are gone */
+	if (self->sink) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	clone = ewah_alloc_mem(self->allocator, sizeof(struct ewah_bitmap));
+	if (clone == NULL)
+		return NULL;
+
+	/*
+	 * The first clone publishes the words, with an index built up front:
+	 * random access through the clones then only ever reads it. Without
+	 * memory for the index, the clones scan instead.
+	 */
+	shared = self->shared;
+	if (shared == NULL) {
+		shared = ewah_alloc_mem(self->allocator, sizeof(struct ewah_shared));
+		if (shared == NULL) {
+			ewah_release_mem(self->allocator, clone);
+			return NULL;
+		}
+
+		ewah_build_rank_index(self, 0);
+
+		shared->refs = 1;
+		shared->index = self->index;
+		self->shared = shared;
+	}
+
+	__atomic_add_fetch(&shared->refs, 1, __ATOMIC_RELAXED);
+
+	clone->buffer = self->buffer;
+	clone->buffer_size = self->buffer_size;
+	clone->alloc_size = self->alloc_size;
+	clone->bit_size = self->bit_size;
+	clone->rlw = self->rlw;
+	clone->index = shared->index;
+	clone->allocator = self->allocator;
+	clone->cardinality = self->cardinality;
+	clone->first_bit = self->first_bit;
+	clone->last_bit = self->last_bit;
+	clone->sink = NULL;
+	clone->canonical = self->canonical;
+	clone->shared = shared;
+
+	return clone;
+}
+
+int ewah_reserve(struct ewah_bitmap *self, size_t words)
+{
+	size_t rlw_offset;
+	eword_t *buffer;
+
+	if (buffer_own(self) < 0)
+		return -1;
+
+	rlw_offset = self->rlw - self->buffer;
+
+	/* appending always keeps one spare word past the end */
+	if (self->alloc_size > words)
+		return 0;
+
+	buffer = ewah_resize_mem(self->allocator,
+		self->buffer, (words + 1) * sizeof(eword_t));
+	if (buffer == NULL)
+		return -1;
+
+	self->buffer = buffer;
+	self->alloc_size = words + 1;
+	self->rlw = self->buffer + rlw_offset;
+	return 0;
+}
+
+size_t ewah_estimate_words(
+	struct ewah_bitmap **bitmaps, size_t n, enum ewah_literal_op op)
+{
+	size_t i, compressed = 1, words = 0, longest = 0, tail;
+
+	/*
+	 * Every RLW of the result starts where one of the inputs changes
+	 * state, and every literal sits where one of them has a literal.
+	 * Nor can the result take more than a word per uncompressed word,
+	 * plus an RLW each time a group is full of literals.
+	 *
+	 * Only the words that all the inputs have can be set in an AND,
+	 * and only those of the first input in an AND-NOT: past them the
+	 * result is a run of zeros.
+	 */
+	for (i = 0; i < n; ++i) {
+		const size_t length = append_word(bitmaps[i]);
+
+		compressed += bitmaps[i]->buffer_size;
+		longest = max_size(longest, length);
+
+		if (op == EWAH_LITERAL_AND)
+			words = i ? min_size(words, length) : length;
+		else if (op != EWAH_LITERAL_AND_NOT || i == 0)
+			words = max_size(words, length);
+	}
+
+	tail = longest - words;
+	words += words / RLW_LARGEST_LITERAL_COUNT + 1;
+
+	if (tail)
+		words += tail / RLW_LARGEST_RUNNING_COUNT + 1;
+
+	return min_size(compressed, words);
+}
+
+void ewah_reserve_result(struct ewah_bitmap *out,
+	struct ewah_bitmap **bitmaps, size_t n, enum ewah_literal_op op)
+{
+	/* a bitmap written to a sink only keeps its last group in memory */
+	if (out->sink == NULL) {
+		ewah_reserve(out,
+			out->buffer_size + ewah_estimate_words(bitmaps, n, op));
+	}
+}
+
+size_t ewah_result_words(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j)
+{
+	struct ewah_bitmap *inputs[2] = { bitmap_i, bitmap_j };
+
+	/* OR and XOR can take the most words */
+	return ewah_estimate_words(inputs, 2, EWAH_LITERAL_OR);
+}
+
+int ewah_compact(struct ewah_bitmap *self)
+{
+	struct ewah_bitmap *out;
+	eword_t *buffer;
+	size_t pointer = 0;
+
+	/* sinks hold words we no longer have */
+	if (self->sink) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	out = ewah_new_with_allocator(self->allocator);
+	if (out == NULL)
+		return -1;
+
+	while (pointer < self->buffer_size) {
+		eword_t *word = &self->buffer[pointer];
+		size_t literals = rlw_get_literal_words(word);
+
+		ewah_add_empty_words(out,
+			rlw_get_run_bit(word), rlw_get_running_len(word));
+		ewah_add_words(out, word + 1, literals);
+
+		pointer += 1 + literals;
+	}
+
+	/* keep the words untrimmed if they cannot be moved */
+	buffer = ewah_resize_mem(self->allocator,
+		out->buffer, out->buffer_size * sizeof(eword_t));
+	if (buffer) {
+		out->rlw = buffer + (out->rlw - out->buffer);
+		out->buffer = buffer;
+		out->alloc_size = out->buffer_size;
+	}
+
+	/* the uncompressed words are the same, so are the bit counts */
+	buffer_release(self);
+
+	self->buffer = out->buffer;
+	self->buffer_size = out->buffer_size;
+	self->alloc_size = out->alloc_size;
+	self->rlw = out->rlw;
+
+	ewah_release_mem(self->allocator, out);
+
+	if (self->index)
+		ewah_index_reset(self->index);
+
+	return 0;
 }
 
 static void read_new_rlw(struct ewah_iterator *it)
@@ -359,6 +1107,8 @@ bool ewah_iterator_next(eword_t *next, struct ewah_iterator *it)
 		*next = it->buffer[it->pointer];
 	}
 
+	it->position++;
+
 	if (it->compressed == it->rl && it->literals == it->lw) {
 		if (++it->pointer < it->buffer_size)
 			read_new_rlw(it);
@@ -379,10 +1129,57 @@ void ewah_iterator_init(struct ewah_iterator *it, struct ewah_bitmap *parent)
 	it->literals = 0;
 	it->b = false;
 
+	it->position = 0;
+	it->parent = parent;
+
 	if (it->pointer < it->buffer_size)
 		read_new_rlw(it);
 }
 
+bool ewah_iterator_advance_to(struct ewah_iterator *it, size_t pos)
+{
+	size_t target = pos / BITS_IN_WORD;
+	size_t rlw_pointer, start, offset;
+
+	if (it->pointer >= it->buffer_size)
+		return false;
+
+	if (target <= it->position)
+		return true;
+
+	rlw_pointer = it->pointer - it->literals;
+	start = it->position - it->compressed - it->literals;
+
+	if (target >= start + it->rl + it->lw) {
+		rlw_pointer += 1 + it->lw;
+		start = rlw_skip_to(it->parent, it->buffer, it->buffer_size,
+			&rlw_pointer, start + it->rl + it->lw, target);
+
+		if (rlw_pointer >= it->buffer_size) {
+			it->pointer = it->buffer_size;
+			it->position = start;
+			return false;
+		}
+
+		it->pointer = rlw_pointer;
+		read_new_rlw(it);
+	}
+
+	offset = target - start;
+
+	if (offset < it->rl) {
+		it->compressed = offset;
+		it->literals = 0;
+	} else {
+		it->compressed = it->rl;
+		it->literals = offset - it->rl;
+	}
+
+	it->pointer = rlw_pointer + it->literals;
+	it->position = target;
+	return true;
+}
+
 void ewah_dump(struct ewah_bitmap *bitmap)
 {
 	size_t i;
@@ -398,6 +1195,9 @@ void ewah_not(struct ewah_bitmap *self)
 {
 	size_t pointer = 0;
 
+	if (buffer_own(self) < 0)
+		return;
+
 	while (pointer < self->buffer_size) {
 		eword_t *word = &self->buffer[pointer];
 		size_t literals, k; 
@@ -411,31 +1211,38 @@ void ewah_not(struct ewah_bitmap *self)
 			++pointer;
 		}
 	}
-}
 
-void ewah_xor(
-	struct ewah_bitmap *bitmap_i,
-	struct ewah_bitmap *bitmap_j,
-	struct ewah_bitmap *out)
-{
-	struct rlw_iterator rlw_i;
-	struct rlw_iterator rlw_j;
+	/* the padding above `bit_size` must stay clear */
+	if (self->bit_size % BITS_IN_WORD) {
+		const size_t bit_size = self->bit_size;
+		const eword_t mask = ((eword_t)1 << (bit_size % BITS_IN_WORD)) - 1;
 
-	rlwit_init(&rlw_i, bitmap_i);
-	rlwit_init(&rlw_j, bitmap_j);
+		ewah_add(self, ewah_pop_word(self) & mask);
+		self->bit_size = bit_size;
+	}
+
+	ewah_recount(self);
+
+	/* the bit counts of a ranked index are now wrong */
+	if (self->index)
+		ewah_index_reset(self->index);
+}
 
-	while (rlwit_word_size(&rlw_i) > 0 && rlwit_word_size(&rlw_j) > 0) {
-		while (rlw_i.rlw.running_len > 0 || rlw_j.rlw.running_len > 0) {
+static void xor_iterators(struct rlw_iterator *rlw_i,
+	struct rlw_iterator *rlw_j, struct ewah_bitmap *out)
+{
+	while (rlwit_word_size(rlw_i) > 0 && rlwit_word_size(rlw_j) > 0) {
+		while (rlw_i->rlw.running_len > 0 || rlw_j->rlw.running_len > 0) {
 			struct rlw_iterator *prey, *predator;
 			size_t index;
 			bool negate_words;
 
-			if (rlw_i.rlw.running_len < rlw_j.rlw.running_len) {
-				prey = &rlw_i;
-				predator = &rlw_j;
+			if (rlw_i->rlw.running_len < rlw_j->rlw.running_len) {
+				prey = rlw_i;
+				predator = rlw_j;
 			} else {
-				prey = &rlw_j;
-				predator = &rlw_i;
+				prey = rlw_j;
+				predator = rlw_i;
 			}
 
 			negate_words = !!predator->rlw.running_bit;
@@ -445,53 +1252,56 @@ void ewah_xor(
 			rlwit_discard_first_words(predator, predator->rlw.running_len);
 		}
 
-		size_t literals = min_size(rlw_i.rlw.literal_words, rlw_j.rlw.literal_words);
+		size_t literals = min_size(rlw_i->rlw.literal_words, rlw_j->rlw.literal_words);
 
 		if (literals) {
-			size_t k;
-
-			for (k = 0; k < literals; ++k) {
-				ewah_add(out,
-					rlw_i.buffer[rlw_i.literal_word_start + k] ^
-					rlw_j.buffer[rlw_j.literal_word_start + k]
-				);
-			}
+			ewah_add_literal_block(out,
+				rlw_i->buffer + rlw_i->literal_word_start,
+				rlw_j->buffer + rlw_j->literal_word_start,
+				literals, EWAH_LITERAL_XOR);
 
-			rlwit_discard_first_words(&rlw_i, literals);
-			rlwit_discard_first_words(&rlw_j, literals);
+			rlwit_discard_first_words(rlw_i, literals);
+			rlwit_discard_first_words(rlw_j, literals);
 		}
 	}
 
-	if (rlwit_word_size(&rlw_i) > 0) {
-		rlwit_discharge(&rlw_i, out, ~0, false);
+	if (rlwit_word_size(rlw_i) > 0) {
+		rlwit_discharge(rlw_i, out, ~0, false);
 	} else {
-		rlwit_discharge(&rlw_j, out, ~0, false);
+		rlwit_discharge(rlw_j, out, ~0, false);
 	}
-
-	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
 }
 
-void ewah_and(
+void ewah_xor(
 	struct ewah_bitmap *bitmap_i,
 	struct ewah_bitmap *bitmap_j,
 	struct ewah_bitmap *out)
 {
 	struct rlw_iterator rlw_i;
 	struct rlw_iterator rlw_j;
+	struct ewah_bitmap *inputs[2] = { bitmap_i, bitmap_j };
+
+	ewah_reserve_result(out, inputs, 2, EWAH_LITERAL_XOR);
 
 	rlwit_init(&rlw_i, bitmap_i);
 	rlwit_init(&rlw_j, bitmap_j);
+	xor_iterators(&rlw_i, &rlw_j, out);
+	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
+}
 
-	while (rlwit_word_size(&rlw_i) > 0 && rlwit_word_size(&rlw_j) > 0) {
-		while (rlw_i.rlw.running_len > 0 || rlw_j.rlw.running_len > 0) {
+static void and_iterators(struct rlw_iterator *rlw_i,
+	struct rlw_iterator *rlw_j, struct ewah_bitmap *out)
+{
+	while (rlwit_word_size(rlw_i) > 0 && rlwit_word_size(rlw_j) > 0) {
+		while (rlw_i->rlw.running_len > 0 || rlw_j->rlw.running_len > 0) {
 			struct rlw_iterator *prey, *predator;
 
-			if (rlw_i.rlw.running_len < rlw_j.rlw.running_len) {
-				prey = &rlw_i;
-				predator = &rlw_j;
+			if (rlw_i->rlw.running_len < rlw_j->rlw.running_len) {
+				prey = rlw_i;
+				predator = rlw_j;
 			} else {
-				prey = &rlw_j;
-				predator = &rlw_i;
+				prey = rlw_j;
+				predator = rlw_i;
 			}
 
 			if (predator->rlw.running_bit == 0) {
@@ -506,57 +1316,60 @@ void ewah_and(
 			}
 		}
 
-		size_t literals = min_size(rlw_i.rlw.literal_words, rlw_j.rlw.literal_words);
+		size_t literals = min_size(rlw_i->rlw.literal_words, rlw_j->rlw.literal_words);
 
 		if (literals) {
-			size_t k;
-
-			for (k = 0; k < literals; ++k) {
-				ewah_add(out,
-					rlw_i.buffer[rlw_i.literal_word_start + k] &
-					rlw_j.buffer[rlw_j.literal_word_start + k]
-				);
-			}
+			ewah_add_literal_block(out,
+				rlw_i->buffer + rlw_i->literal_word_start,
+				rlw_j->buffer + rlw_j->literal_word_start,
+				literals, EWAH_LITERAL_AND);
 
-			rlwit_discard_first_words(&rlw_i, literals);
-			rlwit_discard_first_words(&rlw_j, literals);
+			rlwit_discard_first_words(rlw_i, literals);
+			rlwit_discard_first_words(rlw_j, literals);
 		}
 	}
 
-	if (rlwit_word_size(&rlw_i) > 0) {
-		rlwit_discharge_empty(&rlw_i, out);
+	if (rlwit_word_size(rlw_i) > 0) {
+		rlwit_discharge_empty(rlw_i, out);
 	} else {
-		rlwit_discharge_empty(&rlw_j, out);
+		rlwit_discharge_empty(rlw_j, out);
 	}
-
-	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
 }
 
-void ewah_and_not(
+void ewah_and(
 	struct ewah_bitmap *bitmap_i,
 	struct ewah_bitmap *bitmap_j,
 	struct ewah_bitmap *out)
 {
 	struct rlw_iterator rlw_i;
 	struct rlw_iterator rlw_j;
+	struct ewah_bitmap *inputs[2] = { bitmap_i, bitmap_j };
+
+	ewah_reserve_result(out, inputs, 2, EWAH_LITERAL_AND);
 
 	rlwit_init(&rlw_i, bitmap_i);
 	rlwit_init(&rlw_j, bitmap_j);
+	and_iterators(&rlw_i, &rlw_j, out);
+	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
+}
 
-	while (rlwit_word_size(&rlw_i) > 0 && rlwit_word_size(&rlw_j) > 0) {
-		while (rlw_i.rlw.running_len > 0 || rlw_j.rlw.running_len > 0) {
+static void and_not_iterators(struct rlw_iterator *rlw_i,
+	struct rlw_iterator *rlw_j, struct ewah_bitmap *out)
+{
+	while (rlwit_word_size(rlw_i) > 0 && rlwit_word_size(rlw_j) > 0) {
+		while (rlw_i->rlw.running_len > 0 || rlw_j->rlw.running_len > 0) {
 			struct rlw_iterator *prey, *predator;
 
-			if (rlw_i.rlw.running_len < rlw_j.rlw.running_len) {
-				prey = &rlw_i;
-				predator = &rlw_j;
+			if (rlw_i->rlw.running_len < rlw_j->rlw.running_len) {
+				prey = rlw_i;
+				predator = rlw_j;
 			} else {
-				prey = &rlw_j;
-				predator = &rlw_i;
+				prey = rlw_j;
+				predator = rlw_i;
 			}
 
-			if ((predator->rlw.running_bit && prey == &rlw_i) ||
-				(!predator->rlw.running_bit && prey != &rlw_i)) {
+			if ((predator->rlw.running_bit && prey == rlw_i) ||
+				(!predator->rlw.running_bit && prey != rlw_i)) {
 				ewah_add_empty_words(out, false, predator->rlw.running_len);
 				rlwit_discard_first_words(prey, predator->rlw.running_len);
 				rlwit_discard_first_words(predator, predator->rlw.running_len);
@@ -564,65 +1377,68 @@ void ewah_and_not(
 				size_t index;
 				bool negate_words;
 
-				negate_words = (&rlw_i != prey);
+				negate_words = (rlw_i != prey);
 				index = rlwit_discharge(prey, out, predator->rlw.running_len, negate_words);
 				ewah_add_empty_words(out, negate_words, predator->rlw.running_len - index);
 				rlwit_discard_first_words(predator, predator->rlw.running_len);
 			} 
 		}
 
-		size_t literals = min_size(rlw_i.rlw.literal_words, rlw_j.rlw.literal_words);
+		size_t literals = min_size(rlw_i->rlw.literal_words, rlw_j->rlw.literal_words);
 
 		if (literals) {
-			size_t k;
-
-			for (k = 0; k < literals; ++k) {
-				ewah_add(out,
-					rlw_i.buffer[rlw_i.literal_word_start + k] &
-					~(rlw_j.buffer[rlw_j.literal_word_start + k])
-				);
-			}
+			ewah_add_literal_block(out,
+				rlw_i->buffer + rlw_i->literal_word_start,
+				rlw_j->buffer + rlw_j->literal_word_start,
+				literals, EWAH_LITERAL_AND_NOT);
 
-			rlwit_discard_first_words(&rlw_i, literals);
-			rlwit_discard_first_words(&rlw_j, literals);
+			rlwit_discard_first_words(rlw_i, literals);
+			rlwit_discard_first_words(rlw_j, literals);
 		}
 	}
 
-	if (rlwit_word_size(&rlw_i) > 0) {
-		rlwit_discharge(&rlw_i, out, ~0, false);
+	if (rlwit_word_size(rlw_i) > 0) {
+		rlwit_discharge(rlw_i, out, ~0, false);
 	} else {
-		rlwit_discharge_empty(&rlw_j, out);
+		rlwit_discharge_empty(rlw_j, out);
 	}
-
-	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
 }
 
-void ewah_or(
+void ewah_and_not(
 	struct ewah_bitmap *bitmap_i,
 	struct ewah_bitmap *bitmap_j,
 	struct ewah_bitmap *out)
 {
 	struct rlw_iterator rlw_i;
 	struct rlw_iterator rlw_j;
+	struct ewah_bitmap *inputs[2] = { bitmap_i, bitmap_j };
+
+	ewah_reserve_result(out, inputs, 2, EWAH_LITERAL_AND_NOT);
 
 	rlwit_init(&rlw_i, bitmap_i);
 	rlwit_init(&rlw_j, bitmap_j);
+	and_not_iterators(&rlw_i, &rlw_j, out);
+	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
+}
 
-	while (rlwit_word_size(&rlw_i) > 0 && rlwit_word_size(&rlw_j) > 0) {
-		while (rlw_i.rlw.running_len > 0 || rlw_j.rlw.running_len > 0) {
+static void or_iterators(struct rlw_iterator *rlw_i,
+	struct rlw_iterator *rlw_j, struct ewah_bitmap *out)
+{
+	while (rlwit_word_size(rlw_i) > 0 && rlwit_word_size(rlw_j) > 0) {
+		while (rlw_i->rlw.running_len > 0 || rlw_j->rlw.running_len > 0) {
 			struct rlw_iterator *prey, *predator;
 
-			if (rlw_i.rlw.running_len < rlw_j.rlw.running_len) {
-				prey = &rlw_i;
-				predator = &rlw_j;
+			if (rlw_i->rlw.running_len < rlw_j->rlw.running_len) {
+				prey = rlw_i;
+				predator = rlw_j;
 			} else {
-				prey = &rlw_j;
-				predator = &rlw_i;
+				prey = rlw_j;
+				predator = rlw_i;
 			}
 
 
 			if (predator->rlw.running_bit) {
-				ewah_add_empty_words(out, false, predator->rlw.running_len);
+				ewah_add_empty_words(out, true, predator->rlw.running_len);
 				rlwit_discard_first_words(prey, predator->rlw.running_len);
 				rlwit_discard_first_words(predator, predator->rlw.running_len);
 			} else {
@@ -633,28 +1449,58 @@ void ewah_or(
 			} 
 		}
 
-		size_t literals = min_size(rlw_i.rlw.literal_words, rlw_j.rlw.literal_words);
+		size_t literals = min_size(rlw_i->rlw.literal_words, rlw_j->rlw.literal_words);
 
 		if (literals) {
-			size_t k;
+			ewah_add_literal_block(out,
+				rlw_i->buffer + rlw_i->literal_word_start,
+				rlw_j->buffer + rlw_j->literal_word_start,
+				literals, EWAH_LITERAL_OR);
 
-			for (k = 0; k < literals; ++k) {
-				ewah_add(out,
-					rlw_i.buffer[rlw_i.literal_word_start + k] |
-					rlw_j.buffer[rlw_j.literal_word_start + k]
-				);
-			}
-
-			rlwit_discard_first_words(&rlw_i, literals);
-			rlwit_discard_first_words(&rlw_j, literals);
+			rlwit_discard_first_words(rlw_i, literals);
+			rlwit_discard_first_words(rlw_j, literals);
 		}
 	}
 
-	if (rlwit_word_size(&rlw_i) > 0) {
-		rlwit_discharge(&rlw_i, out, ~0, false);
+	if (rlwit_word_size(rlw_i) > 0) {
+		rlwit_discharge(rlw_i, out, ~0, false);
 	} else {
-		rlwit_discharge(&rlw_j, out, ~0, false);
+		rlwit_discharge(rlw_j, out, ~0, false);
 	}
+}
+
+void ewah_or(
+	struct ewah_bitmap *bitmap_i,
+	struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out)
+{
+	struct rlw_iterator rlw_i;
+	struct rlw_iterator rlw_j;
+	struct ewah_bitmap *inputs[2] = { bitmap_i, bitmap_j };
 
+	ewah_reserve_result(out, inputs, 2, EWAH_LITERAL_OR);
+
+	rlwit_init(&rlw_i, bitmap_i);
+	rlwit_init(&rlw_j, bitmap_j);
+	or_iterators(&rlw_i, &rlw_j, out);
 	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
 }
+
+void rlwit_combine(struct rlw_iterator *rlw_i, struct rlw_iterator *rlw_j,
+	struct ewah_bitmap *out, enum ewah_literal_op op)
+{
+	switch (op) {
+	case EWAH_LITERAL_AND:
+		and_iterators(rlw_i, rlw_j, out);
+		break;
+	case EWAH_LITERAL_OR:
+		or_iterators(rlw_i, rlw_j, out);
+		break;
+	case EWAH_LITERAL_XOR:
+		xor_iterators(rlw_i, rlw_j, out);
+		break;
+	case EWAH_LITERAL_AND_NOT:
+		and_not_iterators(rlw_i, rlw_j, out);
+		break;
+	}
+}
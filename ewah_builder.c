@@ -0,0 +1,153 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Out-of-order builder.
+ *
+ * Positions land in an uncompressed window (a plain `struct bitmap`)
+ * that covers the words of the output from `base` onwards. Everything
+ * below the low-water mark is sealed: whole words below it are flushed
+ * into the compressed stream and the window slides forward. Positions
+ * past the end of the window slide it too, keeping half of it behind
+ * the new position as room for stragglers.
+ */
+
+#define BUILDER_DEFAULT_WINDOW (1 << 20)
+
+struct ewah_builder {
+	struct ewah_bitmap *out;
+
+	/* word 0 of the window is the uncompressed word `base` of `out` */
+	struct bitmap *window;
+	size_t base;
+	size_t window_words;
+
+	/* words at the start of the window that may have bits set */
+	size_t used;
+
+	size_t low_water;
+	size_t bit_size;
+};
+
+/* move the first `words` words of the window into the output */
+static void flush(struct ewah_builder *b, size_t words)
+{
+	eword_t *window = b->window->words;
+	size_t n = min_size(words, b->used);
+
+	ewah_add_words(b->out, window, n);
+	ewah_add_empty_words(b->out, false, words - n);
+
+	memmove(window, window + n, (b->used - n) * sizeof(eword_t));
+	memset(window + b->used - n, 0x0, n * sizeof(eword_t));
+
+	b->used -= n;
+	b->base += words;
+}
+
+struct ewah_builder *ewah_builder_new(struct ewah_bitmap *out, size_t window_bits)
+{
+	struct ewah_builder *b = ewah_malloc(sizeof(struct ewah_builder));
+	if (b == NULL)
+		return NULL;
+
+	b->window = bitmap_new_with_allocator(out->allocator);
+	if (b->window == NULL) {
+		ewah_dealloc(b);
+		return NULL;
+	}
+
+	if (window_bits == 0)
+		window_bits = BUILDER_DEFAULT_WINDOW;
+
+	b->out = out;
+	b->window_words = max_size(window_bits / BITS_IN_WORD, 2);
+	b->base = out->bit_size / BITS_IN_WORD;
+	b->used = 0;
+	b->low_water = out->bit_size;
+	b->bit_size = out->bit_size;
+
+	/* a partially filled last word is completed in the window */
+	if (out->bit_size % BITS_IN_WORD) {
+		b->window->words[0] = ewah_pop_word(out);
+		b->used = 1;
+	}
+
+	return b;
+}
+
+int ewah_builder_set(struct ewah_builder *b, size_t pos)
+{
+	size_t word;
+
+	if (pos < b->low_water) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	word = pos / BITS_IN_WORD;
+
+	if (word - b->base >= b->window_words) {
+		size_t base = word - b->window_words / 2;
+
+		flush(b, base - b->base);
+		b->low_water = max_size(b->low_water, base * BITS_IN_WORD);
+	}
+
+	bitmap_set(b->window, pos - b->base * BITS_IN_WORD);
+	b->used = max_size(b->used, word - b->base + 1);
+	b->bit_size = max_size(b->bit_size, pos + 1);
+	return 0;
+}
+
+void ewah_builder_seal(struct ewah_builder *b, size_t low_water)
+{
+	size_t sealed;
+
+	if (low_water <= b->low_water)
+		return;
+
+	b->low_water = low_water;
+
+	/* empty words past the last bit set are not flushed yet */
+	sealed = min_size(low_water, b->bit_size) / BITS_IN_WORD;
+
+	if (sealed > b->base)
+		flush(b, sealed - b->base);
+}
+
+void ewah_builder_finish(struct ewah_builder *b)
+{
+	const size_t words = (b->bit_size + BITS_IN_WORD - 1) / BITS_IN_WORD;
+
+	flush(b, words - b->base);
+	b->out->bit_size = b->bit_size;
+
+	bitmap_free(b->window);
+	ewah_dealloc(b);
+}
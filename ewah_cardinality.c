@@ -0,0 +1,211 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Effect that a run on one side of a binary operation has on the
+ * matching words of the other side.
+ */
+enum run_effect {
+	RUN_ZEROS,
+	RUN_ONES,
+	RUN_SAME,
+	RUN_NEGATE
+};
+
+static enum run_effect run_effect(
+	enum ewah_literal_op op, bool predator_is_i, bool running_bit)
+{
+	switch (op) {
+	case EWAH_LITERAL_AND:
+		return running_bit ? RUN_SAME : RUN_ZEROS;
+	case EWAH_LITERAL_OR:
+		return running_bit ? RUN_ONES : RUN_SAME;
+	case EWAH_LITERAL_XOR:
+		return running_bit ? RUN_NEGATE : RUN_SAME;
+	case EWAH_LITERAL_AND_NOT:
+		if (predator_is_i)
+			return running_bit ? RUN_NEGATE : RUN_ZEROS;
+		return running_bit ? RUN_ZEROS : RUN_SAME;
+	}
+
+	assert(!"unsupported operation");
+	return RUN_ZEROS;
+}
+
+/*
+ * Count the set bits in the next `max` words of the iterator, consuming
+ * them. Returns the count, and stores in `seen` how many words were
+ * actually available.
+ */
+static size_t rlwit_count(struct rlw_iterator *it, size_t max, size_t *seen)
+{
+	size_t index = 0, count = 0;
+
+	while (index < max && rlwit_word_size(it) > 0) {
+		size_t pd, pl = it->rlw.running_len;
+
+		if (index + pl > max) {
+			pl = max - index;
+		}
+
+		if (it->rlw.running_bit)
+			count += pl * BITS_IN_WORD;
+		index += pl;
+
+		pd = it->rlw.literal_words;
+		if (pd + index > max) {
+			pd = max - index;
+		}
+
+		count += ewah_popcount_words(it->buffer + it->literal_word_start, pd);
+
+		rlwit_discard_first_words(it, pd + pl);
+		index += pd;
+	}
+
+	*seen = index;
+	return count;
+}
+
+static size_t op_cardinality(
+	struct ewah_bitmap *bitmap_i,
+	struct ewah_bitmap *bitmap_j,
+	enum ewah_literal_op op)
+{
+	struct rlw_iterator rlw_i;
+	struct rlw_iterator rlw_j;
+	size_t count = 0, seen;
+
+	rlwit_init(&rlw_i, bitmap_i);
+	rlwit_init(&rlw_j, bitmap_j);
+
+	while (rlwit_word_size(&rlw_i) > 0 && rlwit_word_size(&rlw_j) > 0) {
+		while (rlw_i.rlw.running_len > 0 || rlw_j.rlw.running_len > 0) {
+			struct rlw_iterator *prey, *predator;
+			size_t len, ones;
+
+			if (rlw_i.rlw.running_len < rlw_j.rlw.running_len) {
+				prey = &rlw_i;
+				predator = &rlw_j;
+			} else {
+				prey = &rlw_j;
+				predator = &rlw_i;
+			}
+
+			len = predator->rlw.running_len;
+
+			switch (run_effect(op, predator == &rlw_i, predator->rlw.running_bit)) {
+			case RUN_ZEROS:
+				rlwit_discard_first_words(prey, len);
+				break;
+			case RUN_ONES:
+				count += len * BITS_IN_WORD;
+				rlwit_discard_first_words(prey, len);
+				break;
+			case RUN_SAME:
+				count += rlwit_count(prey, len, &seen);
+				break;
+			case RUN_NEGATE:
+				ones = rlwit_count(prey, len, &seen);
+				count += len * BITS_IN_WORD - ones;
+				break;
+			}
+
+			rlwit_discard_first_words(predator, len);
+		}
+
+		size_t literals = min_size(rlw_i.rlw.literal_words, rlw_j.rlw.literal_words);
+
+		if (literals) {
+			count += ewah_popcount_combined(
+				rlw_i.buffer + rlw_i.literal_word_start,
+				rlw_j.buffer + rlw_j.literal_word_start,
+				literals, op);
+
+			rlwit_discard_first_words(&rlw_i, literals);
+			rlwit_discard_first_words(&rlw_j, literals);
+		}
+	}
+
+	if (op == EWAH_LITERAL_AND)
+		return count;
+
+	if (rlwit_word_size(&rlw_i) > 0) {
+		count += rlwit_count(&rlw_i, ~(size_t)0, &seen);
+	} else if (op != EWAH_LITERAL_AND_NOT) {
+		count += rlwit_count(&rlw_j, ~(size_t)0, &seen);
+	}
+
+	return count;
+}
+
+size_t ewah_cardinality(struct ewah_bitmap *self)
+{
+	return self->cardinality;
+}
+
+bool ewah_first_bit(struct ewah_bitmap *self, size_t *pos)
+{
+	if (self->cardinality == 0)
+		return false;
+
+	*pos = self->first_bit;
+	return true;
+}
+
+bool ewah_last_bit(struct ewah_bitmap *self, size_t *pos)
+{
+	if (self->cardinality == 0)
+		return false;
+
+	*pos = self->last_bit;
+	return true;
+}
+
+size_t ewah_and_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j)
+{
+	return op_cardinality(bitmap_i, bitmap_j, EWAH_LITERAL_AND);
+}
+
+size_t ewah_or_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j)
+{
+	return op_cardinality(bitmap_i, bitmap_j, EWAH_LITERAL_OR);
+}
+
+size_t ewah_xor_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j)
+{
+	return op_cardinality(bitmap_i, bitmap_j, EWAH_LITERAL_XOR);
+}
+
+size_t ewah_and_not_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j)
+{
+	return op_cardinality(bitmap_i, bitmap_j, EWAH_LITERAL_AND_NOT);
+}
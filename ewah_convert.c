@@ -0,0 +1,167 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Conversion between word widths.
+ *
+ * The source stream is walked one RLW at a time. Its words are packed
+ * into (or split into) words of our own width and appended in blocks;
+ * a run is only cut where it does not start or end on a word boundary
+ * of the output, and the rest of it is appended as a single run.
+ */
+
+#define IMPORT_BLOCK_WORDS 256
+
+struct import {
+	struct ewah_bitmap *out;
+	unsigned src_bits;
+
+	/* partial output word, when the source words are narrower */
+	eword_t acc;
+	unsigned have;
+
+	eword_t block[IMPORT_BLOCK_WORDS];
+	size_t block_size;
+};
+
+static void flush_block(struct import *im)
+{
+	ewah_add_words(im->out, im->block, im->block_size);
+	im->block_size = 0;
+}
+
+static void push_word(struct import *im, eword_t word)
+{
+	if (im->block_size == IMPORT_BLOCK_WORDS)
+		flush_block(im);
+
+	im->block[im->block_size++] = word;
+}
+
+static void import_word(struct import *im, uint64_t word)
+{
+	unsigned k;
+
+	if (im->src_bits >= BITS_IN_WORD) {
+		for (k = 0; k < im->src_bits; k += BITS_IN_WORD)
+			push_word(im, (eword_t)(word >> k));
+		return;
+	}
+
+	im->acc |= (eword_t)word << im->have;
+	im->have += im->src_bits;
+
+	if (im->have == BITS_IN_WORD) {
+		push_word(im, im->acc);
+		im->acc = 0;
+		im->have = 0;
+	}
+}
+
+static void import_run(struct import *im, bool bit, size_t count)
+{
+	const uint64_t fill = bit ? ~(uint64_t)0 >> (64 - im->src_bits) : 0;
+	size_t whole;
+
+	/* complete the partial output word first */
+	while (count > 0 && im->have > 0) {
+		import_word(im, fill);
+		count--;
+	}
+
+	whole = count * im->src_bits / BITS_IN_WORD;
+
+	if (whole > 0) {
+		flush_block(im);
+		ewah_add_empty_words(im->out, bit, whole);
+		count -= whole * BITS_IN_WORD / im->src_bits;
+	}
+
+	while (count-- > 0)
+		import_word(im, fill);
+}
+
+static inline uint64_t src_word(const void *buffer, unsigned bits, size_t i)
+{
+	return bits == 32 ? ((const uint32_t *)buffer)[i] : ((const uint64_t *)buffer)[i];
+}
+
+int ewah_import(struct ewah_bitmap *self,
+	const void *buffer, size_t words, unsigned word_bits, size_t bit_size)
+{
+	struct import *im;
+	size_t pointer = 0;
+
+	if (word_bits != 32 && word_bits != 64) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	im = ewah_malloc(sizeof(struct import));
+	if (im == NULL)
+		return -1;
+
+	im->out = self;
+	im->src_bits = word_bits;
+	im->acc = 0;
+	im->have = 0;
+	im->block_size = 0;
+
+	ewah_clear(self);
+
+	while (pointer < words) {
+		const uint64_t rlw = src_word(buffer, word_bits, pointer);
+		const unsigned running_bits = word_bits / 2;
+		const size_t running_len = (rlw >> 1) & (((uint64_t)1 << running_bits) - 1);
+		const size_t literals = rlw >> (1 + running_bits);
+		size_t i;
+
+		if (literals > words - pointer - 1) {
+			ewah_dealloc(im);
+			ewah_clear(self);
+			errno = EINVAL;
+			return -1;
+		}
+
+		import_run(im, rlw & 1, running_len);
+
+		for (i = 0; i < literals; ++i)
+			import_word(im, src_word(buffer, word_bits, pointer + 1 + i));
+
+		pointer += 1 + literals;
+	}
+
+	/* the last source words did not fill an output word */
+	if (im->have > 0)
+		push_word(im, im->acc);
+
+	flush_block(im);
+	self->bit_size = bit_size;
+
+	ewah_dealloc(im);
+	return 0;
+}
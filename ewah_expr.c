@@ -0,0 +1,429 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Fused evaluation of expression trees.
+ *
+ * All the leaves are walked at the same time, and the uncompressed word
+ * space is cut into segments where no leaf changes state. The tree is then
+ * evaluated once per segment: each node yields either a run (of zeros or
+ * ones) or a block of literal words, so only the literal sections are ever
+ * combined word by word, and only the final result is written out.
+ *
+ * Runs carry the position where they end. When the root yields a run the
+ * whole of it is emitted at once and the leaves leapfrog to its end, so a
+ * subtree that is decided (e.g. the zeros of one side of an AND, whose
+ * other side is then not even evaluated) skips over everything below it.
+ */
+
+#define EXPR_CHUNK_WORDS 256
+
+enum expr_op {
+	EXPR_LEAF,
+	EXPR_NOT,
+	EXPR_AND,
+	EXPR_OR,
+	EXPR_XOR,
+	EXPR_AND_NOT
+};
+
+struct ewah_expr {
+	enum expr_op op;
+	struct ewah_expr *left, *right;
+
+	/* leaves only */
+	struct ewah_bitmap *bitmap;
+	struct rlw_iterator it;
+
+	/* internal nodes only: room for the literal words they produce */
+	eword_t *words;
+};
+
+enum value_kind {
+	VALUE_ZEROS,
+	VALUE_ONES,
+	VALUE_LITERAL
+};
+
+struct expr_value {
+	enum value_kind kind;
+
+	/* literal words for the segment being evaluated */
+	const eword_t *words;
+
+	/* for runs, the uncompressed word where the run ends */
+	size_t end;
+};
+
+static struct ewah_expr *expr_new(
+	enum expr_op op, struct ewah_expr *left, struct ewah_expr *right)
+{
+	struct ewah_expr *expr;
+
+	if (left == NULL || (op != EXPR_NOT && right == NULL)) {
+		ewah_expr_free(left);
+		ewah_expr_free(right);
+		return NULL;
+	}
+
+	expr = ewah_malloc(sizeof(struct ewah_expr));
+	if (expr == NULL) {
+		ewah_expr_free(left);
+		ewah_expr_free(right);
+		return NULL;
+	}
+
+	expr->op = op;
+	expr->left = left;
+	expr->right = right;
+	expr->bitmap = NULL;
+	expr->words = NULL;
+	return expr;
+}
+
+struct ewah_expr *ewah_expr_leaf(struct ewah_bitmap *bitmap)
+{
+	struct ewah_expr *expr = ewah_malloc(sizeof(struct ewah_expr));
+	if (expr == NULL)
+		return NULL;
+
+	expr->op = EXPR_LEAF;
+	expr->left = NULL;
+	expr->right = NULL;
+	expr->bitmap = bitmap;
+	expr->words = NULL;
+	return expr;
+}
+
+struct ewah_expr *ewah_expr_not(struct ewah_expr *expr)
+{
+	return expr_new(EXPR_NOT, expr, NULL);
+}
+
+struct ewah_expr *ewah_expr_and(struct ewah_expr *left, struct ewah_expr *right)
+{
+	return expr_new(EXPR_AND, left, right);
+}
+
+struct ewah_expr *ewah_expr_or(struct ewah_expr *left, struct ewah_expr *right)
+{
+	return expr_new(EXPR_OR, left, right);
+}
+
+struct ewah_expr *ewah_expr_xor(struct ewah_expr *left, struct ewah_expr *right)
+{
+	return expr_new(EXPR_XOR, left, right);
+}
+
+struct ewah_expr *ewah_expr_and_not(struct ewah_expr *left, struct ewah_expr *right)
+{
+	return expr_new(EXPR_AND_NOT, left, right);
+}
+
+void ewah_expr_free(struct ewah_expr *expr)
+{
+	if (expr == NULL)
+		return;
+
+	ewah_expr_free(expr->left);
+	ewah_expr_free(expr->right);
+	ewah_dealloc(expr);
+}
+
+/* number of uncompressed words in the bitmap */
+static size_t word_count(struct ewah_bitmap *bitmap)
+{
+	size_t pointer = 0, words = 0;
+
+	while (pointer < bitmap->buffer_size) {
+		words += rlw_size(bitmap->buffer + pointer);
+		pointer += 1 + rlw_get_literal_words(bitmap->buffer + pointer);
+	}
+
+	return words;
+}
+
+/* position where the current run or literal block of a leaf ends */
+static inline size_t leaf_end(struct ewah_expr *leaf)
+{
+	struct rlw_iterator *it = &leaf->it;
+
+	if (it->rlw.running_len > 0)
+		return it->position + it->rlw.running_len;
+
+	return it->position + it->rlw.literal_words;
+}
+
+static void collect(struct ewah_expr *expr,
+	struct ewah_expr **leaves, size_t *leaf_count, size_t *node_count)
+{
+	if (expr->op == EXPR_LEAF) {
+		leaves[(*leaf_count)++] = expr;
+		return;
+	}
+
+	(*node_count)++;
+	collect(expr->left, leaves, leaf_count, node_count);
+	if (expr->right)
+		collect(expr->right, leaves, leaf_count, node_count);
+}
+
+static size_t count_leaves(struct ewah_expr *expr)
+{
+	if (expr->op == EXPR_LEAF)
+		return 1;
+
+	return count_leaves(expr->left) +
+		(expr->right ? count_leaves(expr->right) : 0);
+}
+
+static void assign_words(struct ewah_expr *expr, eword_t **words)
+{
+	if (expr->op == EXPR_LEAF)
+		return;
+
+	expr->words = *words;
+	*words += EXPR_CHUNK_WORDS;
+
+	assign_words(expr->left, words);
+	if (expr->right)
+		assign_words(expr->right, words);
+}
+
+static inline struct expr_value run_value(bool ones, size_t end)
+{
+	struct expr_value v = { ones ? VALUE_ONES : VALUE_ZEROS, NULL, end };
+	return v;
+}
+
+static inline struct expr_value literal_value(const eword_t *words)
+{
+	struct expr_value v = { VALUE_LITERAL, words, 0 };
+	return v;
+}
+
+static struct expr_value negate(
+	struct ewah_expr *expr, struct expr_value v, size_t len)
+{
+	size_t k;
+
+	if (v.kind != VALUE_LITERAL)
+		return run_value(v.kind == VALUE_ZEROS, v.end);
+
+	for (k = 0; k < len; ++k)
+		expr->words[k] = ~v.words[k];
+
+	return literal_value(expr->words);
+}
+
+/* the value of a run combined with anything is one of these two */
+static inline struct expr_value pass(struct expr_value v, struct expr_value run)
+{
+	if (v.kind != VALUE_LITERAL)
+		v.end = min_size(v.end, run.end);
+	return v;
+}
+
+static struct expr_value combine(
+	struct ewah_expr *expr, struct expr_value a, struct expr_value b,
+	size_t len, enum ewah_literal_op op)
+{
+	ewah_combine_words(expr->words, a.words, b.words, len, op);
+	return literal_value(expr->words);
+}
+
+/*
+ * Value of the expression over the `len` words starting at `pos`, none
+ * of which cross a change of state of any leaf. Children whose value
+ * cannot change the result are not evaluated.
+ */
+static struct expr_value evaluate(
+	struct ewah_expr *expr, size_t pos, size_t len, size_t total)
+{
+	struct expr_value a, b;
+
+	switch (expr->op) {
+	case EXPR_LEAF: {
+		struct rlw_iterator *it = &expr->it;
+
+		if (rlwit_word_size(it) == 0)
+			return run_value(false, total);
+
+		if (it->rlw.running_len > 0)
+			return run_value(it->rlw.running_bit, leaf_end(expr));
+
+		return literal_value(
+			it->buffer + it->literal_word_start + (pos - it->position));
+	}
+
+	case EXPR_NOT:
+		return negate(expr, evaluate(expr->left, pos, len, total), len);
+
+	case EXPR_AND:
+		a = evaluate(expr->left, pos, len, total);
+		if (a.kind == VALUE_ZEROS)
+			return a;
+
+		b = evaluate(expr->right, pos, len, total);
+		if (b.kind == VALUE_ZEROS)
+			return b;
+		if (a.kind == VALUE_ONES)
+			return pass(b, a);
+		if (b.kind == VALUE_ONES)
+			return pass(a, b);
+
+		return combine(expr, a, b, len, EWAH_LITERAL_AND);
+
+	case EXPR_OR:
+		a = evaluate(expr->left, pos, len, total);
+		if (a.kind == VALUE_ONES)
+			return a;
+
+		b = evaluate(expr->right, pos, len, total);
+		if (b.kind == VALUE_ONES)
+			return b;
+		if (a.kind == VALUE_ZEROS)
+			return pass(b, a);
+		if (b.kind == VALUE_ZEROS)
+			return pass(a, b);
+
+		return combine(expr, a, b, len, EWAH_LITERAL_OR);
+
+	case EXPR_XOR:
+		a = evaluate(expr->left, pos, len, total);
+		b = evaluate(expr->right, pos, len, total);
+
+		if (a.kind != VALUE_LITERAL && b.kind != VALUE_LITERAL)
+			return run_value(a.kind != b.kind, min_size(a.end, b.end));
+		if (a.kind == VALUE_ZEROS)
+			return b;
+		if (b.kind == VALUE_ZEROS)
+			return a;
+		if (a.kind == VALUE_ONES)
+			return negate(expr, b, len);
+		if (b.kind == VALUE_ONES)
+			return negate(expr, a, len);
+
+		return combine(expr, a, b, len, EWAH_LITERAL_XOR);
+
+	case EXPR_AND_NOT:
+		a = evaluate(expr->left, pos, len, total);
+		if (a.kind == VALUE_ZEROS)
+			return a;
+
+		b = evaluate(expr->right, pos, len, total);
+		if (b.kind == VALUE_ONES)
+			return run_value(false, b.end);
+		if (b.kind == VALUE_ZEROS)
+			return pass(a, b);
+		if (a.kind == VALUE_ONES)
+			return negate(expr, b, len);
+
+		return combine(expr, a, b, len, EWAH_LITERAL_AND_NOT);
+	}
+
+	assert(!"unsupported expression");
+	return run_value(false, total);
+}
+
+int ewah_expr_eval(struct ewah_expr *expr, struct ewah_bitmap *out)
+{
+	struct ewah_expr **leaves;
+	eword_t *words, *next, padding = 0;
+	size_t leaf_count = 0, node_count = 0;
+	size_t i, pos = 0, total = 0, bit_size = 0;
+
+	leaves = ewah_malloc(count_leaves(expr) * sizeof(struct ewah_expr *));
+	if (leaves == NULL)
+		return -1;
+
+	collect(expr, leaves, &leaf_count, &node_count);
+
+	words = ewah_malloc((node_count + 1) * EXPR_CHUNK_WORDS * sizeof(eword_t));
+	if (words == NULL) {
+		ewah_dealloc(leaves);
+		return -1;
+	}
+
+	next = words;
+	assign_words(expr, &next);
+
+	for (i = 0; i < leaf_count; ++i) {
+		struct ewah_bitmap *bitmap = leaves[i]->bitmap;
+
+		rlwit_init(&leaves[i]->it, bitmap);
+		total = max_size(total, word_count(bitmap));
+		bit_size = max_size(bit_size, bitmap->bit_size);
+	}
+
+	if (bit_size % BITS_IN_WORD)
+		padding = ~(((eword_t)1 << (bit_size % BITS_IN_WORD)) - 1);
+
+	while (pos < total) {
+		struct expr_value v;
+		size_t cut = total;
+
+		for (i = 0; i < leaf_count; ++i) {
+			if (rlwit_word_size(&leaves[i]->it) > 0)
+				cut = min_size(cut, leaf_end(leaves[i]));
+		}
+
+		v = evaluate(expr, pos, min_size(cut - pos, EXPR_CHUNK_WORDS), total);
+
+		/* a negation must not set the padding above `bit_size` */
+		if (v.kind == VALUE_LITERAL) {
+			size_t len = min_size(cut - pos, EXPR_CHUNK_WORDS);
+			bool tail = padding && pos + len == total;
+
+			ewah_add_words(out, v.words, len - tail);
+			if (tail)
+				ewah_add(out, v.words[len - 1] & ~padding);
+			pos += len;
+		} else {
+			size_t end = min_size(v.end, total);
+			bool tail = padding && v.kind == VALUE_ONES && end == total;
+
+			ewah_add_empty_words(out, v.kind == VALUE_ONES, end - pos - tail);
+			if (tail)
+				ewah_add(out, ~padding);
+			pos = end;
+		}
+
+		for (i = 0; i < leaf_count; ++i) {
+			struct rlw_iterator *it = &leaves[i]->it;
+
+			if (rlwit_word_size(it) > 0 && leaf_end(leaves[i]) <= pos)
+				rlwit_advance_to(it, pos);
+		}
+	}
+
+	out->bit_size = bit_size;
+
+	ewah_dealloc(words);
+	ewah_dealloc(leaves);
+	return 0;
+}
@@ -0,0 +1,379 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Sampled skip index.
+ *
+ * Every `stride`-th RLW of the bitmap is recorded together with the
+ * uncompressed word where it starts. A lookup binary-searches the
+ * samples and then walks at most `stride` RLW headers, so random access
+ * costs O(log n + stride) instead of a scan from the start.
+ *
+ * Bitmaps only ever grow at the end, and only the last RLW (the one
+ * `bitmap->rlw` points to) can still change its size, so the samples
+ * stay valid as the bitmap grows: the index simply keeps scanning from
+ * where it stopped, up to (but not past) the last RLW.
+ *
+ * A ranked index also records how many bits are set before every
+ * sample, which is what `ewah_rank` and `ewah_select` need to find their
+ * starting point. Building it costs a popcount of every literal word, so
+ * plain random access does not pay for it.
+ */
+
+static struct ewah_index *index_new(size_t stride, bool ranked)
+{
+	struct ewah_index *index = ewah_malloc(sizeof(struct ewah_index));
+
+	if (index == NULL)
+		return NULL;
+
+	index->stride = stride ? stride : EWAH_INDEX_DEFAULT_STRIDE;
+	index->ranked = ranked;
+	index->samples = NULL;
+	index->alloc = 0;
+
+	ewah_index_reset(index);
+	return index;
+}
+
+void ewah_index_reset(struct ewah_index *index)
+{
+	index->count = 0;
+	index->scan_offset = 0;
+	index->scan_words = 0;
+	index->scan_rlws = 0;
+	index->scan_bits = 0;
+}
+
+void ewah_index_free(struct ewah_index *index)
+{
+	if (index == NULL)
+		return;
+
+	ewah_dealloc(index->samples);
+	ewah_dealloc(index);
+}
+
+static int index_push(struct ewah_index *index,
+	size_t buffer_offset, size_t word_offset, size_t bit_offset)
+{
+	if (index->count >= index->alloc) {
+		size_t alloc = index->alloc ? index->alloc * 2 : 16;
+		struct ewah_index_sample *samples = ewah_realloc(
+			index->samples, alloc * sizeof(struct ewah_index_sample));
+
+		if (samples == NULL)
+			return -1;
+
+		index->samples = samples;
+		index->alloc = alloc;
+	}
+
+	index->samples[index->count].buffer_offset = buffer_offset;
+	index->samples[index->count].word_offset = word_offset;
+	index->samples[index->count].bit_offset = bit_offset;
+	index->count++;
+	return 0;
+}
+
+static int index_extend(struct ewah_bitmap *self)
+{
+	struct ewah_index *index = self->index;
+	const size_t last = self->rlw - self->buffer;
+
+	while (index->scan_offset < last) {
+		const eword_t *word = &self->buffer[index->scan_offset];
+
+		if (index->scan_rlws % index->stride == 0 &&
+			index_push(index, index->scan_offset,
+				index->scan_words, index->scan_bits) < 0)
+			return -1;
+
+		if (index->ranked) {
+			if (rlw_get_run_bit(word))
+				index->scan_bits += rlw_get_running_len(word) * BITS_IN_WORD;
+
+			index->scan_bits += ewah_popcount_words(word + 1,
+				rlw_get_literal_words(word));
+		}
+
+		index->scan_rlws++;
+		index->scan_words += rlw_size(word);
+		index->scan_offset += 1 + rlw_get_literal_words(word);
+	}
+
+	return 0;
+}
+
+static int index_build(struct ewah_bitmap *self, size_t stride, bool ranked)
+{
+	struct ewah_index *index = self->index;
+
+	/* shared words come with their index, which other threads read */
+	if (self->shared) {
+		if (index && (!stride || stride == index->stride) &&
+			(!ranked || index->ranked))
+			return 0;
+
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (index == NULL || (stride && stride != index->stride) ||
+		(ranked && !index->ranked)) {
+		if (!stride && index)
+			stride = index->stride;
+
+		ranked = ranked || (index && index->ranked);
+
+		ewah_index_free(index);
+
+		self->index = index_new(stride, ranked);
+		if (self->index == NULL)
+			return -1;
+	}
+
+	return index_extend(self);
+}
+
+int ewah_build_index(struct ewah_bitmap *self, size_t stride)
+{
+	return index_build(self, stride, false);
+}
+
+int ewah_build_rank_index(struct ewah_bitmap *self, size_t stride)
+{
+	return index_build(self, stride, true);
+}
+
+void ewah_index_seek(const struct ewah_bitmap *self, size_t word_pos,
+	size_t *buffer_offset, size_t *word_offset)
+{
+	const struct ewah_index *index = self->index;
+	size_t lo = 0, hi;
+
+	*buffer_offset = 0;
+	*word_offset = 0;
+
+	if (index == NULL || index->count == 0)
+		return;
+
+	/* last sample starting at or before `word_pos` */
+	hi = index->count;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (index->samples[mid].word_offset <= word_pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	/* skip the sampled prefix of the scan when it is closer */
+	if (index->scan_offset > index->samples[lo].buffer_offset &&
+		index->scan_words <= word_pos) {
+		*buffer_offset = index->scan_offset;
+		*word_offset = index->scan_words;
+		return;
+	}
+
+	*buffer_offset = index->samples[lo].buffer_offset;
+	*word_offset = index->samples[lo].word_offset;
+}
+
+bool ewah_get(struct ewah_bitmap *self, size_t pos)
+{
+	const size_t word_pos = pos / BITS_IN_WORD;
+	size_t pointer, words;
+
+	if (pos >= self->bit_size)
+		return false;
+
+	/* the index is built on first use; without memory, just scan */
+	ewah_build_index(self, 0);
+	ewah_index_seek(self, word_pos, &pointer, &words);
+
+	while (pointer < self->buffer_size) {
+		const eword_t *word = &self->buffer[pointer];
+		const size_t run = rlw_get_running_len(word);
+		const size_t literals = rlw_get_literal_words(word);
+
+		if (word_pos < words + run)
+			return rlw_get_run_bit(word);
+
+		words += run;
+
+		if (word_pos < words + literals) {
+			eword_t literal = word[1 + word_pos - words];
+			return (literal >> (pos % BITS_IN_WORD)) & 1;
+		}
+
+		words += literals;
+		pointer += 1 + literals;
+	}
+
+	return false;
+}
+
+/*
+ * Like `ewah_index_seek`, but for a ranked index: finds the closest RLW
+ * that starts at or before the uncompressed word `key` (or, with
+ * `by_bits`, before the set bit with rank `key`), and the number of set
+ * bits before it.
+ */
+static void rank_seek(const struct ewah_bitmap *self, size_t key, bool by_bits,
+	size_t *buffer_offset, size_t *word_offset, size_t *bit_offset)
+{
+	const struct ewah_index *index = self->index;
+	size_t lo = 0, hi;
+
+	*buffer_offset = 0;
+	*word_offset = 0;
+	*bit_offset = 0;
+
+	if (index == NULL || !index->ranked || index->count == 0)
+		return;
+
+	hi = index->count;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct ewah_index_sample *sample = &index->samples[mid];
+
+		if ((by_bits ? sample->bit_offset : sample->word_offset) <= key)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (index->scan_offset > index->samples[lo].buffer_offset &&
+		(by_bits ? index->scan_bits : index->scan_words) <= key) {
+		*buffer_offset = index->scan_offset;
+		*word_offset = index->scan_words;
+		*bit_offset = index->scan_bits;
+		return;
+	}
+
+	*buffer_offset = index->samples[lo].buffer_offset;
+	*word_offset = index->samples[lo].word_offset;
+	*bit_offset = index->samples[lo].bit_offset;
+}
+
+size_t ewah_rank(struct ewah_bitmap *self, size_t pos)
+{
+	const size_t word_pos = pos / BITS_IN_WORD;
+	size_t pointer, words, bits;
+
+	/* without memory for the index, count from the start */
+	ewah_build_rank_index(self, 0);
+	rank_seek(self, word_pos, false, &pointer, &words, &bits);
+
+	while (pointer < self->buffer_size) {
+		const eword_t *word = &self->buffer[pointer];
+		const size_t run = rlw_get_running_len(word);
+		const size_t literals = rlw_get_literal_words(word);
+
+		if (word_pos < words + run) {
+			if (rlw_get_run_bit(word))
+				bits += (word_pos - words) * BITS_IN_WORD + pos % BITS_IN_WORD;
+			return bits;
+		}
+
+		if (rlw_get_run_bit(word))
+			bits += run * BITS_IN_WORD;
+		words += run;
+
+		if (word_pos < words + literals) {
+			const eword_t *literal = word + 1 + (word_pos - words);
+			const eword_t mask = ((eword_t)1 << (pos % BITS_IN_WORD)) - 1;
+			const eword_t partial = *literal & mask;
+
+			bits += ewah_popcount_words(word + 1, word_pos - words);
+			return bits + ewah_popcount_words(&partial, 1);
+		}
+
+		bits += ewah_popcount_words(word + 1, literals);
+		words += literals;
+		pointer += 1 + literals;
+	}
+
+	return bits;
+}
+
+#define SELECT_BLOCK_WORDS 64
+
+bool ewah_select(struct ewah_bitmap *self, size_t k, size_t *pos)
+{
+	size_t pointer, words, bits;
+
+	ewah_build_rank_index(self, 0);
+	rank_seek(self, k, true, &pointer, &words, &bits);
+
+	while (pointer < self->buffer_size) {
+		const eword_t *word = &self->buffer[pointer];
+		const size_t run = rlw_get_running_len(word);
+		size_t literals = rlw_get_literal_words(word);
+		const eword_t *literal = word + 1;
+
+		if (rlw_get_run_bit(word)) {
+			if (k < bits + run * BITS_IN_WORD) {
+				*pos = words * BITS_IN_WORD + (k - bits);
+				return true;
+			}
+			bits += run * BITS_IN_WORD;
+		}
+		words += run;
+
+		/* whole blocks first, then single words */
+		while (literals > 0) {
+			const size_t n = min_size(literals, SELECT_BLOCK_WORDS);
+			const size_t count = ewah_popcount_words(literal, n);
+
+			if (k < bits + count) {
+				for (;; ++literal, ++words) {
+					const size_t c = ewah_popcount_words(literal, 1);
+
+					if (k < bits + c)
+						break;
+					bits += c;
+				}
+
+				*pos = words * BITS_IN_WORD + ewah_select_bit(*literal, k - bits);
+				return true;
+			}
+
+			bits += count;
+			words += n;
+			literal += n;
+			literals -= n;
+		}
+
+		pointer = literal - self->buffer;
+	}
+
+	return false;
+}
@@ -17,10 +17,14 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 
 #include "ewok.h"
+#include "ewok_rlw.h"
 
 #if defined(__linux__)
 #  include <endian.h>
@@ -33,31 +37,188 @@
 #  define be64toh(x) betoh64(x)
 #endif
 
+#if EWOK_WORD_BITS == 32
+#	define htobe_word(x) htobe32(x)
+#	define betoh_word(x) be32toh(x)
+#	define bswap_word(x) __builtin_bswap32(x)
+#else
+#	define htobe_word(x) htobe64(x)
+#	define betoh_word(x) be64toh(x)
+#	define bswap_word(x) __builtin_bswap64(x)
+#endif
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *data = buf;
+
+	while (len > 0) {
+		ssize_t r = read(fd, data, len);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		if (r <= 0) {
+			if (r == 0)
+				errno = EIO;
+			return -1;
+		}
+
+		data += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+	const uint8_t *data = buf;
+
+	while (len > 0) {
+		ssize_t w = pwrite(fd, data, len, offset);
+
+		if (w < 0 && errno == EINTR)
+			continue;
+
+		if (w <= 0)
+			return -1;
+
+		data += w;
+		len -= w;
+		offset += w;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+
+	while (len > 0) {
+		ssize_t w = write(fd, data, len);
+
+		if (w < 0 && errno == EINTR)
+			continue;
+
+		if (w <= 0)
+			return -1;
+
+		data += w;
+		len -= w;
+	}
+
+	return 0;
+}
+
+/*
+ * CRC32C (Castagnoli), as computed by the SSE4.2 CRC32 instruction. The
+ * table-driven version is only used on CPUs without it.
+ */
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	if (crc32c_table[1] == 0) {
+		uint32_t n, k;
+
+		for (n = 0; n < 256; ++n) {
+			uint32_t c = n;
+			for (k = 0; k < 8; ++k)
+				c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+			crc32c_table[n] = c;
+		}
+	}
+
+	for (i = 0; i < len; ++i)
+		crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+static __attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	while (len >= 8) {
+		uint64_t chunk;
+
+		memcpy(&chunk, data, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, chunk);
+
+		data += 8;
+		len -= 8;
+	}
+
+	crc = (uint32_t)crc64;
+
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *data++);
+
+	return crc;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	static int has_sse42 = -1;
+
+	if (has_sse42 < 0) {
+		__builtin_cpu_init();
+		has_sse42 = __builtin_cpu_supports("sse4.2");
+	}
+
+	if (has_sse42)
+		return crc32c_hw(crc, data, len);
+#endif
+	return crc32c_sw(crc, data, len);
+}
+
+/*
+ * Version 1 format: 32-bit fields and words, all in big endian.
+ *
+ * | bit_size | word_count | words... | rlw_position |
+ *      4           4        8 x N          4
+ *
+ * The words are 4 bytes each in the 32-bit variant: this format has no
+ * room to record the word width.
+ */
 int ewah_serialize(struct ewah_bitmap *self, int fd)
 {
 	size_t i;
 	eword_t dump[2048];
 	const size_t words_per_dump = sizeof(dump) / sizeof(eword_t);
 
+	/* the 32 bit fields can't describe this bitmap */
+	if (self->bit_size > UINT32_MAX || self->buffer_size > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
 	/* 32 bit -- bit size fr the map */
 	uint32_t bitsize =  htobe32((uint32_t)self->bit_size);
-	if (write(fd, &bitsize, 4) != 4)
+	if (write_full(fd, &bitsize, 4) < 0)
 		return -1;
 
-	/** 32 bit -- number of compressed 64-bit words */
+	/** 32 bit -- number of compressed words */
 	uint32_t word_count =  htobe32((uint32_t)self->buffer_size);
-	if (write(fd, &word_count, 4) != 4)
+	if (write_full(fd, &word_count, 4) < 0)
 		return -1;
 
-	/** 64 bit x N -- compressed words */
+	/** 64 (or 32) bit x N -- compressed words */
 	const eword_t *buffer = self->buffer;
 	size_t words_left = self->buffer_size;
 
 	while (words_left >= words_per_dump) {
 		for (i = 0; i < words_per_dump; ++i, ++buffer)
-			dump[i] = htobe64(*buffer);
+			dump[i] = htobe_word(*buffer);
 
-		if (write(fd, dump, sizeof(dump)) != sizeof(dump))
+		if (write_full(fd, dump, sizeof(dump)) < 0)
 			return -1;
 
 		words_left -= words_per_dump;
@@ -65,9 +226,9 @@ int ewah_serialize(struct ewah_bitmap *self, int fd)
 
 	if (words_left) {
 		for (i = 0; i < words_left; ++i, ++buffer)
-			dump[i] = htobe64(*buffer);
+			dump[i] = htobe_word(*buffer);
 
-		if (write(fd, dump, words_left * 8) != words_left * 8)
+		if (write_full(fd, dump, words_left * sizeof(eword_t)) < 0)
 			return -1;
 	}
 
@@ -75,64 +236,1269 @@ int ewah_serialize(struct ewah_bitmap *self, int fd)
 	uint32_t rlw_pos = (uint8_t*)self->rlw - (uint8_t *)self->buffer;
 	rlw_pos = htobe32(rlw_pos / sizeof(eword_t));
 
-	if (write(fd, &rlw_pos, 4) != 4)
+	if (write_full(fd, &rlw_pos, 4) < 0)
 		return -1;
 
 	return 0;
 }
 
-int ewah_deserialize(struct ewah_bitmap *self, int fd)
+/*
+ * Bit count and first and last bit of a bitmap, stored after the header
+ * of version 2 files written with `EWAH_V2_STATS`.
+ */
+struct ewah_v2_stats {
+	uint64_t cardinality;
+	uint64_t first_bit;
+	uint64_t last_bit;
+};
+
+static bool valid_v2_stats(const struct ewah_v2_stats *stats)
+{
+	if (stats->cardinality == 0)
+		return true;
+
+	return stats->first_bit <= stats->last_bit &&
+		stats->last_bit <= SIZE_MAX &&
+		stats->cardinality - 1 <= stats->last_bit - stats->first_bit;
+}
+
+/*
+ * Replace the words of the bitmap with `word_count` words read in full
+ * into `buffer`, once nothing can fail anymore: a bitmap that could not
+ * be loaded is left as it was. The bit count is taken from `stats` if
+ * the file had them, or recomputed.
+ */
+static void load_words(struct ewah_bitmap *self, eword_t *buffer,
+	size_t word_count, size_t rlw_pos, size_t bit_size,
+	const struct ewah_v2_stats *stats)
+{
+	/* the words may belong to clones, or to the mapping of a view */
+	ewah_release_words(self);
+
+	self->buffer = buffer;
+	self->buffer_size = word_count;
+	self->alloc_size = word_count;
+	self->bit_size = bit_size;
+	self->rlw = self->buffer + rlw_pos;
+
+	if (stats) {
+		self->cardinality = stats->cardinality;
+		self->first_bit = stats->first_bit;
+		self->last_bit = stats->last_bit;
+	} else {
+		ewah_recount(self);
+	}
+
+	if (self->index)
+		ewah_index_reset(self->index);
+}
+
+static int deserialize_v1(struct ewah_bitmap *self, int fd, uint32_t bitsize)
 {
 	size_t i;
-	eword_t dump[2048];
-	const size_t words_per_dump = sizeof(dump) / sizeof(eword_t);
 
-	/* 32 bit -- bit size fr the map */
-	uint32_t bitsize;
-	if (read(fd, &bitsize, 4) != 4)
+	/** 32 bit -- number of compressed words */
+	uint32_t word_count;
+	if (read_full(fd, &word_count, 4) < 0)
 		return -1;
 
-	self->bit_size = (size_t)be32toh(bitsize);
+	const size_t words = be32toh(word_count);
+	if (words == 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	/** 32 bit -- number of compressed 64-bit words */
-	uint32_t word_count;
-	if (read(fd, &word_count, 4) != 4)
+	/** 64 (or 32) bit x N -- compressed words; byte-swapped in place */
+	eword_t *buffer = ewah_alloc_mem(self->allocator, words * sizeof(eword_t));
+	if (!buffer)
 		return -1;
 
-	self->buffer_size = (size_t)be32toh(word_count);
-	self->buffer = ewah_realloc(self->buffer, self->buffer_size * sizeof(eword_t));
+	/** 32 bit -- position for the RLW */
+	uint32_t rlw_pos;
+	if (read_full(fd, buffer, words * sizeof(eword_t)) < 0 ||
+		read_full(fd, &rlw_pos, 4) < 0) {
+		ewah_release_mem(self->allocator, buffer);
+		return -1;
+	}
 
-	if (!self->buffer)
+	if (be32toh(rlw_pos) >= words) {
+		ewah_release_mem(self->allocator, buffer);
+		errno = EINVAL;
 		return -1;
+	}
 
-	/** 64 bit x N -- compressed words */
-	eword_t *buffer = self->buffer;
-	size_t words_left = self->buffer_size;
+	for (i = 0; i < words; ++i)
+		buffer[i] = betoh_word(buffer[i]);
 
-	while (words_left >= words_per_dump) {
-		if (read(fd, dump, sizeof(dump)) != sizeof(dump))
+	load_words(self, buffer, words, be32toh(rlw_pos), be32toh(bitsize), NULL);
+	return 0;
+}
+
+/*
+ * Version 2 format. A fixed 32-byte header is followed by the bit count
+ * of the bitmap, the compressed words and, optionally, a CRC32C of
+ * everything before it:
+ *
+ * | magic | version | flags | 0 | bit_size | word_count | rlw_pos | stats | words... | crc32c |
+ *    4        1        1     2      8           8           8        24     8 x N       4
+ *
+ * The stats (number of bits set, first and last bit set, as 64-bit
+ * values) are only present if their flag is set; files written before
+ * they were added load as well, and have their bits counted on load.
+ *
+ * Multi-byte fields and words are stored in the byte order of the host
+ * that wrote the file, as recorded in the flags, so loading on the same
+ * kind of host never byte-swaps, and the words can even be used in
+ * place from a memory mapping (see `ewah_view`).
+ *
+ * The magic is stored byte by byte; its first byte is 0xFF so it can not
+ * be mistaken for the big-endian 32-bit bit count that starts a version
+ * 1 file, unless that bitmap was right at the 2^32 bit limit.
+ *
+ * Words are 8 bytes, or 4 bytes when the word width flag is set (files
+ * written by the 32-bit variant). Each variant loads the files of the
+ * other one by converting the words with `ewah_import`.
+ */
+static const uint8_t ewah_v2_magic[4] = { 0xFF, 'E', 'W', 'K' };
+
+#define EWAH_V2_VERSION 2
+#define EWAH_V2_BIG_ENDIAN (1 << 0)
+#define EWAH_V2_WORD32 (1 << 2)
+#define EWAH_V2_STATS (1 << 3)
+#define EWAH_V2_KNOWN_FLAGS \
+	(EWAH_V2_BIG_ENDIAN | EWAH_V2_CHECKSUM | EWAH_V2_WORD32 | EWAH_V2_STATS)
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#	define EWAH_V2_HOST_ORDER EWAH_V2_BIG_ENDIAN
+#else
+#	define EWAH_V2_HOST_ORDER 0
+#endif
+
+#if EWOK_WORD_BITS == 32
+#	define EWAH_V2_HOST_WIDTH EWAH_V2_WORD32
+#else
+#	define EWAH_V2_HOST_WIDTH 0
+#endif
+
+struct ewah_v2_header {
+	uint8_t magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint16_t reserved;
+	uint64_t bit_size;
+	uint64_t word_count;
+	uint64_t rlw_pos;
+};
+
+int ewah_serialize_v2(struct ewah_bitmap *self, int fd, int flags)
+{
+	struct ewah_v2_header header;
+	struct ewah_v2_stats stats;
+	uint32_t crc = ~0;
+
+	memset(&header, 0x0, sizeof(header));
+	memcpy(header.magic, ewah_v2_magic, sizeof(header.magic));
+	header.version = EWAH_V2_VERSION;
+	header.flags = (flags & EWAH_V2_CHECKSUM) |
+		EWAH_V2_HOST_ORDER | EWAH_V2_HOST_WIDTH | EWAH_V2_STATS;
+	header.bit_size = self->bit_size;
+	header.word_count = self->buffer_size;
+	header.rlw_pos = self->rlw - self->buffer;
+
+	stats.cardinality = self->cardinality;
+	stats.first_bit = self->first_bit;
+	stats.last_bit = self->last_bit;
+
+	if (write_full(fd, &header, sizeof(header)) < 0 ||
+		write_full(fd, &stats, sizeof(stats)) < 0)
+		return -1;
+
+	if (write_full(fd, self->buffer, self->buffer_size * sizeof(eword_t)) < 0)
+		return -1;
+
+	if (flags & EWAH_V2_CHECKSUM) {
+		crc = crc32c(crc, &header, sizeof(header));
+		crc = crc32c(crc, &stats, sizeof(stats));
+		crc = ~crc32c(crc, self->buffer, self->buffer_size * sizeof(eword_t));
+
+		if (write_full(fd, &crc, sizeof(crc)) < 0)
 			return -1;
+	}
 
-		for (i = 0; i < words_per_dump; ++i, ++buffer)
-			*buffer = be64toh(dump[i]);
+	return 0;
+}
 
-		words_left -= words_per_dump;
+static bool valid_v2_header(const struct ewah_v2_header *header)
+{
+	return !memcmp(header->magic, ewah_v2_magic, sizeof(header->magic)) &&
+		header->version == EWAH_V2_VERSION &&
+		(header->flags & ~EWAH_V2_KNOWN_FLAGS) == 0;
+}
+
+/*
+ * Read the words of a version 2 file and its checksum, if any, and
+ * byte-swap the words and the stats to the order of the host.
+ */
+static int read_v2_words(int fd, const struct ewah_v2_header *header,
+	struct ewah_v2_stats *stats, void *buffer, size_t words,
+	size_t word_bytes, bool swap)
+{
+	size_t i;
+
+	if (read_full(fd, buffer, words * word_bytes) < 0)
+		return -1;
+
+	if (header->flags & EWAH_V2_CHECKSUM) {
+		uint32_t crc = ~0, expected;
+
+		if (read_full(fd, &expected, sizeof(expected)) < 0)
+			return -1;
+
+		crc = crc32c(crc, header, sizeof(*header));
+		if (header->flags & EWAH_V2_STATS)
+			crc = crc32c(crc, stats, sizeof(*stats));
+		crc = ~crc32c(crc, buffer, words * word_bytes);
+
+		if (crc != (swap ? __builtin_bswap32(expected) : expected)) {
+			errno = EBADMSG;
+			return -1;
+		}
 	}
 
-	if (words_left) {
-		if (read(fd, dump, words_left * 8) != words_left * 8)
+	if (swap) {
+		stats->cardinality = __builtin_bswap64(stats->cardinality);
+		stats->first_bit = __builtin_bswap64(stats->first_bit);
+		stats->last_bit = __builtin_bswap64(stats->last_bit);
+	}
+
+	if (swap && word_bytes == 4) {
+		uint32_t *w = buffer;
+		for (i = 0; i < words; ++i)
+			w[i] = __builtin_bswap32(w[i]);
+	} else if (swap) {
+		uint64_t *w = buffer;
+		for (i = 0; i < words; ++i)
+			w[i] = __builtin_bswap64(w[i]);
+	}
+
+	return 0;
+}
+
+static int deserialize_v2(struct ewah_bitmap *self, int fd)
+{
+	struct ewah_v2_header header;
+	struct ewah_v2_stats stats;
+	size_t word_bytes;
+	bool swap;
+	struct ewah_bitmap *imported;
+	void *foreign;
+	int r;
+
+	/* the magic has already been consumed by `ewah_deserialize` */
+	memcpy(header.magic, ewah_v2_magic, sizeof(header.magic));
+
+	if (read_full(fd, &header.version, sizeof(header) - sizeof(header.magic)) < 0)
+		return -1;
+
+	if (!valid_v2_header(&header)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&stats, 0x0, sizeof(stats));
+
+	if ((header.flags & EWAH_V2_STATS) &&
+		read_full(fd, &stats, sizeof(stats)) < 0)
+		return -1;
+
+	swap = (header.flags & EWAH_V2_BIG_ENDIAN) != EWAH_V2_HOST_ORDER;
+	word_bytes = (header.flags & EWAH_V2_WORD32) ? 4 : 8;
+
+	const uint64_t bit_size = swap ? __builtin_bswap64(header.bit_size) : header.bit_size;
+	const uint64_t words = swap ? __builtin_bswap64(header.word_count) : header.word_count;
+	const uint64_t rlw_pos = swap ? __builtin_bswap64(header.rlw_pos) : header.rlw_pos;
+
+	if (words > SIZE_MAX / sizeof(uint64_t) || bit_size > SIZE_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	if (words == 0 || rlw_pos >= words) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((header.flags & EWAH_V2_WORD32) == EWAH_V2_HOST_WIDTH) {
+		eword_t *buffer = ewah_alloc_mem(self->allocator, words * sizeof(eword_t));
+		if (!buffer)
 			return -1;
 
-		for (i = 0; i < words_left; ++i, ++buffer)
-			*buffer = be64toh(dump[i]);
+		if (read_v2_words(fd, &header, &stats, buffer, words, word_bytes, swap) < 0) {
+			ewah_release_mem(self->allocator, buffer);
+			return -1;
+		}
+
+		if ((header.flags & EWAH_V2_STATS) && !valid_v2_stats(&stats)) {
+			ewah_release_mem(self->allocator, buffer);
+			errno = EINVAL;
+			return -1;
+		}
+
+		load_words(self, buffer, words, rlw_pos, bit_size,
+			(header.flags & EWAH_V2_STATS) ? &stats : NULL);
+		return 0;
 	}
 
-	/** 32 bit -- position for the RLW */
-	uint32_t rlw_pos;
-	if (read(fd, &rlw_pos, 4) != 4)
+	/* written by the variant with the other word width: convert */
+	foreign = ewah_malloc(words * word_bytes);
+	if (!foreign)
+		return -1;
+
+	imported = ewah_new_with_allocator(self->allocator);
+	if (!imported) {
+		ewah_dealloc(foreign);
+		return -1;
+	}
+
+	/* import on the side, so malformed words leave the bitmap alone */
+	r = read_v2_words(fd, &header, &stats, foreign, words, word_bytes, swap);
+	if (r == 0)
+		r = ewah_import(imported, foreign, words, word_bytes * 8, bit_size);
+
+	ewah_dealloc(foreign);
+
+	if (r < 0) {
+		ewah_free(imported);
+		return -1;
+	}
+
+	/* the stats still hold, but the import counted the bits anyway */
+	stats.cardinality = imported->cardinality;
+	stats.first_bit = imported->first_bit;
+	stats.last_bit = imported->last_bit;
+
+	load_words(self, imported->buffer, imported->buffer_size,
+		imported->rlw - imported->buffer, bit_size, &stats);
+	self->alloc_size = imported->alloc_size;
+
+	ewah_release_mem(self->allocator, imported);
+	return 0;
+}
+
+int ewah_deserialize(struct ewah_bitmap *self, int fd)
+{
+	union {
+		uint8_t magic[4];
+		uint32_t bitsize;
+	} start;
+
+	if (read_full(fd, &start, 4) < 0)
 		return -1;
 
-	self->rlw = self->buffer + be32toh(rlw_pos);
+	if (!memcmp(start.magic, ewah_v2_magic, sizeof(start.magic)))
+		return deserialize_v2(self, fd);
+
+	/* 32 bit -- bit size fr the map */
+	return deserialize_v1(self, fd, start.bitsize);
+}
+
+struct ewah_bitmap *ewah_view(const void *map, size_t len)
+{
+	const struct ewah_v2_header *header = map;
+	const struct ewah_v2_stats *stats = NULL;
+	struct ewah_bitmap *self;
+	size_t offset = sizeof(*header);
+
+	if (len < sizeof(*header) || ((uintptr_t)map % sizeof(eword_t)) != 0)
+		return NULL;
+
+	if (!valid_v2_header(header) ||
+		(header->flags & EWAH_V2_BIG_ENDIAN) != EWAH_V2_HOST_ORDER ||
+		(header->flags & EWAH_V2_WORD32) != EWAH_V2_HOST_WIDTH)
+		return NULL;
+
+	if (header->flags & EWAH_V2_STATS) {
+		stats = (const struct ewah_v2_stats *)(header + 1);
+		offset += sizeof(*stats);
+
+		if (len < offset || !valid_v2_stats(stats))
+			return NULL;
+	}
+
+	if (header->word_count == 0 ||
+		header->word_count > (len - offset) / sizeof(eword_t) ||
+		header->rlw_pos >= header->word_count)
+		return NULL;
+
+	self = ewah_malloc(sizeof(struct ewah_bitmap));
+	if (self == NULL)
+		return NULL;
+
+	self->buffer = (eword_t *)((const uint8_t *)map + offset);
+	self->buffer_size = header->word_count;
+	self->alloc_size = 0;
+	self->bit_size = header->bit_size;
+	self->rlw = self->buffer + header->rlw_pos;
+	self->index = NULL;
+	self->allocator = NULL;
+	self->sink = NULL;
+	self->canonical = false;
+	self->shared = NULL;
+
+	/* files without stats cost a walk over the words */
+	if (stats) {
+		self->cardinality = stats->cardinality;
+		self->first_bit = stats->first_bit;
+		self->last_bit = stats->last_bit;
+	} else {
+		ewah_recount(self);
+	}
+
+	return self;
+}
+
+/*
+ * Streaming reader. The words are read into a buffer of fixed size, and
+ * handed to an `rlw_iterator` once they make whole RLW groups; the words
+ * of an incomplete group stay in the buffer until the rest of the group
+ * arrives. A group that does not fit in the buffer is cut: its header is
+ * rewritten to cover the literal words at hand, and a header with no run
+ * is made up for the rest of them on the next refill.
+ */
+#define READER_DEFAULT_WORDS 4096
+
+struct ewah_reader {
+	ewah_read_fn read;
+	void *data;
+	int fd;
+
+	bool v2;
+	bool swap;
+	uint8_t flags;
+	size_t bit_size;
+	uint32_t crc;
+
+	/* bytes of compressed words not read yet */
+	uint64_t bytes_left;
+
+	eword_t *buffer;
+	size_t alloc;
+
+	/* whole words in the buffer, and bytes of an incomplete one after them */
+	size_t size;
+	size_t partial;
+
+	/* words of whole groups at the start of the buffer */
+	size_t ready;
+
+	/* literal words left of a group that was cut */
+	size_t pending;
+
+	bool started;
+	bool done;
+	int error;
+	struct rlw_iterator it;
+
+	/* file position, for readers that use pread */
+	off_t offset;
+	off_t ahead;
+};
+
+static ssize_t read_fd(void *data, void *buf, size_t len)
+{
+	return read(*(int *)data, buf, len);
+}
+
+#define READAHEAD_BYTES (1 << 20)
+
+static ssize_t read_at(void *data, void *buf, size_t len)
+{
+	struct ewah_reader *r = data;
+	ssize_t n;
+
+#ifdef POSIX_FADV_WILLNEED
+	/* ask for the next stretch of the file before it is needed */
+	if (r->offset + (off_t)len > r->ahead) {
+		posix_fadvise(r->fd, r->offset, READAHEAD_BYTES, POSIX_FADV_WILLNEED);
+		r->ahead = r->offset + READAHEAD_BYTES;
+	}
+#endif
+
+	n = pread(r->fd, buf, len, r->offset);
+	if (n > 0)
+		r->offset += n;
+
+	return n;
+}
+
+/*
+ * Read between `min` and `len` bytes, retrying short reads until at
+ * least `min` have arrived.
+ */
+static ssize_t reader_read(struct ewah_reader *r, void *buf, size_t min, size_t len)
+{
+	uint8_t *data = buf;
+	size_t got = 0;
+
+	while (got < min) {
+		ssize_t n = r->read(r->data, data + got, len - got);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+
+		got += n;
+	}
+
+	return got;
+}
+
+static int reader_fail(struct ewah_reader *r, int error)
+{
+	r->error = error;
+	return -1;
+}
+
+/* read more words into the buffer, at least enough to finish one */
+static int reader_fill(struct ewah_reader *r)
+{
+	uint8_t *dst = (uint8_t *)(r->buffer + r->size);
+	size_t room = (r->alloc - r->size) * sizeof(eword_t) - r->partial;
+	size_t min = sizeof(eword_t) - r->partial;
+	size_t i, words;
+	ssize_t got;
+
+	if (room > r->bytes_left)
+		room = r->bytes_left;
+
+	got = reader_read(r, dst + r->partial, min, room);
+	if (got < 0)
+		return reader_fail(r, errno);
+
+	r->bytes_left -= got;
+	r->partial += got;
+
+	words = r->partial / sizeof(eword_t);
+
+	if (r->flags & EWAH_V2_CHECKSUM)
+		r->crc = crc32c(r->crc, dst, words * sizeof(eword_t));
+
+	for (i = r->size; i < r->size + words; ++i) {
+		if (!r->v2)
+			r->buffer[i] = betoh_word(r->buffer[i]);
+		else if (r->swap)
+			r->buffer[i] = bswap_word(r->buffer[i]);
+	}
+
+	r->size += words;
+	r->partial -= words * sizeof(eword_t);
+	return 0;
+}
+
+/* hand out the whole groups at the start of the buffer */
+static int reader_parse(struct ewah_reader *r)
+{
+	while (r->ready < r->size) {
+		eword_t *rlw = r->buffer + r->ready;
+		const size_t literals = rlw_get_literal_words(rlw);
+		const size_t avail = r->size - r->ready - 1;
+
+		if (literals <= avail) {
+			r->ready += 1 + literals;
+			continue;
+		}
+
+		/* the stream ends in the middle of the group */
+		if (r->bytes_left == 0)
+			return reader_fail(r, EINVAL);
+
+		if (r->ready == 0 && avail > 0) {
+			rlw_set_literal_words(rlw, avail);
+			r->pending = literals - avail;
+			r->ready = r->size;
+		}
+
+		break;
+	}
+
+	return 0;
+}
+
+/* the position of the RLW, or the checksum, after the words */
+static int reader_finish(struct ewah_reader *r)
+{
+	uint32_t trailer;
+
+	r->done = true;
+
+	if (!r->v2 || (r->flags & EWAH_V2_CHECKSUM)) {
+		if (reader_read(r, &trailer, sizeof(trailer), sizeof(trailer)) < 0)
+			return reader_fail(r, errno);
+	}
+
+	if (r->flags & EWAH_V2_CHECKSUM) {
+		if (r->swap)
+			trailer = __builtin_bswap32(trailer);
+
+		if (~r->crc != trailer)
+			return reader_fail(r, EBADMSG);
+	}
+
+	return 0;
+}
+
+bool rlwit_refill(struct rlw_iterator *it)
+{
+	struct ewah_reader *r = it->source;
+	const size_t head = r->pending ? 1 : 0;
+	const size_t tail = r->size - r->ready;
+
+	if (r->error || r->done)
+		return false;
+
+	memmove(r->buffer + head, r->buffer + r->ready,
+		tail * sizeof(eword_t) + r->partial);
+
+	if (r->pending) {
+		r->buffer[0] = 0;
+		rlw_set_literal_words(r->buffer, r->pending);
+		r->pending = 0;
+	}
+
+	r->size = head + tail;
+	r->ready = 0;
+
+	while (1) {
+		if (reader_parse(r) < 0)
+			return false;
+
+		if (r->ready > 0)
+			break;
+
+		if (r->bytes_left == 0) {
+			reader_finish(r);
+			return false;
+		}
+
+		if (reader_fill(r) < 0)
+			return false;
+	}
+
+	it->buffer = r->buffer;
+	it->size = r->ready;
+	it->pointer = 0;
+	return true;
+}
+
+static struct ewah_reader *reader_new(size_t buffer_words)
+{
+	struct ewah_reader *r;
+
+	r = ewah_calloc(1, sizeof(struct ewah_reader));
+	if (r == NULL)
+		return NULL;
+
+	r->alloc = max_size(buffer_words ? buffer_words : READER_DEFAULT_WORDS, 2);
+	r->buffer = ewah_malloc(r->alloc * sizeof(eword_t));
+
+	if (r->buffer == NULL) {
+		ewah_dealloc(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static int reader_open(struct ewah_reader *r)
+{
+	struct ewah_v2_header header;
+	uint64_t words;
+
+	if (reader_read(r, header.magic, sizeof(header.magic), sizeof(header.magic)) < 0)
+		return -1;
+
+	if (!memcmp(header.magic, ewah_v2_magic, sizeof(header.magic))) {
+		const size_t rest = sizeof(header) - sizeof(header.magic);
+		struct ewah_v2_stats stats;
+
+		if (reader_read(r, &header.version, rest, rest) < 0)
+			return -1;
+
+		if (!valid_v2_header(&header) ||
+			(header.flags & EWAH_V2_WORD32) != EWAH_V2_HOST_WIDTH) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		r->v2 = true;
+		r->flags = header.flags;
+		r->swap = (header.flags & EWAH_V2_BIG_ENDIAN) != EWAH_V2_HOST_ORDER;
+		r->crc = crc32c(~0, &header, sizeof(header));
+
+		/* the stats are not needed to stream the words */
+		if (header.flags & EWAH_V2_STATS) {
+			if (reader_read(r, &stats, sizeof(stats), sizeof(stats)) < 0)
+				return -1;
+
+			r->crc = crc32c(r->crc, &stats, sizeof(stats));
+		}
+
+		words = r->swap ? __builtin_bswap64(header.word_count) : header.word_count;
+		header.bit_size = r->swap ? __builtin_bswap64(header.bit_size) : header.bit_size;
+
+		if (words > SIZE_MAX / sizeof(uint64_t) || header.bit_size > SIZE_MAX) {
+			errno = EOVERFLOW;
+			return -1;
+		}
+
+		r->bit_size = header.bit_size;
+	} else {
+		uint32_t bitsize, word_count;
+
+		memcpy(&bitsize, header.magic, sizeof(bitsize));
+
+		if (reader_read(r, &word_count, sizeof(word_count), sizeof(word_count)) < 0)
+			return -1;
+
+		r->bit_size = be32toh(bitsize);
+		words = be32toh(word_count);
+	}
+
+	if (words == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->bytes_left = words * sizeof(eword_t);
+	return 0;
+}
+
+struct ewah_reader *ewah_reader_new_cb(
+	ewah_read_fn fn, void *data, size_t buffer_words)
+{
+	struct ewah_reader *r = reader_new(buffer_words);
+
+	if (r == NULL)
+		return NULL;
+
+	r->read = fn;
+	r->data = data;
+
+	if (reader_open(r) < 0) {
+		ewah_reader_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+struct ewah_reader *ewah_reader_new(int fd, size_t buffer_words)
+{
+	struct ewah_reader *r = reader_new(buffer_words);
+
+	if (r == NULL)
+		return NULL;
+
+	r->fd = fd;
+	r->read = &read_fd;
+	r->data = &r->fd;
+
+	if (reader_open(r) < 0) {
+		ewah_reader_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/*
+ * Reader for the bitmap at the current position of `fd`, that reads it
+ * with pread (and readahead hints) if the file is seekable.
+ */
+static struct ewah_reader *reader_new_at(int fd)
+{
+	struct ewah_reader *r;
+	off_t offset = lseek(fd, 0, SEEK_CUR);
+
+	if (offset < 0)
+		return ewah_reader_new(fd, 0);
+
+	r = reader_new(0);
+	if (r == NULL)
+		return NULL;
+
+	r->fd = fd;
+	r->read = &read_at;
+	r->data = r;
+	r->offset = offset;
+	r->ahead = offset;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if (reader_open(r) < 0) {
+		ewah_reader_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void ewah_reader_free(struct ewah_reader *reader)
+{
+	if (reader == NULL)
+		return;
+
+	ewah_dealloc(reader->buffer);
+	ewah_dealloc(reader);
+}
+
+size_t ewah_reader_bit_size(struct ewah_reader *reader)
+{
+	return reader->bit_size;
+}
+
+static void reader_start(struct ewah_reader *r)
+{
+	if (!r->started) {
+		rlwit_init_reader(&r->it, r);
+		r->started = true;
+	}
+}
+
+/*
+ * Once the iterator is past the last word, read what is left of the
+ * stream (empty groups, the trailer) so the checksum gets verified.
+ */
+static int reader_status(struct ewah_reader *r)
+{
+	if (rlwit_word_size(&r->it) == 0) {
+		while (rlwit_refill(&r->it))
+			;
+	}
+
+	if (r->error) {
+		errno = r->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t ewah_reader_load(
+	struct ewah_reader *reader, struct ewah_bitmap *out, size_t words)
+{
+	size_t loaded;
+
+	reader_start(reader);
+	loaded = rlwit_discharge(&reader->it, out, words, false);
+
+	if (reader_status(reader) < 0)
+		return -1;
+
+	if (reader->done)
+		out->bit_size = reader->bit_size;
+
+	return loaded;
+}
+
+static int reader_combine(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out, enum ewah_literal_op op)
+{
+	struct rlw_iterator it;
+
+	if (reader->started) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	reader_start(reader);
+	rlwit_init(&it, bitmap);
+	rlwit_combine(&reader->it, &it, out, op);
+
+	out->bit_size = max_size(reader->bit_size, bitmap->bit_size);
+	return reader_status(reader);
+}
+
+int ewah_reader_and(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out)
+{
+	return reader_combine(reader, bitmap, out, EWAH_LITERAL_AND);
+}
+
+int ewah_reader_or(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out)
+{
+	return reader_combine(reader, bitmap, out, EWAH_LITERAL_OR);
+}
+
+int ewah_reader_xor(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out)
+{
+	return reader_combine(reader, bitmap, out, EWAH_LITERAL_XOR);
+}
+
+int ewah_reader_and_not(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out)
+{
+	return reader_combine(reader, bitmap, out, EWAH_LITERAL_AND_NOT);
+}
+
+/*
+ * Out-of-core operations: both inputs are streamed, and the result is
+ * written out as it is produced, in the version 2 format. The header
+ * goes in last, when the size of the result is known, so the output
+ * must be seekable.
+ */
+struct file_sink {
+	struct ewah_sink sink;
+	int fd;
+	off_t start;
+	int error;
+};
+
+static void sink_write(struct ewah_sink *sink, const eword_t *words, size_t n)
+{
+	struct file_sink *out = (struct file_sink *)sink;
+	const off_t offset = out->start + (off_t)(sink->flushed * sizeof(eword_t));
+
+	if (!out->error && pwrite_full(out->fd, words, n * sizeof(eword_t), offset) < 0)
+		out->error = errno;
+}
+
+/* checksum of the words written to the file, read back in blocks */
+static int file_crc(int fd, off_t offset, size_t words, uint32_t *crc)
+{
+	eword_t block[1024];
+
+	while (words > 0) {
+		const size_t n = min_size(words, sizeof(block) / sizeof(eword_t));
+		ssize_t got = pread(fd, block, n * sizeof(eword_t), offset);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+
+		if (got != (ssize_t)(n * sizeof(eword_t))) {
+			if (got >= 0)
+				errno = EIO;
+			return -1;
+		}
+
+		*crc = crc32c(*crc, block, got);
+		offset += got;
+		words -= n;
+	}
+
+	return 0;
+}
+
+static int combine_files(int fd_i, int fd_j, int out_fd, int flags,
+	enum ewah_literal_op op)
+{
+	struct ewah_reader *reader_i = NULL, *reader_j = NULL;
+	struct ewah_bitmap *out = NULL;
+	struct ewah_v2_header header;
+	struct ewah_v2_stats stats;
+	struct file_sink sink;
+	uint32_t crc = ~0;
+	size_t rlw_pos;
+	off_t base, end;
+	int r = -1;
+
+	base = lseek(out_fd, 0, SEEK_CUR);
+	if (base < 0)
+		return -1;
+
+	reader_i = reader_new_at(fd_i);
+	reader_j = reader_i ? reader_new_at(fd_j) : NULL;
+	out = reader_j ? ewah_new() : NULL;
+
+	if (out == NULL)
+		goto done;
+
+	sink.sink.flush = &sink_write;
+	sink.sink.flushed = 0;
+	sink.fd = out_fd;
+	sink.start = base + sizeof(header) + sizeof(stats);
+	sink.error = 0;
+	out->sink = &sink.sink;
+
+	reader_start(reader_i);
+	reader_start(reader_j);
+	rlwit_combine(&reader_i->it, &reader_j->it, out, op);
+
+	if (reader_status(reader_i) < 0 || reader_status(reader_j) < 0)
+		goto done;
+
+	rlw_pos = sink.sink.flushed + (out->rlw - out->buffer);
+	ewah_sink_finish(out);
+
+	if (sink.error) {
+		errno = sink.error;
+		goto done;
+	}
+
+	memset(&header, 0x0, sizeof(header));
+	memcpy(header.magic, ewah_v2_magic, sizeof(header.magic));
+	header.version = EWAH_V2_VERSION;
+	header.flags = (flags & EWAH_V2_CHECKSUM) |
+		EWAH_V2_HOST_ORDER | EWAH_V2_HOST_WIDTH | EWAH_V2_STATS;
+	header.bit_size = max_size(reader_i->bit_size, reader_j->bit_size);
+	header.word_count = sink.sink.flushed;
+	header.rlw_pos = rlw_pos;
+
+	stats.cardinality = out->cardinality;
+	stats.first_bit = out->first_bit;
+	stats.last_bit = out->last_bit;
+
+	if (pwrite_full(out_fd, &header, sizeof(header), base) < 0 ||
+		pwrite_full(out_fd, &stats, sizeof(stats), base + sizeof(header)) < 0)
+		goto done;
+
+	end = sink.start + (off_t)(sink.sink.flushed * sizeof(eword_t));
+
+	if (flags & EWAH_V2_CHECKSUM) {
+		crc = crc32c(crc, &header, sizeof(header));
+		crc = crc32c(crc, &stats, sizeof(stats));
+
+		if (file_crc(out_fd, sink.start, sink.sink.flushed, &crc) < 0)
+			goto done;
+
+		crc = ~crc;
+		if (pwrite_full(out_fd, &crc, sizeof(crc), end) < 0)
+			goto done;
+
+		end += sizeof(crc);
+	}
+
+	/* leave the file offset after the bitmap, like `ewah_serialize_v2` */
+	if (lseek(out_fd, end, SEEK_SET) >= 0)
+		r = 0;
+
+done:
+	if (out) {
+		out->sink = NULL;
+		ewah_free(out);
+	}
+
+	ewah_reader_free(reader_i);
+	ewah_reader_free(reader_j);
+	return r;
+}
+
+int ewah_and_files(int fd_i, int fd_j, int out_fd, int flags)
+{
+	return combine_files(fd_i, fd_j, out_fd, flags, EWAH_LITERAL_AND);
+}
+
+int ewah_or_files(int fd_i, int fd_j, int out_fd, int flags)
+{
+	return combine_files(fd_i, fd_j, out_fd, flags, EWAH_LITERAL_OR);
+}
+
+int ewah_xor_files(int fd_i, int fd_j, int out_fd, int flags)
+{
+	return combine_files(fd_i, fd_j, out_fd, flags, EWAH_LITERAL_XOR);
+}
+
+int ewah_and_not_files(int fd_i, int fd_j, int out_fd, int flags)
+{
+	return combine_files(fd_i, fd_j, out_fd, flags, EWAH_LITERAL_AND_NOT);
+}
+
+/*
+ * Skip index format, in the byte order of the host that wrote it:
+ *
+ * | magic | version | flags | 0 | stride | count | scan_offset | scan_words | scan_rlws | scan_bits | samples... |
+ *    4        1        1     2     8        8          8             8            8           8      24 x N
+ *
+ * Each sample is the buffer offset of an RLW, the uncompressed word
+ * where it starts and the number of set bits before it, as three 64-bit
+ * values. The bit counts are only meaningful if the ranked flag is set.
+ *
+ * Version 1 indexes had neither the ranked flag nor the bit counts (no
+ * `scan_bits`, and 16-byte samples); they are still accepted.
+ */
+static const uint8_t ewah_index_magic[4] = { 0xFF, 'E', 'W', 'I' };
+
+#define EWAH_INDEX_VERSION 2
+#define EWAH_INDEX_RANKED (1 << 1)
+
+struct ewah_index_header {
+	uint8_t magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint16_t reserved;
+	uint64_t stride;
+	uint64_t count;
+	uint64_t scan_offset;
+	uint64_t scan_words;
+	uint64_t scan_rlws;
+	uint64_t scan_bits;
+};
+
+/* size of the header of a version 1 index */
+#define EWAH_INDEX_V1_HEADER offsetof(struct ewah_index_header, scan_bits)
+
+int ewah_serialize_index(struct ewah_bitmap *self, int fd)
+{
+	struct ewah_index_header header;
+	const struct ewah_index *index;
+	uint64_t dump[512];
+	size_t i, n = 0;
+
+	if (ewah_build_index(self, 0) < 0)
+		return -1;
+
+	index = self->index;
+
+	memset(&header, 0x0, sizeof(header));
+	memcpy(header.magic, ewah_index_magic, sizeof(header.magic));
+	header.version = EWAH_INDEX_VERSION;
+	header.flags = EWAH_V2_HOST_ORDER | (index->ranked ? EWAH_INDEX_RANKED : 0);
+	header.stride = index->stride;
+	header.count = index->count;
+	header.scan_offset = index->scan_offset;
+	header.scan_words = index->scan_words;
+	header.scan_rlws = index->scan_rlws;
+	header.scan_bits = index->scan_bits;
+
+	if (write_full(fd, &header, sizeof(header)) < 0)
+		return -1;
+
+	for (i = 0; i < index->count; ++i) {
+		dump[n++] = index->samples[i].buffer_offset;
+		dump[n++] = index->samples[i].word_offset;
+		dump[n++] = index->samples[i].bit_offset;
+
+		if (n + 3 > sizeof(dump) / sizeof(dump[0]) || i + 1 == index->count) {
+			if (write_full(fd, dump, n * sizeof(dump[0])) < 0)
+				return -1;
+			n = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a loaded index was built for the words of the bitmap: the
+ * samples must sit on the RLWs the index would have sampled, one every
+ * `stride`, and the scan must stop on an RLW. The bit counts cannot be
+ * checked without a popcount of every literal word, but they only
+ * affect where lookups start, not which words they read.
+ */
+static bool index_matches(
+	const struct ewah_bitmap *self, const struct ewah_index *index)
+{
+	size_t pointer = 0, words = 0, rlws = 0, i = 0;
+
+	while (pointer < index->scan_offset) {
+		const eword_t *word = &self->buffer[pointer];
+
+		if (rlws % index->stride == 0) {
+			if (i >= index->count ||
+				index->samples[i].buffer_offset != pointer ||
+				index->samples[i].word_offset != words)
+				return false;
+			i++;
+		}
+
+		rlws++;
+		words += rlw_size(word);
+		pointer += 1 + rlw_get_literal_words(word);
+	}
+
+	return pointer == index->scan_offset && i == index->count &&
+		words == index->scan_words && rlws == index->scan_rlws;
+}
+
+int ewah_deserialize_index(struct ewah_bitmap *self, int fd)
+{
+	struct ewah_index_header header;
+	struct ewah_index *index;
+	size_t i, sample_words;
+
+	/* the index of shared words is shared with them, and read-only */
+	if (self->shared) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (read_full(fd, &header, EWAH_INDEX_V1_HEADER) < 0)
+		return -1;
+
+	header.scan_bits = 0;
+
+	if (header.version == EWAH_INDEX_VERSION &&
+		read_full(fd, &header.scan_bits, sizeof(header.scan_bits)) < 0)
+		return -1;
+
+	sample_words = (header.version == 1) ? 2 : 3;
+
+	if (memcmp(header.magic, ewah_index_magic, sizeof(header.magic)) ||
+		(header.version != 1 && header.version != EWAH_INDEX_VERSION) ||
+		(header.flags & ~EWAH_INDEX_RANKED) != EWAH_V2_HOST_ORDER ||
+		(header.version == 1 && header.flags != EWAH_V2_HOST_ORDER) ||
+		header.stride == 0 ||
+		header.scan_offset > (size_t)(self->rlw - self->buffer) ||
+		header.count > header.scan_rlws ||
+		header.count > header.scan_offset + 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	index = ewah_malloc(sizeof(struct ewah_index));
+	if (index == NULL)
+		return -1;
+
+	index->stride = header.stride;
+	index->ranked = (header.flags & EWAH_INDEX_RANKED) != 0;
+	index->count = index->alloc = header.count;
+	index->scan_offset = header.scan_offset;
+	index->scan_words = header.scan_words;
+	index->scan_rlws = header.scan_rlws;
+	index->scan_bits = header.scan_bits;
+	index->samples = ewah_malloc(
+		(header.count ? header.count : 1) * sizeof(struct ewah_index_sample));
+
+	if (index->samples == NULL) {
+		ewah_dealloc(index);
+		return -1;
+	}
+
+	for (i = 0; i < index->count; ++i) {
+		uint64_t sample[3] = { 0, 0, 0 };
+
+		if (read_full(fd, sample, sample_words * sizeof(uint64_t)) < 0) {
+			ewah_index_free(index);
+			return -1;
+		}
+
+		if (sample[0] > header.scan_offset) {
+			ewah_index_free(index);
+			errno = EINVAL;
+			return -1;
+		}
+
+		index->samples[i].buffer_offset = sample[0];
+		index->samples[i].word_offset = sample[1];
+		index->samples[i].bit_offset = sample[2];
+	}
+
+	if (!index_matches(self, index)) {
+		ewah_index_free(index);
+		errno = EINVAL;
+		return -1;
+	}
 
+	ewah_index_free(self->index);
+	self->index = index;
 	return 0;
 }
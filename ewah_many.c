@@ -0,0 +1,318 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * N-way logical operations.
+ *
+ * All the inputs are walked at the same time, each one through its own
+ * `rlw_iterator`. The uncompressed word space is cut into segments: a
+ * segment ends whenever any of the inputs changes state (a run ends, or
+ * a block of literal words ends). The inputs are kept in a min-heap keyed
+ * by the position where their current state ends, so finding the next cut
+ * is O(1) and only the inputs that actually change state are touched.
+ *
+ * Inputs are synchronized lazily: an input sitting inside a long run, or
+ * an input whose literals are not needed because the segment is already
+ * decided (e.g. a run of ones in an OR), is not moved until its own state
+ * ends.
+ *
+ * Decided segments are also stretched as far as the deciding run goes
+ * (the longest run of ones in an OR, of zeros in an AND), and the inputs
+ * it covers leapfrog to its end with `rlwit_advance_to`, so they skip the
+ * RLW groups in between instead of being cut at every one of them.
+ */
+
+#define MANY_CHUNK_WORDS 256
+
+struct many_input {
+	struct rlw_iterator it;
+
+	/* position where the current run or literal block ends */
+	size_t end;
+
+	/* index in the literal set, or -1 if the input is in a run */
+	ssize_t literal_slot;
+};
+
+struct many_state {
+	struct many_input **heap;
+	size_t heap_size;
+
+	struct many_input **literals;
+	size_t literal_count;
+
+	size_t ones;
+	size_t zeros;
+
+	/* furthest end of any run of ones (resp. zeros) entered so far */
+	size_t ones_end;
+	size_t zeros_end;
+};
+
+static inline bool heap_less(struct many_input *a, struct many_input *b)
+{
+	return a->end < b->end;
+}
+
+static void heap_sift_down(struct many_state *st, size_t i)
+{
+	struct many_input **heap = st->heap;
+
+	while (1) {
+		size_t l = 2 * i + 1, r = l + 1, m = i;
+		struct many_input *tmp;
+
+		if (l < st->heap_size && heap_less(heap[l], heap[m]))
+			m = l;
+		if (r < st->heap_size && heap_less(heap[r], heap[m]))
+			m = r;
+
+		if (m == i)
+			return;
+
+		tmp = heap[i];
+		heap[i] = heap[m];
+		heap[m] = tmp;
+		i = m;
+	}
+}
+
+static void heap_pop(struct many_state *st)
+{
+	st->heap[0] = st->heap[--st->heap_size];
+	heap_sift_down(st, 0);
+}
+
+static void enter_state(struct many_state *st, struct many_input *in)
+{
+	if (in->it.rlw.running_len > 0) {
+		in->end = in->it.position + in->it.rlw.running_len;
+		in->literal_slot = -1;
+
+		if (in->it.rlw.running_bit) {
+			st->ones++;
+			st->ones_end = max_size(st->ones_end, in->end);
+		} else {
+			st->zeros++;
+			st->zeros_end = max_size(st->zeros_end, in->end);
+		}
+	} else {
+		in->end = in->it.position + in->it.rlw.literal_words;
+		in->literal_slot = st->literal_count;
+		st->literals[st->literal_count++] = in;
+	}
+}
+
+static void leave_state(struct many_state *st, struct many_input *in)
+{
+	if (in->literal_slot < 0) {
+		if (in->it.rlw.running_bit)
+			st->ones--;
+		else
+			st->zeros--;
+	} else {
+		struct many_input *last = st->literals[--st->literal_count];
+
+		st->literals[in->literal_slot] = last;
+		last->literal_slot = in->literal_slot;
+		in->literal_slot = -1;
+	}
+}
+
+static inline const eword_t *
+literal_words_at(struct many_input *in, size_t pos)
+{
+	return in->it.buffer + in->it.literal_word_start + (pos - in->it.position);
+}
+
+static void emit_literals(
+	struct many_state *st, enum ewah_literal_op op, bool negate,
+	size_t pos, size_t len, struct ewah_bitmap *out)
+{
+	eword_t words[MANY_CHUNK_WORDS];
+
+	if (st->literal_count == 1 && !negate) {
+		ewah_add_words(out, literal_words_at(st->literals[0], pos), len);
+		return;
+	}
+
+	while (len > 0) {
+		size_t chunk = min_size(len, MANY_CHUNK_WORDS);
+		size_t i, k;
+
+		memcpy(words, literal_words_at(st->literals[0], pos),
+			chunk * sizeof(eword_t));
+
+		for (i = 1; i < st->literal_count; ++i) {
+			ewah_combine_words(words, words,
+				literal_words_at(st->literals[i], pos), chunk, op);
+		}
+
+		if (negate) {
+			for (k = 0; k < chunk; ++k)
+				words[k] = ~words[k];
+		}
+
+		ewah_add_words(out, words, chunk);
+
+		pos += chunk;
+		len -= chunk;
+	}
+}
+
+static void emit_segment(
+	struct many_state *st, enum ewah_literal_op op,
+	size_t pos, size_t len, struct ewah_bitmap *out, size_t exhausted)
+{
+	switch (op) {
+	case EWAH_LITERAL_OR:
+		if (st->ones > 0)
+			ewah_add_empty_words(out, true, len);
+		else if (st->literal_count == 0)
+			ewah_add_empty_words(out, false, len);
+		else
+			emit_literals(st, op, false, pos, len, out);
+		break;
+
+	case EWAH_LITERAL_AND:
+		if (st->zeros > 0 || exhausted > 0)
+			ewah_add_empty_words(out, false, len);
+		else if (st->literal_count == 0)
+			ewah_add_empty_words(out, true, len);
+		else
+			emit_literals(st, op, false, pos, len, out);
+		break;
+
+	case EWAH_LITERAL_XOR:
+		if (st->literal_count == 0)
+			ewah_add_empty_words(out, st->ones & 1, len);
+		else
+			emit_literals(st, op, st->ones & 1, pos, len, out);
+		break;
+
+	default:
+		assert(!"unsupported N-way operation");
+	}
+}
+
+static int ewah_many(
+	enum ewah_literal_op op, struct ewah_bitmap **bitmaps, size_t n,
+	struct ewah_bitmap *out)
+{
+	struct many_input *inputs;
+	struct many_state st;
+	size_t i, pos = 0, bit_size = 0, exhausted = 0;
+
+	if (n == 0)
+		return 0;
+
+	inputs = ewah_malloc(n * sizeof(struct many_input));
+	st.heap = ewah_malloc(2 * n * sizeof(struct many_input *));
+
+	if (inputs == NULL || st.heap == NULL) {
+		ewah_dealloc(inputs);
+		ewah_dealloc(st.heap);
+		return -1;
+	}
+
+	st.literals = st.heap + n;
+	st.heap_size = 0;
+	st.literal_count = 0;
+	st.ones = 0;
+	st.zeros = 0;
+	st.ones_end = 0;
+	st.zeros_end = 0;
+
+	ewah_reserve_result(out, bitmaps, n, op);
+
+	for (i = 0; i < n; ++i) {
+		struct many_input *in = &inputs[i];
+
+		bit_size = max_size(bit_size, bitmaps[i]->bit_size);
+
+		rlwit_init(&in->it, bitmaps[i]);
+
+		if (rlwit_word_size(&in->it) == 0) {
+			exhausted++;
+			continue;
+		}
+
+		enter_state(&st, in);
+		st.heap[st.heap_size++] = in;
+	}
+
+	for (i = st.heap_size / 2; i-- > 0; )
+		heap_sift_down(&st, i);
+
+	while (st.heap_size > 0) {
+		size_t end = st.heap[0]->end;
+
+		if (op == EWAH_LITERAL_OR && st.ones > 0)
+			end = max_size(end, st.ones_end);
+		else if (op == EWAH_LITERAL_AND && st.zeros > 0)
+			end = max_size(end, st.zeros_end);
+
+		emit_segment(&st, op, pos, end - pos, out, exhausted);
+		pos = end;
+
+		while (st.heap_size > 0 && st.heap[0]->end <= pos) {
+			struct many_input *in = st.heap[0];
+
+			leave_state(&st, in);
+			rlwit_advance_to(&in->it, pos);
+
+			if (rlwit_word_size(&in->it) == 0) {
+				exhausted++;
+				heap_pop(&st);
+			} else {
+				enter_state(&st, in);
+				heap_sift_down(&st, 0);
+			}
+		}
+	}
+
+	out->bit_size = bit_size;
+
+	ewah_dealloc(inputs);
+	ewah_dealloc(st.heap);
+	return 0;
+}
+
+int ewah_or_many(struct ewah_bitmap **bitmaps, size_t n, struct ewah_bitmap *out)
+{
+	return ewah_many(EWAH_LITERAL_OR, bitmaps, n, out);
+}
+
+int ewah_and_many(struct ewah_bitmap **bitmaps, size_t n, struct ewah_bitmap *out)
+{
+	return ewah_many(EWAH_LITERAL_AND, bitmaps, n, out);
+}
+
+int ewah_xor_many(struct ewah_bitmap **bitmaps, size_t n, struct ewah_bitmap *out)
+{
+	return ewah_many(EWAH_LITERAL_XOR, bitmaps, n, out);
+}
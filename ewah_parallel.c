@@ -0,0 +1,232 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Partitioned execution of the binary operations.
+ *
+ * The uncompressed word space is cut into as many ranges as threads. Each
+ * thread runs the merge loop of the operation on iterators bounded to its
+ * range of both inputs (seeking to it with the iterators, and through the
+ * skip index when the inputs have one), and the partial outputs are then
+ * spliced in order into the final bitmap.
+ *
+ * The writer only depends on the sequence of words it is fed, and the
+ * bounded iterators yield every word as it was (run or literal), so once
+ * the splice has replayed the first groups of a partial output to get the
+ * writer in step, the rest can be copied: the result is byte for byte the
+ * one the sequential operation would have produced.
+ */
+
+/* below this many compressed words per thread, threading is not worth it */
+#define PARALLEL_MIN_WORDS 4096
+
+struct partition {
+	enum ewah_literal_op op;
+	struct ewah_bitmap *bitmap_i, *bitmap_j;
+
+	/* uncompressed range, `end` is SIZE_MAX for the last partition */
+	size_t start, end;
+
+	struct ewah_bitmap *out;
+	pthread_t thread;
+	bool threaded;
+};
+
+static void *run_partition(void *payload)
+{
+	struct partition *part = payload;
+	struct rlw_iterator rlw_i, rlw_j;
+
+	rlwit_init_range(&rlw_i, part->bitmap_i, part->start, part->end);
+	rlwit_init_range(&rlw_j, part->bitmap_j, part->start, part->end);
+	rlwit_combine(&rlw_i, &rlw_j, part->out, part->op);
+
+	return NULL;
+}
+
+static void run_sequential(enum ewah_literal_op op,
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out)
+{
+	switch (op) {
+	case EWAH_LITERAL_AND:
+		ewah_and(bitmap_i, bitmap_j, out);
+		break;
+	case EWAH_LITERAL_OR:
+		ewah_or(bitmap_i, bitmap_j, out);
+		break;
+	case EWAH_LITERAL_XOR:
+		ewah_xor(bitmap_i, bitmap_j, out);
+		break;
+	case EWAH_LITERAL_AND_NOT:
+		ewah_and_not(bitmap_i, bitmap_j, out);
+		break;
+	}
+}
+
+/*
+ * Pick the split points by walking the RLW headers of the larger input,
+ * cutting whenever another `1/n` of its compressed size has gone by, so
+ * every partition gets about the same amount of compressed words to go
+ * through. Returns the number of partitions, which is at most `n`.
+ */
+static size_t split(struct ewah_bitmap *bitmap, size_t *starts, size_t n)
+{
+	size_t pointer = 0, words = 0, count = 1;
+
+	starts[0] = 0;
+
+	while (pointer < bitmap->buffer_size && count < n) {
+		const eword_t *word = bitmap->buffer + pointer;
+
+		if (pointer >= bitmap->buffer_size * count / n && words > starts[count - 1])
+			starts[count++] = words;
+
+		words += rlw_size(word);
+		pointer += 1 + rlw_get_literal_words(word);
+	}
+
+	return count;
+}
+
+static void free_partitions(struct partition *parts, size_t n)
+{
+	size_t k;
+
+	for (k = 0; k < n; ++k)
+		ewah_free(parts[k].out);
+
+	ewah_dealloc(parts);
+}
+
+static void ewah_parallel(
+	enum ewah_literal_op op, struct ewah_bitmap *bitmap_i,
+	struct ewah_bitmap *bitmap_j, struct ewah_bitmap *out, size_t threads)
+{
+	struct ewah_bitmap *larger, *inputs[2] = { bitmap_i, bitmap_j };
+	struct partition *parts;
+	size_t *starts, n, k;
+
+	if (threads == 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? (size_t)online : 1;
+	}
+
+	larger = bitmap_i->buffer_size > bitmap_j->buffer_size ? bitmap_i : bitmap_j;
+	threads = min_size(threads, larger->buffer_size / PARALLEL_MIN_WORDS);
+
+	if (threads <= 1) {
+		run_sequential(op, bitmap_i, bitmap_j, out);
+		return;
+	}
+
+	parts = ewah_calloc(threads, sizeof(struct partition));
+	starts = ewah_malloc(threads * sizeof(size_t));
+
+	if (parts == NULL || starts == NULL) {
+		ewah_dealloc(parts);
+		ewah_dealloc(starts);
+		run_sequential(op, bitmap_i, bitmap_j, out);
+		return;
+	}
+
+	n = split(larger, starts, threads);
+
+	for (k = 0; k < n; ++k) {
+		struct partition *part = &parts[k];
+
+		part->op = op;
+		part->bitmap_i = bitmap_i;
+		part->bitmap_j = bitmap_j;
+		part->start = starts[k];
+		part->end = (k + 1 < n) ? starts[k + 1] : SIZE_MAX;
+		part->out = ewah_new();
+
+		if (part->out == NULL) {
+			free_partitions(parts, k);
+			ewah_dealloc(starts);
+			run_sequential(op, bitmap_i, bitmap_j, out);
+			return;
+		}
+
+		part->out->canonical = out->canonical;
+	}
+
+	/* the calling thread takes the first partition itself */
+	for (k = 1; k < n; ++k) {
+		parts[k].threaded =
+			!pthread_create(&parts[k].thread, NULL, &run_partition, &parts[k]);
+	}
+
+	run_partition(&parts[0]);
+
+	for (k = 1; k < n; ++k) {
+		if (parts[k].threaded)
+			pthread_join(parts[k].thread, NULL);
+		else
+			run_partition(&parts[k]);
+	}
+
+	ewah_reserve_result(out, inputs, 2, op);
+
+	for (k = 0; k < n; ++k)
+		ewah_splice(out, parts[k].out);
+
+	out->bit_size = max_size(bitmap_i->bit_size, bitmap_j->bit_size);
+
+	free_partitions(parts, n);
+	ewah_dealloc(starts);
+}
+
+void ewah_or_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads)
+{
+	ewah_parallel(EWAH_LITERAL_OR, bitmap_i, bitmap_j, out, threads);
+}
+
+void ewah_and_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads)
+{
+	ewah_parallel(EWAH_LITERAL_AND, bitmap_i, bitmap_j, out, threads);
+}
+
+void ewah_xor_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads)
+{
+	ewah_parallel(EWAH_LITERAL_XOR, bitmap_i, bitmap_j, out, threads);
+}
+
+void ewah_and_not_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads)
+{
+	ewah_parallel(EWAH_LITERAL_AND_NOT, bitmap_i, bitmap_j, out, threads);
+}
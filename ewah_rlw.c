@@ -25,18 +25,36 @@
 #include "ewok.h"
 #include "ewok_rlw.h"
 
+/* cut the group at the head of the iterator where its range ends */
+static inline void clamp_to_end(struct rlw_iterator *it)
+{
+	const size_t room = it->end - it->position;
+
+	if (it->rlw.running_len > room)
+		it->rlw.running_len = room;
+
+	if (it->rlw.literal_words > room - it->rlw.running_len)
+		it->rlw.literal_words = room - it->rlw.running_len;
+}
+
 static inline bool next_word(struct rlw_iterator *it)
 {
-	if (it->pointer >= it->size)
+	if (it->position >= it->end)
+		return false;
+
+	if (it->pointer >= it->size && !(it->source && rlwit_refill(it)))
 		return false;
 
 	it->rlw.word = &it->buffer[it->pointer];
+	it->literal_word_start = it->pointer + 1;
 	it->pointer += rlw_get_literal_words(it->rlw.word) + 1;
 
 	it->rlw.literal_words = rlw_get_literal_words(it->rlw.word);
 	it->rlw.running_len = rlw_get_running_len(it->rlw.word);
 	it->rlw.running_bit = rlw_get_run_bit(it->rlw.word);
-	it->rlw.literal_word_offset = 0;
+
+	if (it->position + rlwit_word_size(it) > it->end)
+		clamp_to_end(it);
 
 	return true;
 }
@@ -46,38 +64,128 @@ void rlwit_init(struct rlw_iterator *it, struct ewah_bitmap *bitmap)
 	it->buffer = bitmap->buffer;
 	it->size = bitmap->buffer_size;
 	it->pointer = 0;
+	it->position = 0;
+	it->end = SIZE_MAX;
+	it->parent = bitmap;
+	it->source = NULL;
 
 	next_word(it);
+}
+
+void rlwit_init_range(struct rlw_iterator *it,
+	struct ewah_bitmap *bitmap, size_t start, size_t end)
+{
+	rlwit_init(it, bitmap);
+	it->end = end;
+
+	if (rlwit_word_size(it) > end)
+		clamp_to_end(it);
+
+	rlwit_advance_to(it, start);
+}
+
+void rlwit_init_reader(struct rlw_iterator *it, struct ewah_reader *reader)
+{
+	it->buffer = NULL;
+	it->size = 0;
+	it->pointer = 0;
+	it->position = 0;
+	it->end = SIZE_MAX;
+	it->parent = NULL;
+	it->source = reader;
+
+	/* an empty stream */
+	if (!next_word(it)) {
+		it->literal_word_start = 0;
+		it->rlw.running_len = 0;
+		it->rlw.literal_words = 0;
+	}
+}
+
+size_t rlw_skip_to(const struct ewah_bitmap *parent,
+	const eword_t *buffer, size_t size,
+	size_t *pointer, size_t words, size_t target)
+{
+	size_t walked = 0;
 
-	it->literal_word_start = rlwit_literal_words(it) + it->rlw.literal_word_offset;
+	while (*pointer < size) {
+		const eword_t *word = &buffer[*pointer];
+		const size_t len = rlw_size(word);
+
+		if (words + len > target)
+			break;
+
+		words += len;
+		*pointer += 1 + rlw_get_literal_words(word);
+
+		/* still far away: jump through the skip index */
+		if (parent && parent->index && ++walked == parent->index->stride) {
+			size_t offset, start;
+
+			ewah_index_seek(parent, target, &offset, &start);
+
+			if (start > words) {
+				*pointer = offset;
+				words = start;
+			}
+		}
+	}
+
+	return words;
+}
+
+void rlwit_advance_to(struct rlw_iterator *it, size_t pos)
+{
+	if (pos <= it->position)
+		return;
+
+	if (pos >= it->position + rlwit_word_size(it)) {
+		size_t pointer = it->pointer;
+
+		it->position = rlw_skip_to(it->parent, it->buffer, it->size,
+			&pointer, it->position + rlwit_word_size(it), pos);
+		it->pointer = pointer;
+
+		if (!next_word(it)) {
+			it->rlw.running_len = 0;
+			it->rlw.literal_words = 0;
+			return;
+		}
+	}
+
+	rlwit_discard_first_words(it, pos - it->position);
 }
 
 void rlwit_discard_first_words(struct rlw_iterator *it, size_t x)
 {
+	/* jumping over whole groups is cheaper than consuming them */
+	if (x > rlwit_word_size(it) && it->parent && it->parent->index) {
+		rlwit_advance_to(it, it->position + x);
+		return;
+	}
+
 	while (x > 0) {
 		size_t discard;
 
 		if (it->rlw.running_len > x) {
 			it->rlw.running_len -= x;
+			it->position += x;
 			return;
 		}
 
 		x -= it->rlw.running_len;
+		it->position += it->rlw.running_len;
 		it->rlw.running_len = 0;
 
 		discard = (x > it->rlw.literal_words) ? it->rlw.literal_words : x;
 
 		it->literal_word_start += discard;
 		it->rlw.literal_words -= discard;
+		it->position += discard;
 		x -= discard;
 
-		if (x > 0 || rlwit_word_size(it) == 0) {
-			if (!next_word(it))
-				break;
-
-			it->literal_word_start =
-				rlwit_literal_words(it) + it->rlw.literal_word_offset;
-		}
+		if ((x > 0 || rlwit_word_size(it) == 0) && !next_word(it))
+			break;
 	}
 }
 
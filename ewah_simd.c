@@ -0,0 +1,316 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Vectorized kernels for the literal sections of the binary operations.
+ *
+ * Each kernel combines a block of literal words from both operands and,
+ * while the words are still in vector registers, checks whether any of
+ * the results is an empty word (all zeros or all ones). Blocks without
+ * empty words, which is the common case for dense bitmaps, are appended
+ * to the output in one go; otherwise the block is split into runs of
+ * empty words and runs of dirty words. The encoding is the same that
+ * calling `ewah_add` for every single word would produce.
+ *
+ * The kernels are written with GCC vector extensions and compiled once
+ * per instruction set; the widest one supported by the CPU is picked on
+ * first use.
+ */
+
+#define LITERAL_BLOCK_WORDS 256
+
+typedef bool (*literal_kernel)(
+	eword_t *dst, const eword_t *a, const eword_t *b, size_t n);
+
+#define OP_AND(a, b) ((a) & (b))
+#define OP_OR(a, b) ((a) | (b))
+#define OP_XOR(a, b) ((a) ^ (b))
+#define OP_AND_NOT(a, b) ((a) & ~(b))
+
+#define DEFINE_KERNEL(isa, attr, bytes, name, OP) \
+static attr bool isa##_##name( \
+	eword_t *dst, const eword_t *a, const eword_t *b, size_t n) \
+{ \
+	typedef eword_t vec_t __attribute__((vector_size(bytes))); \
+	const size_t lanes = sizeof(vec_t) / sizeof(eword_t); \
+	vec_t clean = {0}; \
+	size_t i, k; \
+\
+	for (i = 0; i + lanes <= n; i += lanes) { \
+		vec_t va, vb, r; \
+\
+		memcpy(&va, a + i, sizeof(vec_t)); \
+		memcpy(&vb, b + i, sizeof(vec_t)); \
+		r = OP(va, vb); \
+		clean |= (vec_t)(r == 0) | (vec_t)(~r == 0); \
+		memcpy(dst + i, &r, sizeof(vec_t)); \
+	} \
+\
+	for (k = 0; k < lanes; ++k) { \
+		if (clean[k]) \
+			break; \
+	} \
+\
+	for (; i < n; ++i) { \
+		dst[i] = OP(a[i], b[i]); \
+		if (dst[i] == 0 || dst[i] == (eword_t)(~0)) \
+			k = 0; \
+	} \
+\
+	return k < lanes; \
+}
+
+#define DEFINE_KERNELS(isa, attr, bytes) \
+	DEFINE_KERNEL(isa, attr, bytes, and, OP_AND) \
+	DEFINE_KERNEL(isa, attr, bytes, or, OP_OR) \
+	DEFINE_KERNEL(isa, attr, bytes, xor, OP_XOR) \
+	DEFINE_KERNEL(isa, attr, bytes, and_not, OP_AND_NOT) \
+	static const literal_kernel isa##_kernels[] = { \
+		&isa##_and, &isa##_or, &isa##_xor, &isa##_and_not \
+	};
+
+/* SSE2 on x86-64, whatever the compiler makes of it elsewhere */
+DEFINE_KERNELS(generic, , 16)
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#	define EWAH_X86_DISPATCH
+DEFINE_KERNELS(avx2, __attribute__((target("avx2"))), 32)
+DEFINE_KERNELS(avx512, __attribute__((target("avx512f"))), 64)
+#endif
+
+static const literal_kernel *kernels;
+
+static const literal_kernel *select_kernels(void)
+{
+#ifdef EWAH_X86_DISPATCH
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f"))
+		return avx512_kernels;
+
+	if (__builtin_cpu_supports("avx2"))
+		return avx2_kernels;
+#endif
+	return generic_kernels;
+}
+
+/*
+ * Population count over blocks of literal words. Without `-mpopcnt`
+ * the builtin expands to a bit-twiddling sequence, so a copy built for
+ * the POPCNT instruction is picked at runtime when available.
+ */
+typedef size_t (*popcount_kernel)(
+	const eword_t *a, const eword_t *b, size_t n, int op);
+
+#define DEFINE_POPCOUNT(isa, attr) \
+static attr size_t isa##_popcount( \
+	const eword_t *a, const eword_t *b, size_t n, int op) \
+{ \
+	size_t i, count = 0; \
+\
+	switch (op) { \
+	case EWAH_LITERAL_AND: \
+		for (i = 0; i < n; ++i) \
+			count += __builtin_popcountll(OP_AND(a[i], b[i])); \
+		break; \
+	case EWAH_LITERAL_OR: \
+		for (i = 0; i < n; ++i) \
+			count += __builtin_popcountll(OP_OR(a[i], b[i])); \
+		break; \
+	case EWAH_LITERAL_XOR: \
+		for (i = 0; i < n; ++i) \
+			count += __builtin_popcountll(OP_XOR(a[i], b[i])); \
+		break; \
+	case EWAH_LITERAL_AND_NOT: \
+		for (i = 0; i < n; ++i) \
+			count += __builtin_popcountll(OP_AND_NOT(a[i], b[i])); \
+		break; \
+	default: \
+		for (i = 0; i < n; ++i) \
+			count += __builtin_popcountll(a[i]); \
+		break; \
+	} \
+\
+	return count; \
+}
+
+DEFINE_POPCOUNT(generic, )
+
+#ifdef EWAH_X86_DISPATCH
+DEFINE_POPCOUNT(popcnt, __attribute__((target("popcnt"))))
+#endif
+
+static popcount_kernel popcount;
+
+static popcount_kernel select_popcount(void)
+{
+#ifdef EWAH_X86_DISPATCH
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("popcnt"))
+		return popcnt_popcount;
+#endif
+	return generic_popcount;
+}
+
+/*
+ * The parallel operations may race to pick the kernels: all threads
+ * pick the same ones, so a relaxed atomic is all it takes.
+ */
+static popcount_kernel get_popcount(void)
+{
+	popcount_kernel k = __atomic_load_n(&popcount, __ATOMIC_RELAXED);
+
+	if (k == NULL) {
+		k = select_popcount();
+		__atomic_store_n(&popcount, k, __ATOMIC_RELAXED);
+	}
+
+	return k;
+}
+
+/*
+ * Position of the k-th set bit of a word: a single PDEP to deposit a
+ * bit at the k-th set position, and TZCNT to find it, when the CPU has
+ * BMI2; otherwise the lowest set bits are cleared one at a time.
+ */
+typedef unsigned (*select_kernel)(uint64_t word, unsigned k);
+
+static unsigned generic_select(uint64_t word, unsigned k)
+{
+	while (k--)
+		word &= word - 1;
+
+	return __builtin_ctzll(word);
+}
+
+#ifdef EWAH_X86_DISPATCH
+static __attribute__((target("bmi,bmi2"))) unsigned bmi2_select(uint64_t word, unsigned k)
+{
+	return __builtin_ia32_tzcnt_u64(__builtin_ia32_pdep_di((uint64_t)1 << k, word));
+}
+#endif
+
+static select_kernel select_bit;
+
+static select_kernel select_select_bit(void)
+{
+#ifdef EWAH_X86_DISPATCH
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("bmi2"))
+		return bmi2_select;
+#endif
+	return generic_select;
+}
+
+static select_kernel get_select_bit(void)
+{
+	select_kernel k = __atomic_load_n(&select_bit, __ATOMIC_RELAXED);
+
+	if (k == NULL) {
+		k = select_select_bit();
+		__atomic_store_n(&select_bit, k, __ATOMIC_RELAXED);
+	}
+
+	return k;
+}
+
+unsigned ewah_select_bit(eword_t word, size_t k)
+{
+	return get_select_bit()(word, k);
+}
+
+size_t ewah_popcount_words(const eword_t *words, size_t n)
+{
+	return get_popcount()(words, NULL, n, -1);
+}
+
+size_t ewah_popcount_combined(
+	const eword_t *a, const eword_t *b, size_t n, enum ewah_literal_op op)
+{
+	return get_popcount()(a, b, n, op);
+}
+
+void ewah_add_words(struct ewah_bitmap *self, const eword_t *words, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n) {
+		size_t j = i + 1;
+
+		if (words[i] == 0) {
+			while (j < n && words[j] == 0)
+				j++;
+			ewah_add_empty_words(self, false, j - i);
+		} else if (words[i] == (eword_t)(~0)) {
+			while (j < n && words[j] == (eword_t)(~0))
+				j++;
+			ewah_add_empty_words(self, true, j - i);
+		} else {
+			while (j < n && words[j] != 0 && words[j] != (eword_t)(~0))
+				j++;
+			ewah_add_dirty_words(self, words + i, j - i, false);
+		}
+
+		i = j;
+	}
+}
+
+bool ewah_combine_words(
+	eword_t *dst, const eword_t *a, const eword_t *b, size_t n,
+	enum ewah_literal_op op)
+{
+	const literal_kernel *k = __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+
+	if (k == NULL) {
+		k = select_kernels();
+		__atomic_store_n(&kernels, k, __ATOMIC_RELAXED);
+	}
+
+	return k[op](dst, a, b, n);
+}
+
+void ewah_add_literal_block(
+	struct ewah_bitmap *self, const eword_t *a, const eword_t *b, size_t n,
+	enum ewah_literal_op op)
+{
+	eword_t block[LITERAL_BLOCK_WORDS];
+
+	while (n > 0) {
+		size_t len = min_size(n, LITERAL_BLOCK_WORDS);
+
+		if (ewah_combine_words(block, a, b, len, op))
+			ewah_add_words(self, block, len);
+		else
+			ewah_add_dirty_words(self, block, len, false);
+
+		a += len;
+		b += len;
+		n -= len;
+	}
+}
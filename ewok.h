@@ -17,11 +17,38 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
-#ifndef __EWOK_BITMAP_C__
-#define __EWOK_BITMAP_C__
+
+/*
+ * Width of the compressed words: 64 by default. The library can also be
+ * built for 32-bit words, which makes the compressed stream of very
+ * sparse bitmaps about half as large. In that build every symbol and
+ * type is renamed (`ewah_new` becomes `ewah32_new`, `struct bitmap`
+ * becomes `struct bitmap32`, ...; see `ewok32_names.h`), so both
+ * variants can be linked into the same binary. `ewok32.c` compiles the
+ * 32-bit variant next to the default one; include `ewok32.h` to use it.
+ */
+#ifndef EWOK_WORD_BITS
+#	define EWOK_WORD_BITS 64
+#endif
+
+#if EWOK_WORD_BITS == 32
+#	include "ewok32_names.h"
+#elif EWOK_WORD_BITS != 64
+#	error "EWOK_WORD_BITS must be 32 or 64"
+#endif
+
+#if (EWOK_WORD_BITS == 32 && !defined(__EWOK32_BITMAP_C__)) || \
+	(EWOK_WORD_BITS == 64 && !defined(__EWOK_BITMAP_C__))
+#if EWOK_WORD_BITS == 32
+#	define __EWOK32_BITMAP_C__
+#else
+#	define __EWOK_BITMAP_C__
+#endif
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifndef ewah_malloc
 #	define ewah_malloc malloc
@@ -32,16 +59,101 @@
 #ifndef ewah_calloc
 #	define ewah_calloc calloc
 #endif
+#ifndef ewah_dealloc
+#	define ewah_dealloc free
+#endif
 
+#if EWOK_WORD_BITS == 32
+typedef uint32_t eword_t;
+#else
 typedef uint64_t eword_t;
+#endif
 #define BITS_IN_WORD (sizeof(eword_t) * 8)
 
+struct ewah_index;
+struct ewah_sink;
+struct ewah_shared;
+
+/* the allocators and arenas are shared by both word widths */
+#ifndef __EWOK_ALLOCATOR__
+#define __EWOK_ALLOCATOR__
+
+/**
+ * Runtime allocator for the memory of a bitmap (the struct itself and
+ * its word buffer). The three callbacks follow the semantics of malloc,
+ * realloc and free, and get `ctx` as their first argument.
+ *
+ * A bitmap created with an allocator keeps a pointer to it, so the
+ * allocator must outlive the bitmap. Bitmaps without one use the
+ * compile-time `ewah_malloc` / `ewah_realloc` / `ewah_dealloc` macros.
+ */
+struct ewah_allocator {
+	void *(*alloc)(void *ctx, size_t size);
+	void *(*resize)(void *ctx, void *ptr, size_t size);
+	void (*release)(void *ctx, void *ptr);
+	void *ctx;
+};
+
+/**
+ * Bump allocator for short-lived bitmaps, e.g. all the intermediate
+ * results of one query: allocations are carved out of large chunks, and
+ * the whole arena is released at once with `ewah_arena_reset`, which
+ * keeps the first chunk around for the next round.
+ *
+ * Freeing or growing the most recent allocation is done in place; any
+ * other free is a no-op until the next reset. Arenas are not thread-safe.
+ *
+ * E.g.
+ *
+ *		struct ewah_arena *arena = ewah_arena_new(0);
+ *		struct ewah_bitmap *tmp =
+ *			ewah_new_with_allocator(ewah_arena_allocator(arena));
+ *		...
+ *		ewah_arena_reset(arena);
+ */
+struct ewah_arena;
+
+/**
+ * Create an arena that allocates `chunk_size` bytes at a time from the
+ * default allocator; 0 picks a default of 1MB.
+ */
+struct ewah_arena *ewah_arena_new(size_t chunk_size);
+const struct ewah_allocator *ewah_arena_allocator(struct ewah_arena *arena);
+
+/**
+ * Release every allocation made from the arena. All the bitmaps using it
+ * become invalid, and must not be passed to `ewah_free`.
+ */
+void ewah_arena_reset(struct ewah_arena *arena);
+void ewah_arena_free(struct ewah_arena *arena);
+
+#endif
+
 struct ewah_bitmap {
 	eword_t *buffer;
 	size_t buffer_size;
 	size_t alloc_size;
 	size_t bit_size;
 	eword_t *rlw;
+	struct ewah_index *index;
+	const struct ewah_allocator *allocator;
+
+	/* bits set, and the first and last of them; kept up to date as
+	 * words are appended */
+	size_t cardinality;
+	size_t first_bit;
+	size_t last_bit;
+
+	/* where finished RLW groups are written out, if the bitmap is not
+	 * kept in memory */
+	struct ewah_sink *sink;
+
+	/* fold empty words appended as literals into runs, so that the set
+	 * operations writing here emit the same words `ewah_compact` would */
+	bool canonical;
+
+	/* reference count of the words, if they are shared with clones */
+	struct ewah_shared *shared;
 };
 
 /**
@@ -49,6 +161,33 @@ struct ewah_bitmap {
  */
 struct ewah_bitmap *ewah_new(void);
 
+/**
+ * Allocate a new EWAH Compressed bitmap whose memory comes from
+ * `allocator` (NULL for the default one).
+ */
+struct ewah_bitmap *ewah_new_with_allocator(const struct ewah_allocator *allocator);
+
+/**
+ * Make a copy of the bitmap in O(1), sharing its words. Shared words are
+ * reference counted and read-only: whichever of the bitmaps sharing them
+ * is written to first gets a private copy before the write, so a clone
+ * behaves like a deep copy.
+ *
+ * The first clone publishes the bitmap: it builds the ranked skip index
+ * of the words once, and the clones share it read-only, so `ewah_get`,
+ * `ewah_rank` and `ewah_select` on any of them never write. That first
+ * call must not race with any other call on the bitmap. From then on,
+ * readers never lock: any number of threads may clone it or query it at
+ * once, as long as nothing writes to it meanwhile.
+ *
+ * Clones of a view are views of the same mapping. Bitmaps written to a
+ * sink cannot be cloned.
+ *
+ * Returns: the clone, to be released with `ewah_free`, or NULL on
+ * failure (check errno)
+ */
+struct ewah_bitmap *ewah_clone(struct ewah_bitmap *self);
+
 /**
  * Clear all the bits in the bitmap. Does not free or resize
  * memory.
@@ -64,9 +203,19 @@ void ewah_free(struct ewah_bitmap *bitmap);
  * Load a bitmap from a file descriptor. An empty `ewah_bitmap` instance
  * must have been allocated beforehand.
  *
+ * Both the original (version 1) format written by `ewah_serialize` and
+ * the version 2 format written by `ewah_serialize_v2` are accepted; the
+ * version is detected from the first bytes of the stream. Version 2
+ * files written on a host with a different byte order are byte-swapped
+ * on load, and their checksum, if any, is verified. Version 2 files
+ * written by the variant of the library with the other word width are
+ * converted on load. A bitmap that cannot be loaded is left as it was,
+ * even if its words are shared with clones.
+ *
  * The fd must be open in read mode.
  *
- * Returns: 0 on success, -1 if a reading error occured (check errno)
+ * Returns: 0 on success, -1 if a reading error occured (check errno).
+ * errno is EINVAL for malformed data and EBADMSG for a checksum mismatch.
  */
 int ewah_deserialize(struct ewah_bitmap *self, int fd);
 
@@ -76,16 +225,279 @@ int ewah_deserialize(struct ewah_bitmap *self, int fd);
  *
  * | bit_count | number_of_words | words... | rlw_position
  *
+ * All the fields are 32-bit wide, so bitmaps with 2^32 bits or words
+ * or more can only be written with `ewah_serialize_v2`. The format does
+ * not record the width of the words, so files written by the 32-bit
+ * variant can only be read back by the 32-bit variant.
+ *
  * The fd must be open in write mode.
  *
- * Returns: 0 on success, -1 if a writing error occured (check errno)
+ * Returns: 0 on success, -1 if a writing error occured (check errno).
+ * errno is EOVERFLOW if the bitmap is too large for this format.
  */
 int ewah_serialize(struct ewah_bitmap *self, int fd);
 
+/* Append a CRC32C of the serialized bitmap */
+#define EWAH_V2_CHECKSUM (1 << 1)
+
+/**
+ * Dump an existing bitmap to a file descriptor in the version 2
+ * format: a fixed-size header with 64-bit fields, followed by the
+ * compressed words, all of them in the byte order of the host, and an
+ * optional CRC32C trailer (`EWAH_V2_CHECKSUM`). The header records the
+ * width of the words, and is followed by the bit count and the first
+ * and last bit set, so loading the file does not have to count them.
+ *
+ * Files in this format can be read back with `ewah_deserialize`, or
+ * mapped into memory and used in place with `ewah_view`.
+ *
+ * The fd must be open in write mode.
+ *
+ * Returns: 0 on success, -1 if a writing error occured (check errno)
+ */
+int ewah_serialize_v2(struct ewah_bitmap *self, int fd, int flags);
+
+/**
+ * Create a read-only bitmap whose words live in `map`, a memory region
+ * (usually a file mapped with mmap) that starts with a bitmap written by
+ * `ewah_serialize_v2` on a host with the same byte order, by a build
+ * with the same word width. The region
+ * must be aligned to a word boundary. The checksum, if any, is not
+ * verified, since that would mean reading the whole bitmap.
+ *
+ * Nothing is copied: opening the bitmap is O(1), and the pages are
+ * shared with every other process mapping the same file. Iterators, the
+ * logical operations (as inputs) and `ewah_each_bit` work on the view
+ * like on any other bitmap. The mapping is never written to: the first
+ * function that modifies the view copies its words out of the mapping
+ * first. `ewah_free` releases the view but not the mapping, which must
+ * outlive it.
+ *
+ * Returns: the new view, or NULL if the region does not hold a valid
+ * native bitmap for this host
+ */
+struct ewah_bitmap *ewah_view(const void *map, size_t len);
+
+/**
+ * Source of bytes for a streaming reader, with the semantics of read(2):
+ * returns the number of bytes stored in `buf` (at most `len`), 0 at the
+ * end of the stream, or -1 on error with errno set.
+ */
+typedef ssize_t (*ewah_read_fn)(void *data, void *buf, size_t len);
+
+/**
+ * Streaming reader for serialized bitmaps (both formats, see
+ * `ewah_deserialize`), for bitmaps that are still arriving through a
+ * pipe or a socket, or that are too large to be loaded at once.
+ *
+ * The compressed words are pulled from the stream in whole RLW groups
+ * as they are needed, into a buffer of `buffer_words` words (0 picks the
+ * default size), so memory use is bounded whatever the size of the
+ * bitmap. Short reads are retried until enough bytes have arrived.
+ *
+ *	struct ewah_reader *r = ewah_reader_new(fd, 0);
+ *	ewah_reader_and(r, filter, out);
+ *	ewah_reader_free(r);
+ *
+ * Version 2 files written by the variant of the library with the other
+ * word width can not be streamed; load them with `ewah_deserialize`.
+ *
+ * Returns: the new reader, once the header of the bitmap has been read;
+ * NULL on a reading error or a malformed header (check errno)
+ */
+struct ewah_reader;
+
+struct ewah_reader *ewah_reader_new(int fd, size_t buffer_words);
+struct ewah_reader *ewah_reader_new_cb(
+	ewah_read_fn fn, void *data, size_t buffer_words);
+void ewah_reader_free(struct ewah_reader *reader);
+
+/**
+ * Size in bits of the bitmap being read, as recorded in its header.
+ */
+size_t ewah_reader_bit_size(struct ewah_reader *reader);
+
+/**
+ * Partial load: append the next `words` uncompressed words of the
+ * stream to `out`, reading only as much of it as they take. Calling it
+ * again resumes where the previous call stopped; once the end of the
+ * stream is reached, the bit size of `out` is set to that of the bitmap
+ * (so `out` should start empty).
+ *
+ * Returns: the number of words appended, 0 at the end of the stream, or
+ * -1 on error (check errno; EBADMSG for a checksum mismatch)
+ */
+ssize_t ewah_reader_load(
+	struct ewah_reader *reader, struct ewah_bitmap *out, size_t words);
+
+/**
+ * Logical operations between the bitmap being read and `bitmap`, like
+ * `ewah_and` and friends, with the streamed bitmap on the left. The
+ * operation starts as soon as the first words arrive, and only a buffer
+ * of the streamed bitmap is ever in memory. It consumes the whole
+ * stream, so it must be the first use of the reader.
+ *
+ * Returns: 0 on success, -1 if the stream could not be read (check
+ * errno), in which case `out` holds a partial result
+ */
+int ewah_reader_and(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out);
+int ewah_reader_or(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out);
+int ewah_reader_xor(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out);
+int ewah_reader_and_not(struct ewah_reader *reader,
+	struct ewah_bitmap *bitmap, struct ewah_bitmap *out);
+
+/**
+ * Out-of-core logical operations between two bitmaps serialized in
+ * files (in either format), starting at the current position of `fd_i`
+ * and `fd_j`. The result is written to `out_fd` in the version 2 format,
+ * with `flags` as for `ewah_serialize_v2`.
+ *
+ * Both inputs are streamed with pread and readahead hints, and the
+ * result is written out as it is produced, so memory use is a few
+ * buffers whatever the size of the bitmaps. `out_fd` must be seekable:
+ * the header of the result is written last. On success, its offset is
+ * left after the result, as `ewah_serialize_v2` does.
+ *
+ * Returns: 0 on success, -1 on a reading or writing error (check errno)
+ */
+int ewah_and_files(int fd_i, int fd_j, int out_fd, int flags);
+int ewah_or_files(int fd_i, int fd_j, int out_fd, int flags);
+int ewah_xor_files(int fd_i, int fd_j, int out_fd, int flags);
+int ewah_and_not_files(int fd_i, int fd_j, int out_fd, int flags);
+
+/**
+ * Load a compressed bitmap made of words of another width into `self`,
+ * which is cleared first. `buffer` holds `words` compressed words of
+ * `word_bits` bits (32 or 64), in the byte order of the host, for a
+ * bitmap of `bit_size` bits. Runs are converted without expanding them.
+ *
+ * This is how bitmaps move between the 64-bit and the 32-bit variants
+ * of the library (see `ewok32.h`).
+ *
+ * Returns: 0 on success, -1 if the words are malformed (errno is EINVAL)
+ */
+int ewah_import(struct ewah_bitmap *self,
+	const void *buffer, size_t words, unsigned word_bits, size_t bit_size);
+
+/**
+ * Build (or bring up to date) the skip index of the bitmap, sampling
+ * one every `stride` RLWs; 0 picks the default stride. The index makes
+ * random access such as `ewah_get` O(log n) instead of a full scan.
+ *
+ * The index is optional: it is built lazily on the first random access
+ * and kept up to date as the bitmap grows. Smaller strides trade memory
+ * for faster lookups.
+ *
+ * Bitmaps whose words are shared with clones (see `ewah_clone`) already
+ * have a complete ranked index, which cannot be rebuilt with another
+ * stride.
+ *
+ * Returns: 0 on success, -1 if the index could not be allocated, or
+ * the words are shared and their index is not the one asked for (errno
+ * is EBUSY)
+ */
+int ewah_build_index(struct ewah_bitmap *self, size_t stride);
+
+/**
+ * Get the value of the bit at position `pos`.
+ *
+ * Uses the skip index of the bitmap, building it if necessary: this
+ * writes to the bitmap, unless its words are shared with clones (see
+ * `ewah_clone`), so concurrent readers must go through clones.
+ */
+bool ewah_get(struct ewah_bitmap *self, size_t pos);
+
+/**
+ * Build (or bring up to date) a ranked skip index: like the one built
+ * by `ewah_build_index`, but every sample also counts the set bits
+ * before it. This costs a popcount of all the literal words, once.
+ */
+int ewah_build_rank_index(struct ewah_bitmap *self, size_t stride);
+
+/**
+ * Number of set bits before position `pos` (excluded).
+ *
+ * Uses the ranked skip index of the bitmap, building it if necessary, so
+ * the cost is O(log n) plus a walk of at most `stride` RLW groups. Like
+ * `ewah_get`, building the index writes to the bitmap.
+ */
+size_t ewah_rank(struct ewah_bitmap *self, size_t pos);
+
+/**
+ * Find the position of the set bit with rank `k`, i.e. the `k+1`-th set
+ * bit of the bitmap, using the ranked skip index like `ewah_rank`; this
+ * also writes to the bitmap if the index has to be built.
+ *
+ * Returns: true if the bitmap has more than `k` set bits, and the
+ * position in `*pos`; false otherwise
+ */
+bool ewah_select(struct ewah_bitmap *self, size_t k, size_t *pos);
+
+/**
+ * Dump the skip index of the bitmap to a file descriptor, building it
+ * if necessary, so it can be stored next to the serialized bitmap and
+ * loaded again with `ewah_deserialize_index` instead of rebuilt.
+ *
+ * Returns: 0 on success, -1 if a writing error occured (check errno)
+ */
+int ewah_serialize_index(struct ewah_bitmap *self, int fd);
+
+/**
+ * Load a skip index written by `ewah_serialize_index` and attach it to
+ * the bitmap it was built for. Indexes written on a host with a
+ * different byte order are rejected, since they can always be rebuilt.
+ *
+ * Returns: 0 on success, -1 if a reading error occured, the index
+ * does not match the bitmap, or the words of the bitmap are shared with
+ * clones (check errno)
+ */
+int ewah_deserialize_index(struct ewah_bitmap *self, int fd);
+
+/**
+ * Make room in the buffer of the bitmap for `words` words in total, so
+ * that appending up to that size does not reallocate it. The capacity is
+ * kept by `ewah_clear`, so a bitmap recycled as the output of many
+ * operations only grows once.
+ *
+ * Returns: 0 on success, -1 if the buffer could not be grown
+ */
+int ewah_reserve(struct ewah_bitmap *self, size_t words);
+
+/**
+ * Upper bound on the number of words taken by the result of any of the
+ * logical operations between `bitmap_i` and `bitmap_j`, computed in O(1)
+ * from the size of the inputs.
+ *
+ * The operations reserve at most this many words in `out` before
+ * writing to it: an AND only reserves room for the words both inputs
+ * have, and an AND-NOT for the words of `bitmap_i`.
+ */
+size_t ewah_result_words(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j);
+
+/**
+ * Rewrite the bitmap in its canonical, minimal form: empty literal words
+ * become runs, adjacent runs of the same bit are merged and empty RLWs
+ * are dropped. The buffer is then trimmed to its exact size, giving back
+ * the slack left by growing it.
+ *
+ * The set bits are not changed. A skip index attached to the bitmap is
+ * reset. Bitmaps written to a sink cannot be compacted.
+ *
+ * Returns: 0 on success, -1 if the new buffer could not be allocated
+ * or the bitmap cannot be compacted (check errno)
+ */
+int ewah_compact(struct ewah_bitmap *self);
+
 /**
  * Logical not (bitwise negation) in-place on the bitmap
  *
- * This operation is linear time based on the size of the bitmap.
+ * Only the first `bit_size` bits are flipped: the padding of the last
+ * word stays clear. This operation is linear time based on the size
+ * of the bitmap.
  */
 void ewah_not(struct ewah_bitmap *self);
 
@@ -98,6 +510,43 @@ void ewah_not(struct ewah_bitmap *self);
  */
 void ewah_each_bit(struct ewah_bitmap *self, void (*callback)(size_t, void*), void *payload);
 
+struct ewah_decode_cursor {
+	size_t pointer;
+	size_t word_pos;
+	size_t base;
+	size_t ones_left;
+	size_t literals_left;
+	eword_t word;
+};
+
+/**
+ * Initialize a cursor to decode a bitmap from its first set bit.
+ */
+void ewah_decode_init(struct ewah_decode_cursor *cursor);
+
+/**
+ * Write the positions of up to `cap` set bits into `out`, in increasing
+ * order, starting where the previous call with the same cursor stopped.
+ *
+ * Returns the number of positions written; 0 once the whole bitmap has
+ * been decoded. The 32-bit variant truncates positions, so it must only
+ * be used for bitmaps with less than 2^32 bits.
+ *
+ * E.g.
+ *
+ *		struct ewah_decode_cursor cursor;
+ *		uint64_t pos[256];
+ *		size_t n;
+ *
+ *		ewah_decode_init(&cursor);
+ *		while ((n = ewah_decode_positions(bitmap, pos, 256, &cursor)) > 0)
+ *			lookup_rows(pos, n);
+ */
+size_t ewah_decode_positions(struct ewah_bitmap *self,
+	uint64_t *out, size_t cap, struct ewah_decode_cursor *cursor);
+size_t ewah_decode_positions32(struct ewah_bitmap *self,
+	uint32_t *out, size_t cap, struct ewah_decode_cursor *cursor);
+
 /**
  * Set a given bit on the bitmap.
  *
@@ -117,6 +566,68 @@ void ewah_each_bit(struct ewah_bitmap *self, void (*callback)(size_t, void*), vo
  */
 void ewah_set(struct ewah_bitmap *self, size_t i);
 
+/**
+ * Set all the bits in the range [start, end). Like `ewah_set`, bits can
+ * only be set past the end of the bitmap (`start` must be at least
+ * `bit_size`), but whole words are emitted as runs of ones directly.
+ */
+void ewah_set_range(struct ewah_bitmap *self, size_t start, size_t end);
+
+/**
+ * Set the bits at the `n` positions in `ids`, which must be sorted
+ * (duplicates are fine) and not before the end of the bitmap. Bits are
+ * packed into words locally and appended in bulk, which is much faster
+ * than calling `ewah_set` for each of them.
+ *
+ * Returns: 0 on success, -1 with errno set to EINVAL if the ids are not
+ * sorted or start before the end of the bitmap; nothing is set then
+ */
+int ewah_add_sorted(struct ewah_bitmap *self, const uint64_t *ids, size_t n);
+int ewah_add_sorted32(struct ewah_bitmap *self, const uint32_t *ids, size_t n);
+
+/**
+ * Builder for positions that arrive out of order.
+ *
+ * Positions are buffered in an uncompressed window of `window_bits` bits
+ * (0 picks a default of 1M) and flushed into `out` as the low-water mark
+ * advances. The mark is raised explicitly with `ewah_builder_seal`, and
+ * implicitly when a position lands past the end of the window, which
+ * then slides forward keeping half of it behind that position: mostly
+ * ordered streams can be built without sorting them first, as long as
+ * stragglers are no more than half a window behind.
+ *
+ * `out` must not be used until `ewah_builder_finish`, which flushes the
+ * rest of the window and frees the builder.
+ *
+ * E.g.
+ *
+ *		struct ewah_builder *b = ewah_builder_new(bitmap, 0);
+ *
+ *		ewah_builder_set(b, 1000);
+ *		ewah_builder_set(b, 12); // ok
+ *		ewah_builder_seal(b, 900);
+ *		ewah_builder_set(b, 800); // failed, already sealed
+ *		ewah_builder_finish(b);
+ */
+struct ewah_builder;
+
+struct ewah_builder *ewah_builder_new(struct ewah_bitmap *out, size_t window_bits);
+
+/**
+ * Set the bit at `pos`.
+ *
+ * Returns: 0 on success, -1 with errno set to EINVAL if `pos` is below
+ * the low-water mark (or the end of `out` when the builder was created)
+ */
+int ewah_builder_set(struct ewah_builder *b, size_t pos);
+
+/**
+ * Promise that no position below `low_water` will be set any more, and
+ * flush the words below it into the output.
+ */
+void ewah_builder_seal(struct ewah_builder *b, size_t low_water);
+void ewah_builder_finish(struct ewah_builder *b);
+
 /**
  * Add a stream of empty words to the bitstream
  *
@@ -125,6 +636,30 @@ void ewah_set(struct ewah_bitmap *self, size_t i);
  */
 size_t ewah_add_empty_words(struct ewah_bitmap *self, bool v, size_t number);
 
+/**
+ * Append a single uncompressed word to the bitstream. Empty words
+ * (all zeros or all ones) are folded into the current run.
+ *
+ * This is an internal operation used to efficiently generate
+ * compressed bitmaps.
+ */
+size_t ewah_add(struct ewah_bitmap *self, eword_t word);
+
+/**
+ * Append the contents of `src` to `dst`, with bit 0 of `src` landing on
+ * bit `bit_offset` of `dst`; the gap after the current end of `dst` is
+ * filled with zeros. This is the way to join bitmaps built per segment
+ * or shard (e.g. in parallel) into a global one.
+ *
+ * When `bit_offset` is a multiple of the word size the compressed stream
+ * of `src` is spliced directly; otherwise every word is shifted, but runs
+ * are kept as runs. `dst` and `src` must be different bitmaps.
+ *
+ * Returns: 0 on success, -1 with errno set to EINVAL if `bit_offset` falls
+ * before the end of `dst`
+ */
+int ewah_append(struct ewah_bitmap *dst, struct ewah_bitmap *src, size_t bit_offset);
+
 struct ewah_iterator {
 	const eword_t *buffer;
 	size_t buffer_size;
@@ -133,6 +668,10 @@ struct ewah_iterator {
 	eword_t compressed, literals;
 	eword_t rl, lw;
 	bool b;
+
+	/* uncompressed word that will be yielded next */
+	size_t position;
+	const struct ewah_bitmap *parent;
 };
 
 /**
@@ -159,6 +698,19 @@ void ewah_iterator_init(struct ewah_iterator *it, struct ewah_bitmap *parent);
  */
 bool ewah_iterator_next(eword_t *next, struct ewah_iterator *it);
 
+/**
+ * Move the iterator forward so the next word yielded is the one holding
+ * the bit at `pos`. Iterators never move backwards: if that word has
+ * already been yielded, this is a no-op.
+ *
+ * Whole runs and literal blocks are skipped without being decoded, and
+ * if the bitmap has a skip index (see `ewah_build_index`) long jumps use
+ * it, so the cost depends on the distance in compressed words, not bits.
+ *
+ * Return: true if there are words left to yield, false otherwise
+ */
+bool ewah_iterator_advance_to(struct ewah_iterator *it, size_t pos);
+
 void ewah_or(
 	struct ewah_bitmap *bitmap_i,
 	struct ewah_bitmap *bitmap_j,
@@ -179,6 +731,124 @@ void ewah_and(
 	struct ewah_bitmap *bitmap_j,
 	struct ewah_bitmap *out);
 
+/**
+ * Number of bits set in the bitmap.
+ *
+ * The count is maintained as words are appended to the bitmap (and is
+ * stored in version 2 files), so this is O(1).
+ */
+size_t ewah_cardinality(struct ewah_bitmap *self);
+
+/**
+ * Position of the lowest (resp. highest) bit set in the bitmap, in O(1)
+ * like `ewah_cardinality`.
+ *
+ * Returns: false if the bitmap has no bits set, in which case `pos` is
+ * left untouched
+ */
+bool ewah_first_bit(struct ewah_bitmap *self, size_t *pos);
+bool ewah_last_bit(struct ewah_bitmap *self, size_t *pos);
+
+/**
+ * Number of bits set in the result of the corresponding logical
+ * operation, e.g. `ewah_and_cardinality(a, b)` is the cardinality of
+ * `ewah_and(a, b, out)`.
+ *
+ * The result is never materialized: both bitmaps are walked side by
+ * side and no output buffer is allocated.
+ */
+size_t ewah_and_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j);
+size_t ewah_or_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j);
+size_t ewah_xor_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j);
+size_t ewah_and_not_cardinality(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j);
+
+/**
+ * Logical operations over an arbitrary number of bitmaps.
+ *
+ * All the `n` input bitmaps are walked in a single pass and the result
+ * is written once into `out`, instead of materializing the intermediate
+ * result of chaining the binary operations above. Long runs are skipped
+ * across all the inputs at once.
+ *
+ * Returns: 0 on success, -1 if the iteration state could not be allocated
+ */
+int ewah_or_many(struct ewah_bitmap **bitmaps, size_t n, struct ewah_bitmap *out);
+int ewah_and_many(struct ewah_bitmap **bitmaps, size_t n, struct ewah_bitmap *out);
+int ewah_xor_many(struct ewah_bitmap **bitmaps, size_t n, struct ewah_bitmap *out);
+
+/**
+ * Multithreaded versions of the binary operations, for very large inputs.
+ *
+ * The inputs are split at uncompressed word boundaries into up to
+ * `threads` partitions of similar compressed size (0 uses one thread per
+ * online CPU); each partition is computed on its own thread and the
+ * partial results are stitched together. The output is identical to the
+ * one of the sequential operation.
+ *
+ * Inputs too small to be worth splitting, or failures to allocate or to
+ * start the threads, fall back to running on the calling thread.
+ */
+void ewah_or_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads);
+void ewah_and_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads);
+void ewah_xor_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads);
+void ewah_and_not_parallel(
+	struct ewah_bitmap *bitmap_i, struct ewah_bitmap *bitmap_j,
+	struct ewah_bitmap *out, size_t threads);
+
+/**
+ * Expression trees over bitmaps, evaluated in a single streaming pass.
+ *
+ * Instead of chaining binary operations (and writing out every one of the
+ * intermediate results), build a tree with the leaves and operators of the
+ * whole expression and evaluate it once: all the leaves are walked at the
+ * same time, only the final result is written, and subtrees whose value is
+ * already decided over a long run are skipped.
+ *
+ * The constructors take ownership of their operands (and free them if they
+ * fail), so trees can be built in a single nested call; leaves only borrow
+ * their bitmap. Negation covers whole words up to the end of the longest
+ * leaf, like `ewah_not`.
+ *
+ * E.g. for (A & B) | (C & ~D):
+ *
+ *		struct ewah_expr *expr = ewah_expr_or(
+ *			ewah_expr_and(ewah_expr_leaf(a), ewah_expr_leaf(b)),
+ *			ewah_expr_and_not(ewah_expr_leaf(c), ewah_expr_leaf(d)));
+ *
+ *		ewah_expr_eval(expr, result);
+ *		ewah_expr_free(expr);
+ */
+struct ewah_expr;
+
+struct ewah_expr *ewah_expr_leaf(struct ewah_bitmap *bitmap);
+struct ewah_expr *ewah_expr_not(struct ewah_expr *expr);
+struct ewah_expr *ewah_expr_and(struct ewah_expr *left, struct ewah_expr *right);
+struct ewah_expr *ewah_expr_or(struct ewah_expr *left, struct ewah_expr *right);
+struct ewah_expr *ewah_expr_xor(struct ewah_expr *left, struct ewah_expr *right);
+struct ewah_expr *ewah_expr_and_not(struct ewah_expr *left, struct ewah_expr *right);
+
+/**
+ * Evaluate the expression, appending the result to `out`.
+ *
+ * Returns: 0 on success, -1 if the evaluation state could not be allocated
+ */
+int ewah_expr_eval(struct ewah_expr *expr, struct ewah_bitmap *out);
+
+/**
+ * Free the expression tree; the bitmaps of the leaves are left alone.
+ */
+void ewah_expr_free(struct ewah_expr *expr);
+
 void ewah_dump(struct ewah_bitmap *bitmap);
 
 void ewah_add_dirty_words(
@@ -191,14 +861,74 @@ void ewah_add_dirty_words(
 struct bitmap {
 	eword_t *words;
 	size_t word_alloc;
+	const struct ewah_allocator *allocator;
 };
 
 struct bitmap *bitmap_new(void);
+struct bitmap *bitmap_new_with_allocator(const struct ewah_allocator *allocator);
 void bitmap_set(struct bitmap *self, size_t pos);
 void bitmap_clear(struct bitmap *self, size_t pos);
 bool bitmap_get(struct bitmap *self, size_t pos);
+void bitmap_free(struct bitmap *self);
+
+/**
+ * Combine a compressed bitmap into an uncompressed one, in place:
+ * `self = self | other`, `self = self & other` and `self = self & ~other`.
+ *
+ * The compressed stream is walked directly, without decompressing it
+ * first: runs are set or cleared with memset (or skipped when they do not
+ * change anything), and literal words are combined with vector kernels.
+ * `bitmap_or_ewah` grows `self` at most once, to the size of `other`.
+ */
+void bitmap_or_ewah(struct bitmap *self, struct ewah_bitmap *other);
+void bitmap_and_ewah(struct bitmap *self, struct ewah_bitmap *other);
+void bitmap_andnot_ewah(struct bitmap *self, struct ewah_bitmap *other);
 
 struct ewah_bitmap * bitmap_to_ewah(struct bitmap *bitmap);
 struct bitmap *ewah_to_bitmap(struct ewah_bitmap *ewah);
 
+/**
+ * Hybrid bitmap: the bit space is cut into chunks of 64K bits and every
+ * non-empty chunk is kept in the smallest of three containers: a sorted
+ * array of 16-bit offsets, an uncompressed bitmap, or an EWAH run stream.
+ * Operations between two hybrid bitmaps are done chunk by chunk, with a
+ * dedicated algorithm for each pair of containers.
+ *
+ * Bits can be set in any order; `hybrid_optimize` picks the best container
+ * again for every chunk after a batch of `hybrid_set` calls.
+ */
+struct hybrid_bitmap;
+
+struct hybrid_bitmap *hybrid_new(void);
+void hybrid_free(struct hybrid_bitmap *self);
+bool hybrid_get(struct hybrid_bitmap *self, size_t pos);
+size_t hybrid_cardinality(struct hybrid_bitmap *self);
+void hybrid_optimize(struct hybrid_bitmap *self);
+
+/**
+ * Set the bit at `pos`, in any order.
+ *
+ * Returns: 0 on success, -1 if the container of its chunk could not be
+ * allocated; the bitmap is then left as it was
+ */
+int hybrid_set(struct hybrid_bitmap *self, size_t pos);
+
+/**
+ * Memory used by the bitmap, in bytes.
+ */
+size_t hybrid_size(struct hybrid_bitmap *self);
+
+struct hybrid_bitmap *hybrid_from_ewah(struct ewah_bitmap *ewah);
+struct ewah_bitmap *hybrid_to_ewah(struct hybrid_bitmap *self);
+
+/**
+ * Logical operations between hybrid bitmaps; the result is a new bitmap,
+ * or NULL if it could not be allocated. The conversions from and to EWAH
+ * return NULL in the same case.
+ */
+struct hybrid_bitmap *hybrid_and(struct hybrid_bitmap *a, struct hybrid_bitmap *b);
+struct hybrid_bitmap *hybrid_or(struct hybrid_bitmap *a, struct hybrid_bitmap *b);
+struct hybrid_bitmap *hybrid_xor(struct hybrid_bitmap *a, struct hybrid_bitmap *b);
+struct hybrid_bitmap *hybrid_and_not(struct hybrid_bitmap *a, struct hybrid_bitmap *b);
+
 #endif
@@ -0,0 +1,49 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Build of the 32-bit word variant of the library (see `ewok32.h`),
+ * next to the default one: every source file is compiled again with
+ * 32-bit words and the renamed symbols of `ewok32_names.h`.
+ *
+ * New source files must be added here, and their external symbols to
+ * `ewok32_names.h`. The allocators in `ewah_alloc.c` are shared.
+ *
+ * A build made entirely of 32-bit objects (`-DEWOK_WORD_BITS=32` for
+ * every file) does not need this file, and leaves it empty.
+ */
+#ifndef EWOK_WORD_BITS
+#define EWOK_WORD_BITS 32
+
+#include "bitmap.c"
+#include "ewah_append.c"
+#include "ewah_bitmap.c"
+#include "ewah_builder.c"
+#include "ewah_cardinality.c"
+#include "ewah_convert.c"
+#include "ewah_expr.c"
+#include "ewah_index.c"
+#include "ewah_io.c"
+#include "ewah_many.c"
+#include "ewah_parallel.c"
+#include "ewah_rlw.c"
+#include "ewah_simd.c"
+#include "hybrid.c"
+#endif
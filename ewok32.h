@@ -0,0 +1,64 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef __EWOK32_H__
+#define __EWOK32_H__
+
+/*
+ * 32-bit word variant of the library.
+ *
+ * The whole API of `ewok.h` is available with 32-bit words under
+ * prefixed names: `struct ewah32_bitmap`, `ewah32_new`, `ewah32_or`,
+ * `struct bitmap32`, `bitmap32_set`, `hybrid32_from_ewah`, ... The
+ * default 64-bit API stays available in the same compilation unit.
+ *
+ * Runs in a 32-bit bitmap are at most 2^16 words long and a group holds
+ * at most 2^15 literal words, so dense or very long bitmaps compress
+ * better with 64-bit words; very sparse ones are about half the size
+ * with 32-bit words.
+ */
+#include "ewok.h"
+
+#undef EWOK_WORD_BITS
+#define EWOK_WORD_BITS 32
+#include "ewok.h"
+
+#define EWOK32_UNDEF_NAMES
+#include "ewok32_names.h"
+#undef EWOK32_UNDEF_NAMES
+
+#undef EWOK_WORD_BITS
+#define EWOK_WORD_BITS 64
+
+/**
+ * Convert a bitmap between word widths. `dst` is cleared first.
+ *
+ * Returns: 0 on success, -1 on error (check errno)
+ */
+static inline int ewah32_from_ewah(struct ewah32_bitmap *dst, struct ewah_bitmap *src)
+{
+	return ewah32_import(dst, src->buffer, src->buffer_size, 64, src->bit_size);
+}
+
+static inline int ewah_from_ewah32(struct ewah_bitmap *dst, struct ewah32_bitmap *src)
+{
+	return ewah_import(dst, src->buffer, src->buffer_size, 32, src->bit_size);
+}
+
+#endif
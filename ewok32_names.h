@@ -0,0 +1,333 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Names of the 32-bit variant of the library.
+ *
+ * `ewok.h` includes this file when `EWOK_WORD_BITS` is 32, so all the
+ * code that follows (the library sources in `ewok32.c`, or the prototypes
+ * in `ewok32.h`) uses the prefixed names. With `EWOK32_UNDEF_NAMES`
+ * defined, the renames are undone instead.
+ *
+ * Every type and every external symbol of the library must be listed
+ * here, so the two variants do not clash at link time. The allocators
+ * and arenas do not depend on the word width and are shared.
+ */
+#ifndef EWOK32_UNDEF_NAMES
+
+/* types */
+#define eword_t eword32_t
+#define bitmap bitmap32
+#define ewah_bitmap ewah32_bitmap
+#define ewah_builder ewah32_builder
+#define ewah_decode_cursor ewah32_decode_cursor
+#define ewah_expr ewah32_expr
+#define ewah_index ewah32_index
+#define ewah_iterator ewah32_iterator
+#define ewah_read_fn ewah32_read_fn
+#define ewah_reader ewah32_reader
+#define ewah_shared ewah32_shared
+#define ewah_sink ewah32_sink
+#define hybrid_bitmap hybrid32_bitmap
+
+/* functions */
+#define bitmap_and_ewah bitmap32_and_ewah
+#define bitmap_andnot_ewah bitmap32_andnot_ewah
+#define bitmap_clear bitmap32_clear
+#define bitmap_compress bitmap32_compress
+#define bitmap_free bitmap32_free
+#define bitmap_get bitmap32_get
+#define bitmap_grow bitmap32_grow
+#define bitmap_new bitmap32_new
+#define bitmap_new_with_allocator bitmap32_new_with_allocator
+#define bitmap_or_ewah bitmap32_or_ewah
+#define bitmap_set bitmap32_set
+#define bitmap_to_ewah bitmap32_to_ewah
+#define ewah_add ewah32_add
+#define ewah_add_dirty_words ewah32_add_dirty_words
+#define ewah_add_empty_words ewah32_add_empty_words
+#define ewah_add_literal_block ewah32_add_literal_block
+#define ewah_add_sorted ewah32_add_sorted
+#define ewah_add_sorted32 ewah32_add_sorted32
+#define ewah_add_words ewah32_add_words
+#define ewah_and ewah32_and
+#define ewah_and_cardinality ewah32_and_cardinality
+#define ewah_and_files ewah32_and_files
+#define ewah_and_many ewah32_and_many
+#define ewah_and_not ewah32_and_not
+#define ewah_and_not_cardinality ewah32_and_not_cardinality
+#define ewah_and_not_files ewah32_and_not_files
+#define ewah_and_not_parallel ewah32_and_not_parallel
+#define ewah_and_parallel ewah32_and_parallel
+#define ewah_append ewah32_append
+#define ewah_build_index ewah32_build_index
+#define ewah_build_rank_index ewah32_build_rank_index
+#define ewah_builder_finish ewah32_builder_finish
+#define ewah_builder_new ewah32_builder_new
+#define ewah_builder_seal ewah32_builder_seal
+#define ewah_builder_set ewah32_builder_set
+#define ewah_cardinality ewah32_cardinality
+#define ewah_clone ewah32_clone
+#define ewah_compact ewah32_compact
+#define ewah_estimate_words ewah32_estimate_words
+#define ewah_first_bit ewah32_first_bit
+#define ewah_last_bit ewah32_last_bit
+#define ewah_clear ewah32_clear
+#define ewah_combine_words ewah32_combine_words
+#define ewah_decode_init ewah32_decode_init
+#define ewah_decode_positions ewah32_decode_positions
+#define ewah_decode_positions32 ewah32_decode_positions32
+#define ewah_deserialize ewah32_deserialize
+#define ewah_deserialize_index ewah32_deserialize_index
+#define ewah_dump ewah32_dump
+#define ewah_each_bit ewah32_each_bit
+#define ewah_expr_and ewah32_expr_and
+#define ewah_expr_and_not ewah32_expr_and_not
+#define ewah_expr_eval ewah32_expr_eval
+#define ewah_expr_free ewah32_expr_free
+#define ewah_expr_leaf ewah32_expr_leaf
+#define ewah_expr_not ewah32_expr_not
+#define ewah_expr_or ewah32_expr_or
+#define ewah_expr_xor ewah32_expr_xor
+#define ewah_free ewah32_free
+#define ewah_get ewah32_get
+#define ewah_import ewah32_import
+#define ewah_index_free ewah32_index_free
+#define ewah_index_reset ewah32_index_reset
+#define ewah_index_seek ewah32_index_seek
+#define ewah_iterator_advance_to ewah32_iterator_advance_to
+#define ewah_iterator_init ewah32_iterator_init
+#define ewah_iterator_next ewah32_iterator_next
+#define ewah_new ewah32_new
+#define ewah_new_with_allocator ewah32_new_with_allocator
+#define ewah_not ewah32_not
+#define ewah_or ewah32_or
+#define ewah_or_cardinality ewah32_or_cardinality
+#define ewah_or_files ewah32_or_files
+#define ewah_or_many ewah32_or_many
+#define ewah_or_parallel ewah32_or_parallel
+#define ewah_pop_word ewah32_pop_word
+#define ewah_rank ewah32_rank
+#define ewah_popcount_combined ewah32_popcount_combined
+#define ewah_popcount_words ewah32_popcount_words
+#define ewah_reader_and ewah32_reader_and
+#define ewah_reader_and_not ewah32_reader_and_not
+#define ewah_reader_bit_size ewah32_reader_bit_size
+#define ewah_reader_free ewah32_reader_free
+#define ewah_reader_load ewah32_reader_load
+#define ewah_reader_new ewah32_reader_new
+#define ewah_reader_new_cb ewah32_reader_new_cb
+#define ewah_reader_or ewah32_reader_or
+#define ewah_reader_xor ewah32_reader_xor
+#define ewah_recount ewah32_recount
+#define ewah_release_words ewah32_release_words
+#define ewah_reserve ewah32_reserve
+#define ewah_reserve_result ewah32_reserve_result
+#define ewah_result_words ewah32_result_words
+#define ewah_select ewah32_select
+#define ewah_select_bit ewah32_select_bit
+#define ewah_serialize ewah32_serialize
+#define ewah_serialize_index ewah32_serialize_index
+#define ewah_serialize_v2 ewah32_serialize_v2
+#define ewah_set ewah32_set
+#define ewah_set_range ewah32_set_range
+#define ewah_sink_finish ewah32_sink_finish
+#define ewah_splice ewah32_splice
+#define ewah_to_bitmap ewah32_to_bitmap
+#define ewah_view ewah32_view
+#define ewah_xor ewah32_xor
+#define ewah_xor_cardinality ewah32_xor_cardinality
+#define ewah_xor_files ewah32_xor_files
+#define ewah_xor_many ewah32_xor_many
+#define ewah_xor_parallel ewah32_xor_parallel
+#define hybrid_and hybrid32_and
+#define hybrid_and_not hybrid32_and_not
+#define hybrid_cardinality hybrid32_cardinality
+#define hybrid_free hybrid32_free
+#define hybrid_from_ewah hybrid32_from_ewah
+#define hybrid_get hybrid32_get
+#define hybrid_new hybrid32_new
+#define hybrid_optimize hybrid32_optimize
+#define hybrid_or hybrid32_or
+#define hybrid_set hybrid32_set
+#define hybrid_size hybrid32_size
+#define hybrid_to_ewah hybrid32_to_ewah
+#define hybrid_xor hybrid32_xor
+#define rlw_skip_to rlw32_skip_to
+#define rlwit_advance_to rlwit32_advance_to
+#define rlwit_combine rlwit32_combine
+#define rlwit_discard_first_words rlwit32_discard_first_words
+#define rlwit_discharge rlwit32_discharge
+#define rlwit_discharge_empty rlwit32_discharge_empty
+#define rlwit_init rlwit32_init
+#define rlwit_init_range rlwit32_init_range
+#define rlwit_init_reader rlwit32_init_reader
+#define rlwit_refill rlwit32_refill
+
+#else
+
+#undef eword_t
+#undef bitmap
+#undef ewah_bitmap
+#undef ewah_builder
+#undef ewah_decode_cursor
+#undef ewah_expr
+#undef ewah_index
+#undef ewah_iterator
+#undef ewah_read_fn
+#undef ewah_reader
+#undef ewah_shared
+#undef ewah_sink
+#undef hybrid_bitmap
+
+#undef bitmap_and_ewah
+#undef bitmap_andnot_ewah
+#undef bitmap_clear
+#undef bitmap_compress
+#undef bitmap_free
+#undef bitmap_get
+#undef bitmap_grow
+#undef bitmap_new
+#undef bitmap_new_with_allocator
+#undef bitmap_or_ewah
+#undef bitmap_set
+#undef bitmap_to_ewah
+#undef ewah_add
+#undef ewah_add_dirty_words
+#undef ewah_add_empty_words
+#undef ewah_add_literal_block
+#undef ewah_add_sorted
+#undef ewah_add_sorted32
+#undef ewah_add_words
+#undef ewah_and
+#undef ewah_and_cardinality
+#undef ewah_and_files
+#undef ewah_and_many
+#undef ewah_and_not
+#undef ewah_and_not_cardinality
+#undef ewah_and_not_files
+#undef ewah_and_not_parallel
+#undef ewah_and_parallel
+#undef ewah_append
+#undef ewah_build_index
+#undef ewah_build_rank_index
+#undef ewah_builder_finish
+#undef ewah_builder_new
+#undef ewah_builder_seal
+#undef ewah_builder_set
+#undef ewah_cardinality
+#undef ewah_clone
+#undef ewah_compact
+#undef ewah_estimate_words
+#undef ewah_first_bit
+#undef ewah_last_bit
+#undef ewah_clear
+#undef ewah_combine_words
+#undef ewah_decode_init
+#undef ewah_decode_positions
+#undef ewah_decode_positions32
+#undef ewah_deserialize
+#undef ewah_deserialize_index
+#undef ewah_dump
+#undef ewah_each_bit
+#undef ewah_expr_and
+#undef ewah_expr_and_not
+#undef ewah_expr_eval
+#undef ewah_expr_free
+#undef ewah_expr_leaf
+#undef ewah_expr_not
+#undef ewah_expr_or
+#undef ewah_expr_xor
+#undef ewah_free
+#undef ewah_get
+#undef ewah_import
+#undef ewah_index_free
+#undef ewah_index_reset
+#undef ewah_index_seek
+#undef ewah_iterator_advance_to
+#undef ewah_iterator_init
+#undef ewah_iterator_next
+#undef ewah_new
+#undef ewah_new_with_allocator
+#undef ewah_not
+#undef ewah_or
+#undef ewah_or_cardinality
+#undef ewah_or_files
+#undef ewah_or_many
+#undef ewah_or_parallel
+#undef ewah_pop_word
+#undef ewah_rank
+#undef ewah_popcount_combined
+#undef ewah_popcount_words
+#undef ewah_reader_and
+#undef ewah_reader_and_not
+#undef ewah_reader_bit_size
+#undef ewah_reader_free
+#undef ewah_reader_load
+#undef ewah_reader_new
+#undef ewah_reader_new_cb
+#undef ewah_reader_or
+#undef ewah_reader_xor
+#undef ewah_recount
+#undef ewah_release_words
+#undef ewah_reserve
+#undef ewah_reserve_result
+#undef ewah_result_words
+#undef ewah_select
+#undef ewah_select_bit
+#undef ewah_serialize
+#undef ewah_serialize_index
+#undef ewah_serialize_v2
+#undef ewah_set
+#undef ewah_set_range
+#undef ewah_sink_finish
+#undef ewah_splice
+#undef ewah_to_bitmap
+#undef ewah_view
+#undef ewah_xor
+#undef ewah_xor_cardinality
+#undef ewah_xor_files
+#undef ewah_xor_many
+#undef ewah_xor_parallel
+#undef hybrid_and
+#undef hybrid_and_not
+#undef hybrid_cardinality
+#undef hybrid_free
+#undef hybrid_from_ewah
+#undef hybrid_get
+#undef hybrid_new
+#undef hybrid_optimize
+#undef hybrid_or
+#undef hybrid_set
+#undef hybrid_size
+#undef hybrid_to_ewah
+#undef hybrid_xor
+#undef rlw_skip_to
+#undef rlwit_advance_to
+#undef rlwit_combine
+#undef rlwit_discard_first_words
+#undef rlwit_discharge
+#undef rlwit_discharge_empty
+#undef rlwit_init
+#undef rlwit_init_range
+#undef rlwit_init_reader
+#undef rlwit_refill
+
+#endif
@@ -30,7 +30,28 @@
 
 #define RLW_RUNNING_LEN_PLUS_BIT (((eword_t)1 << (RLW_RUNNING_BITS + 1)) - 1)
 
-static bool rlw_get_run_bit(const eword_t *word)
+static inline size_t min_size(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+static inline size_t max_size(size_t a, size_t b)
+{
+	return a > b ? a : b;
+}
+
+/* position of the lowest (resp. highest) bit set in a non-empty word */
+static inline unsigned word_low_bit(eword_t word)
+{
+	return __builtin_ctzll(word);
+}
+
+static inline unsigned word_high_bit(eword_t word)
+{
+	return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(word);
+}
+
+static inline bool rlw_get_run_bit(const eword_t *word)
 {
 	return *word & (eword_t)1;
 }
@@ -80,36 +101,262 @@ static inline eword_t rlw_size(const eword_t *self)
 	return rlw_get_running_len(self) + rlw_get_literal_words(self);
 }
 
+static inline void *ewah_alloc_mem(const struct ewah_allocator *a, size_t size)
+{
+	return a ? a->alloc(a->ctx, size) : ewah_malloc(size);
+}
+
+static inline void *ewah_resize_mem(
+	const struct ewah_allocator *a, void *ptr, size_t size)
+{
+	return a ? a->resize(a->ctx, ptr, size) : ewah_realloc(ptr, size);
+}
+
+static inline void ewah_release_mem(const struct ewah_allocator *a, void *ptr)
+{
+	if (a)
+		a->release(a->ctx, ptr);
+	else
+		ewah_dealloc(ptr);
+}
+
+#define EWAH_INDEX_DEFAULT_STRIDE 64
+
+struct ewah_index_sample {
+	size_t buffer_offset;
+	size_t word_offset;
+
+	/* set bits before the RLW, if the index is ranked */
+	size_t bit_offset;
+};
+
+struct ewah_index {
+	/* one sample every `stride` RLWs */
+	size_t stride;
+
+	/* whether the samples count the set bits before them */
+	bool ranked;
+
+	struct ewah_index_sample *samples;
+	size_t count, alloc;
+
+	/* next RLW to scan: offset in the buffer, first word, ordinal */
+	size_t scan_offset;
+	size_t scan_words;
+	size_t scan_rlws;
+	size_t scan_bits;
+};
+
+void ewah_index_reset(struct ewah_index *index);
+void ewah_index_free(struct ewah_index *index);
+
+/*
+ * Find the closest RLW that starts at or before the uncompressed word
+ * `word_pos`, using whatever part of the skip index has been built so
+ * far. Stores its offset in the buffer and the uncompressed word where
+ * it starts; both are 0 when there is no index.
+ */
+void ewah_index_seek(const struct ewah_bitmap *self, size_t word_pos,
+	size_t *buffer_offset, size_t *word_offset);
+
 struct rlw_iterator {
 	const eword_t *buffer;
 	size_t size;
 	size_t pointer;
 	size_t literal_word_start;
 
+	/* uncompressed word at the head of the iterator */
+	size_t position;
+
+	/* uncompressed word where the iterator runs dry */
+	size_t end;
+
+	/* bitmap being iterated, for its skip index */
+	const struct ewah_bitmap *parent;
+
+	/* stream the words come from, instead of a bitmap in memory */
+	struct ewah_reader *source;
+
 	struct {
 		const eword_t *word;
-		int literal_words;
-		int running_len;
-		int literal_word_offset;
+		size_t literal_words;
+		size_t running_len;
 		int running_bit;
 	} rlw;
 };
 
 void rlwit_init(struct rlw_iterator *it, struct ewah_bitmap *bitmap);
 void rlwit_discard_first_words(struct rlw_iterator *it, size_t x);
+
+/*
+ * Iterate only the uncompressed words from `start` to `end` of the
+ * bitmap, as if it started and stopped there. The groups before `start`
+ * are skipped over (through the skip index, if the bitmap has one) and
+ * the group holding `end` is cut short, so the words are never copied.
+ */
+void rlwit_init_range(struct rlw_iterator *it,
+	struct ewah_bitmap *bitmap, size_t start, size_t end);
+
+/*
+ * Iterate the words of a serialized bitmap as they are read by `reader`.
+ * The buffer of the iterator only ever holds whole RLW groups (long
+ * groups are cut in pieces), and is refilled by `rlwit_refill` once the
+ * iterator is past all of them.
+ */
+void rlwit_init_reader(struct rlw_iterator *it, struct ewah_reader *reader);
+bool rlwit_refill(struct rlw_iterator *it);
+
+/*
+ * Move the iterator forward so its head is at the uncompressed word
+ * `pos`. Whole RLW groups are skipped by looking only at their headers,
+ * and far jumps go through the skip index of the bitmap, if it has one.
+ */
+void rlwit_advance_to(struct rlw_iterator *it, size_t pos);
+
+/*
+ * Walk the RLW headers of `buffer`, starting with the group at `*pointer`
+ * (which starts at the uncompressed word `words`), until the group that
+ * contains the uncompressed word `target`. After walking as many headers
+ * as the stride of the skip index of `parent` (if any), the index is used
+ * to jump closer to the target.
+ *
+ * Returns the uncompressed word where the group at `*pointer` starts;
+ * `*pointer` is past the end of the buffer if `target` is beyond it.
+ */
+size_t rlw_skip_to(const struct ewah_bitmap *parent,
+	const eword_t *buffer, size_t size,
+	size_t *pointer, size_t words, size_t target);
 size_t rlwit_discharge(
 	struct rlw_iterator *it, struct ewah_bitmap *out, size_t max, bool negate);
 void rlwit_discharge_empty(struct rlw_iterator *it, struct ewah_bitmap *out);
 
+enum ewah_literal_op {
+	EWAH_LITERAL_AND,
+	EWAH_LITERAL_OR,
+	EWAH_LITERAL_XOR,
+	EWAH_LITERAL_AND_NOT
+};
+
+/*
+ * Write to `out` the result of the logical operation `op` between the
+ * words left in two iterators, as `ewah_and` and friends do. The bit
+ * size of `out` is left for the caller to set.
+ */
+void rlwit_combine(struct rlw_iterator *rlw_i, struct rlw_iterator *rlw_j,
+	struct ewah_bitmap *out, enum ewah_literal_op op);
+
+/*
+ * Combine `n` literal words from `a` and `b` into `dst` with the vector
+ * kernel for `op`. Returns true if any of the resulting words is empty
+ * (all zeros or all ones). `dst` may be the same as `a`.
+ */
+bool ewah_combine_words(
+	eword_t *dst, const eword_t *a, const eword_t *b, size_t n,
+	enum ewah_literal_op op);
+
+/*
+ * Number of set bits in a block of words, or in the result of combining
+ * two blocks with `op`, using the hardware popcount when available.
+ */
+size_t ewah_popcount_words(const eword_t *words, size_t n);
+size_t ewah_popcount_combined(
+	const eword_t *a, const eword_t *b, size_t n, enum ewah_literal_op op);
+
+/*
+ * Upper bound on the number of words of the result of the logical
+ * operation `op` between `n` bitmaps, and the reservation in `out` of
+ * that many words past its current end, so the operation does not have
+ * to grow it as it goes.
+ */
+size_t ewah_estimate_words(
+	struct ewah_bitmap **bitmaps, size_t n, enum ewah_literal_op op);
+void ewah_reserve_result(struct ewah_bitmap *out,
+	struct ewah_bitmap **bitmaps, size_t n, enum ewah_literal_op op);
+
+/*
+ * Recompute the bit count and the first and last bit of a bitmap whose
+ * words were written without going through the append functions.
+ */
+void ewah_recount(struct ewah_bitmap *self);
+
+/*
+ * Position of the set bit with rank `k` in `word`, which must have more
+ * than `k` bits set.
+ */
+unsigned ewah_select_bit(eword_t word, size_t k);
+
+/*
+ * Output of a bitmap that is written out as it grows: once the buffer
+ * is full, the words before the last RLW (which may still change) are
+ * passed to `flush` and dropped from memory, and RLW groups are kept
+ * short, so the buffer never grows past a few groups. Only the append
+ * functions may be used on such a bitmap.
+ */
+#define EWAH_SINK_GROUP_WORDS 4096
+
+struct ewah_sink {
+	void (*flush)(struct ewah_sink *sink, const eword_t *words, size_t n);
+
+	/* number of words flushed so far */
+	size_t flushed;
+};
+
+/*
+ * Flush all the words of a bitmap with a sink, including the last RLW
+ * group, once nothing else will be appended to it.
+ */
+void ewah_sink_finish(struct ewah_bitmap *self);
+
+/*
+ * Append uncompressed words to the bitmap, folding empty words into
+ * runs. Same result as calling `ewah_add` for every word.
+ */
+void ewah_add_words(struct ewah_bitmap *self, const eword_t *words, size_t n);
+
+/*
+ * Append all the words of `src` after the last whole word of `self`,
+ * encoded as if they had been appended one at a time. Only the groups
+ * until the writer of `self` is in step with that of `src` are replayed:
+ * the rest of the compressed words are copied as they are.
+ */
+void ewah_splice(struct ewah_bitmap *self, struct ewah_bitmap *src);
+
+/*
+ * Remove the last uncompressed word of the bitmap and return it, so a
+ * partially filled word can be completed and appended again. Only the
+ * last RLW is touched, so the skip index stays valid.
+ *
+ * The bit count drops by the bits of the word, but the first and last
+ * bit are left alone: callers must append the word back, with at least
+ * the bits it had.
+ */
+eword_t ewah_pop_word(struct ewah_bitmap *self);
+
+/*
+ * Let go of the words of the bitmap before replacing them: shared words
+ * are only freed by the last clone holding them, and the mapping of a
+ * view is never freed. The bitmap is left without words.
+ */
+void ewah_release_words(struct ewah_bitmap *self);
+
+/*
+ * Resize the words of an uncompressed bitmap to `word_alloc`, clearing
+ * the new ones. Returns -1, leaving the bitmap as it was, if they could
+ * not be allocated.
+ */
+int bitmap_grow(struct bitmap *self, size_t word_alloc);
+
+/*
+ * Append the result of combining two blocks of literal words.
+ */
+void ewah_add_literal_block(
+	struct ewah_bitmap *self, const eword_t *a, const eword_t *b, size_t n,
+	enum ewah_literal_op op);
+
 static inline size_t rlwit_word_size(struct rlw_iterator *it)
 {
 	return it->rlw.running_len + it->rlw.literal_words;
 }
 
-static inline size_t rlwit_literal_words(struct rlw_iterator *it)
-{
-	return it->pointer - it->rlw.literal_words;
-}
-
 #endif
 
@@ -0,0 +1,877 @@
+/**
+ * Copyright 2013, GitHub, Inc
+ * Copyright 2009-2013, Daniel Lemire, Cliff Moon,
+ *	David McIntosh, Robert Becho, Google Inc. and Veronika Zenz
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "ewok.h"
+#include "ewok_rlw.h"
+
+/*
+ * Hybrid bitmaps.
+ *
+ * The universe is split into chunks of 64K bits, and every chunk with
+ * any bit set is stored in whichever container is smallest for it:
+ *
+ *	- a sorted array of 16-bit offsets, for sparse chunks;
+ *	- an uncompressed `struct bitmap`, for dense scattered chunks;
+ *	- an `ewah_bitmap`, for chunks made of runs.
+ *
+ * Binary operations work chunk by chunk. Pairs of containers with a
+ * cheap direct algorithm (merging arrays, filtering an array through a
+ * bitmap, word kernels between bitmaps, folding a run stream into a
+ * bitmap...) use it; the rest go through the uncompressed words of the
+ * chunk. Every result is then stored in its own best container.
+ */
+
+#define CHUNK_BITS (1 << 16)
+#define CHUNK_WORDS (CHUNK_BITS / BITS_IN_WORD)
+
+/* past this many bits, an array takes more room than a bitset */
+#define ARRAY_MAX (CHUNK_BITS / 16)
+
+enum container {
+	CONTAINER_ARRAY,
+	CONTAINER_BITSET,
+	CONTAINER_RUN
+};
+
+struct hybrid_chunk {
+	size_t key;
+	enum container type;
+	size_t cardinality;
+
+	union {
+		uint16_t *array;
+		struct bitmap *bitset;
+		struct ewah_bitmap *run;
+	} u;
+};
+
+struct hybrid_bitmap {
+	struct hybrid_chunk *chunks;
+	size_t count, alloc;
+};
+
+static void chunk_free(struct hybrid_chunk *chunk)
+{
+	switch (chunk->type) {
+	case CONTAINER_ARRAY:
+		ewah_dealloc(chunk->u.array);
+		break;
+	case CONTAINER_BITSET:
+		bitmap_free(chunk->u.bitset);
+		break;
+	case CONTAINER_RUN:
+		ewah_free(chunk->u.run);
+		break;
+	}
+}
+
+/* the uncompressed words of the chunk */
+static void chunk_words(const struct hybrid_chunk *chunk, eword_t *words)
+{
+	size_t i;
+
+	switch (chunk->type) {
+	case CONTAINER_ARRAY:
+		memset(words, 0x0, CHUNK_WORDS * sizeof(eword_t));
+		for (i = 0; i < chunk->cardinality; ++i) {
+			const uint16_t v = chunk->u.array[i];
+			words[v / BITS_IN_WORD] |= (eword_t)1 << (v % BITS_IN_WORD);
+		}
+		break;
+
+	case CONTAINER_BITSET:
+		memcpy(words, chunk->u.bitset->words, CHUNK_WORDS * sizeof(eword_t));
+		break;
+
+	case CONTAINER_RUN: {
+		struct ewah_iterator it;
+		eword_t word;
+
+		memset(words, 0x0, CHUNK_WORDS * sizeof(eword_t));
+		ewah_iterator_init(&it, chunk->u.run);
+
+		for (i = 0; i < CHUNK_WORDS && ewah_iterator_next(&word, &it); ++i)
+			words[i] = word;
+		break;
+	}
+	}
+}
+
+/*
+ * Number of words EWAH needs for `n` uncompressed words: one RLW for
+ * every group of a run (of a single kind) followed by dirty words, plus
+ * the dirty words themselves.
+ */
+static size_t run_size(const eword_t *words, size_t n)
+{
+	size_t i = 0, size = 0;
+
+	while (i < n) {
+		size++;
+
+		if (words[i] == 0 || words[i] == (eword_t)(~0)) {
+			const eword_t kind = words[i];
+
+			while (i < n && words[i] == kind)
+				i++;
+		}
+
+		while (i < n && words[i] != 0 && words[i] != (eword_t)(~0)) {
+			size++;
+			i++;
+		}
+	}
+
+	return size;
+}
+
+/* a bitset container holding the first `n` uncompressed words of a chunk */
+static struct bitmap *bitset_new(const eword_t *words, size_t n)
+{
+	struct bitmap *bitset = bitmap_new();
+
+	if (bitset == NULL)
+		return NULL;
+
+	if (bitmap_grow(bitset, CHUNK_WORDS) < 0) {
+		bitmap_free(bitset);
+		return NULL;
+	}
+
+	memcpy(bitset->words, words, n * sizeof(eword_t));
+	return bitset;
+}
+
+/*
+ * Store the chunk with the given uncompressed words in its smallest
+ * container. Returns 1 once it is stored, 0 (storing nothing) if the
+ * chunk is empty, or -1 if the container could not be allocated.
+ */
+static int chunk_from_words(struct hybrid_chunk *chunk, const eword_t *words)
+{
+	size_t n = CHUNK_WORDS, cardinality, array_bytes, run_bytes;
+
+	while (n > 0 && words[n - 1] == 0)
+		n--;
+
+	if (n == 0)
+		return 0;
+
+	cardinality = ewah_popcount_words(words, n);
+	array_bytes = cardinality * sizeof(uint16_t);
+	run_bytes = (run_size(words, n) + 1) * sizeof(eword_t);
+
+	chunk->cardinality = cardinality;
+
+	if (run_bytes < array_bytes && run_bytes < CHUNK_WORDS * sizeof(eword_t)) {
+		chunk->type = CONTAINER_RUN;
+		chunk->u.run = ewah_new();
+		if (chunk->u.run == NULL)
+			return -1;
+
+		ewah_add_words(chunk->u.run, words, n);
+	} else if (cardinality <= ARRAY_MAX) {
+		size_t i, k = 0;
+
+		chunk->type = CONTAINER_ARRAY;
+		chunk->u.array = ewah_malloc(cardinality * sizeof(uint16_t));
+		if (chunk->u.array == NULL)
+			return -1;
+
+		for (i = 0; i < n; ++i) {
+			eword_t w = words[i];
+
+			while (w) {
+				chunk->u.array[k++] = i * BITS_IN_WORD + __builtin_ctzll(w);
+				w &= w - 1;
+			}
+		}
+	} else {
+		chunk->type = CONTAINER_BITSET;
+		chunk->u.bitset = bitset_new(words, n);
+		if (chunk->u.bitset == NULL)
+			return -1;
+	}
+
+	return 1;
+}
+
+static int chunk_from_array(
+	struct hybrid_chunk *chunk, uint16_t *array, size_t cardinality)
+{
+	if (cardinality == 0) {
+		ewah_dealloc(array);
+		return 0;
+	}
+
+	chunk->type = CONTAINER_ARRAY;
+	chunk->cardinality = cardinality;
+	chunk->u.array = array;
+	return 1;
+}
+
+static bool chunk_get(struct hybrid_chunk *chunk, uint16_t v)
+{
+	switch (chunk->type) {
+	case CONTAINER_ARRAY: {
+		size_t lo = 0, hi = chunk->cardinality;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (chunk->u.array[mid] < v)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return lo < chunk->cardinality && chunk->u.array[lo] == v;
+	}
+
+	case CONTAINER_BITSET:
+		return bitmap_get(chunk->u.bitset, v);
+
+	case CONTAINER_RUN:
+		return ewah_get(chunk->u.run, v);
+	}
+
+	return false;
+}
+
+/* same return values as `chunk_from_words`, for a chunk that is never empty */
+static int chunk_copy(struct hybrid_chunk *dst, const struct hybrid_chunk *src)
+{
+	*dst = *src;
+
+	switch (src->type) {
+	case CONTAINER_ARRAY:
+		dst->u.array = ewah_malloc(src->cardinality * sizeof(uint16_t));
+		if (dst->u.array == NULL)
+			return -1;
+
+		memcpy(dst->u.array, src->u.array, src->cardinality * sizeof(uint16_t));
+		break;
+
+	case CONTAINER_BITSET:
+		dst->u.bitset = bitset_new(src->u.bitset->words, CHUNK_WORDS);
+		if (dst->u.bitset == NULL)
+			return -1;
+		break;
+
+	case CONTAINER_RUN:
+		/* the compressed words are copied as they are */
+		dst->u.run = ewah_new();
+		if (dst->u.run == NULL)
+			return -1;
+
+		ewah_splice(dst->u.run, src->u.run);
+		if (dst->u.run->bit_size != src->u.run->bit_size) {
+			ewah_free(dst->u.run);
+			return -1;
+		}
+		break;
+	}
+
+	return 1;
+}
+
+/* merge two sorted arrays */
+static int array_array(struct hybrid_chunk *out,
+	const struct hybrid_chunk *a, const struct hybrid_chunk *b,
+	enum ewah_literal_op op)
+{
+	const uint16_t *x = a->u.array, *y = b->u.array;
+	size_t i = 0, j = 0, n = 0;
+	uint16_t *r = ewah_malloc((a->cardinality + b->cardinality) * sizeof(uint16_t));
+
+	if (r == NULL)
+		return -1;
+
+	while (i < a->cardinality && j < b->cardinality) {
+		if (x[i] < y[j]) {
+			if (op != EWAH_LITERAL_AND)
+				r[n++] = x[i];
+			i++;
+		} else if (x[i] > y[j]) {
+			if (op == EWAH_LITERAL_OR || op == EWAH_LITERAL_XOR)
+				r[n++] = y[j];
+			j++;
+		} else {
+			if (op == EWAH_LITERAL_OR || op == EWAH_LITERAL_AND)
+				r[n++] = x[i];
+			i++, j++;
+		}
+	}
+
+	if (op != EWAH_LITERAL_AND) {
+		while (i < a->cardinality)
+			r[n++] = x[i++];
+	}
+
+	if (op == EWAH_LITERAL_OR || op == EWAH_LITERAL_XOR) {
+		while (j < b->cardinality)
+			r[n++] = y[j++];
+	}
+
+	if (n > ARRAY_MAX) {
+		struct hybrid_chunk tmp;
+		eword_t words[CHUNK_WORDS];
+
+		chunk_from_array(&tmp, r, n);
+		chunk_words(&tmp, words);
+		ewah_dealloc(r);
+		return chunk_from_words(out, words);
+	}
+
+	return chunk_from_array(out, r, n);
+}
+
+/* keep the values of an array that are (or are not) in another container */
+static int array_filter(struct hybrid_chunk *out,
+	const struct hybrid_chunk *a, struct hybrid_chunk *b, bool keep)
+{
+	uint16_t *r = ewah_malloc(a->cardinality * sizeof(uint16_t));
+	size_t i, n = 0;
+
+	if (r == NULL)
+		return -1;
+
+	for (i = 0; i < a->cardinality; ++i) {
+		if (chunk_get(b, a->u.array[i]) == keep)
+			r[n++] = a->u.array[i];
+	}
+
+	return chunk_from_array(out, r, n);
+}
+
+/* a bitset combined in place with a run stream */
+static int bitset_run(struct hybrid_chunk *out,
+	const struct hybrid_chunk *a, const struct hybrid_chunk *b,
+	enum ewah_literal_op op)
+{
+	struct bitmap *bitset = bitset_new(a->u.bitset->words, CHUNK_WORDS);
+	int ok;
+
+	if (bitset == NULL)
+		return -1;
+
+	if (op == EWAH_LITERAL_OR)
+		bitmap_or_ewah(bitset, b->u.run);
+	else if (op == EWAH_LITERAL_AND)
+		bitmap_and_ewah(bitset, b->u.run);
+	else
+		bitmap_andnot_ewah(bitset, b->u.run);
+
+	ok = chunk_from_words(out, bitset->words);
+	bitmap_free(bitset);
+	return ok;
+}
+
+static int run_run(struct hybrid_chunk *out,
+	const struct hybrid_chunk *a, const struct hybrid_chunk *b,
+	enum ewah_literal_op op)
+{
+	struct ewah_bitmap *r = ewah_new();
+	eword_t words[CHUNK_WORDS];
+	int ok;
+
+	if (r == NULL)
+		return -1;
+
+	switch (op) {
+	case EWAH_LITERAL_AND:
+		ewah_and(a->u.run, b->u.run, r);
+		break;
+	case EWAH_LITERAL_OR:
+		ewah_or(a->u.run, b->u.run, r);
+		break;
+	case EWAH_LITERAL_XOR:
+		ewah_xor(a->u.run, b->u.run, r);
+		break;
+	case EWAH_LITERAL_AND_NOT:
+		ewah_and_not(a->u.run, b->u.run, r);
+		break;
+	}
+
+	/* runs combined usually stay runs: keep the result as it is */
+	if (r->buffer_size * sizeof(eword_t) < ewah_cardinality(r) * sizeof(uint16_t) &&
+		r->buffer_size < CHUNK_WORDS) {
+		out->type = CONTAINER_RUN;
+		out->cardinality = ewah_cardinality(r);
+		out->u.run = r;
+		return 1;
+	}
+
+	{
+		struct hybrid_chunk tmp;
+
+		tmp.type = CONTAINER_RUN;
+		tmp.u.run = r;
+		chunk_words(&tmp, words);
+	}
+
+	ok = chunk_from_words(out, words);
+	ewah_free(r);
+	return ok;
+}
+
+static int chunk_combine(struct hybrid_chunk *out,
+	struct hybrid_chunk *a, struct hybrid_chunk *b, enum ewah_literal_op op)
+{
+	eword_t wa[CHUNK_WORDS], wb[CHUNK_WORDS];
+	const bool commutes = (op != EWAH_LITERAL_AND_NOT);
+
+	out->key = a->key;
+
+	if (a->type == CONTAINER_ARRAY && b->type == CONTAINER_ARRAY)
+		return array_array(out, a, b, op);
+
+	if (a->type == CONTAINER_ARRAY && op == EWAH_LITERAL_AND)
+		return array_filter(out, a, b, true);
+	if (b->type == CONTAINER_ARRAY && op == EWAH_LITERAL_AND)
+		return array_filter(out, b, a, true);
+	if (a->type == CONTAINER_ARRAY && op == EWAH_LITERAL_AND_NOT)
+		return array_filter(out, a, b, false);
+
+	if (a->type == CONTAINER_RUN && b->type == CONTAINER_RUN)
+		return run_run(out, a, b, op);
+
+	if (a->type == CONTAINER_BITSET && b->type == CONTAINER_RUN && op != EWAH_LITERAL_XOR)
+		return bitset_run(out, a, b, op);
+	if (b->type == CONTAINER_BITSET && a->type == CONTAINER_RUN && commutes &&
+		op != EWAH_LITERAL_XOR)
+		return bitset_run(out, b, a, op);
+
+	/* everything else goes through the uncompressed words */
+	chunk_words(a, wa);
+	chunk_words(b, wb);
+	ewah_combine_words(wa, wa, wb, CHUNK_WORDS, op);
+
+	return chunk_from_words(out, wa);
+}
+
+struct hybrid_bitmap *hybrid_new(void)
+{
+	struct hybrid_bitmap *self = ewah_malloc(sizeof(struct hybrid_bitmap));
+	if (self == NULL)
+		return NULL;
+
+	self->chunks = NULL;
+	self->count = 0;
+	self->alloc = 0;
+	return self;
+}
+
+void hybrid_free(struct hybrid_bitmap *self)
+{
+	size_t i;
+
+	for (i = 0; i < self->count; ++i)
+		chunk_free(&self->chunks[i]);
+
+	ewah_dealloc(self->chunks);
+	ewah_dealloc(self);
+}
+
+/* a new slot at the end of the chunks, or NULL if there is no room */
+static struct hybrid_chunk *push_chunk(struct hybrid_bitmap *self)
+{
+	if (self->count == self->alloc) {
+		const size_t alloc = self->alloc ? self->alloc * 2 : 16;
+		struct hybrid_chunk *chunks = ewah_realloc(self->chunks,
+			alloc * sizeof(struct hybrid_chunk));
+
+		if (chunks == NULL)
+			return NULL;
+
+		self->chunks = chunks;
+		self->alloc = alloc;
+	}
+
+	return &self->chunks[self->count++];
+}
+
+/* index of the chunk with `key`, or where it would be inserted */
+static size_t find_chunk(struct hybrid_bitmap *self, size_t key)
+{
+	size_t lo = 0, hi = self->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (self->chunks[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int hybrid_set(struct hybrid_bitmap *self, size_t pos)
+{
+	const size_t key = pos / CHUNK_BITS;
+	const uint16_t v = pos % CHUNK_BITS;
+	size_t i = find_chunk(self, key);
+	struct hybrid_chunk *chunk;
+
+	if (i == self->count || self->chunks[i].key != key) {
+		if (push_chunk(self) == NULL)
+			return -1;
+
+		memmove(&self->chunks[i + 1], &self->chunks[i],
+			(self->count - 1 - i) * sizeof(struct hybrid_chunk));
+
+		chunk = &self->chunks[i];
+		chunk->key = key;
+		chunk->type = CONTAINER_ARRAY;
+		chunk->cardinality = 0;
+		chunk->u.array = NULL;
+	}
+
+	chunk = &self->chunks[i];
+
+	if (chunk_get(chunk, v))
+		return 0;
+
+	/* runs are only built in bulk; change them back into a bitset */
+	if (chunk->type == CONTAINER_RUN ||
+		(chunk->type == CONTAINER_ARRAY && chunk->cardinality == ARRAY_MAX)) {
+		eword_t words[CHUNK_WORDS];
+		struct bitmap *bitset;
+
+		chunk_words(chunk, words);
+
+		bitset = bitset_new(words, CHUNK_WORDS);
+		if (bitset == NULL)
+			return -1;
+
+		chunk_free(chunk);
+		chunk->type = CONTAINER_BITSET;
+		chunk->u.bitset = bitset;
+	}
+
+	if (chunk->type == CONTAINER_BITSET) {
+		bitmap_set(chunk->u.bitset, v);
+	} else {
+		size_t lo = 0, hi = chunk->cardinality;
+		uint16_t *array;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (chunk->u.array[mid] < v)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		array = ewah_realloc(chunk->u.array,
+			(chunk->cardinality + 1) * sizeof(uint16_t));
+		if (array == NULL) {
+			/* a chunk that was just inserted must not stay empty */
+			if (chunk->cardinality == 0) {
+				self->count--;
+				memmove(&self->chunks[i], &self->chunks[i + 1],
+					(self->count - i) * sizeof(struct hybrid_chunk));
+			}
+			return -1;
+		}
+
+		chunk->u.array = array;
+		memmove(chunk->u.array + lo + 1, chunk->u.array + lo,
+			(chunk->cardinality - lo) * sizeof(uint16_t));
+		chunk->u.array[lo] = v;
+	}
+
+	chunk->cardinality++;
+	return 0;
+}
+
+bool hybrid_get(struct hybrid_bitmap *self, size_t pos)
+{
+	size_t i = find_chunk(self, pos / CHUNK_BITS);
+
+	if (i == self->count || self->chunks[i].key != pos / CHUNK_BITS)
+		return false;
+
+	return chunk_get(&self->chunks[i], pos % CHUNK_BITS);
+}
+
+size_t hybrid_cardinality(struct hybrid_bitmap *self)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < self->count; ++i)
+		count += self->chunks[i].cardinality;
+
+	return count;
+}
+
+size_t hybrid_size(struct hybrid_bitmap *self)
+{
+	size_t i, size = sizeof(struct hybrid_bitmap) +
+		self->alloc * sizeof(struct hybrid_chunk);
+
+	for (i = 0; i < self->count; ++i) {
+		struct hybrid_chunk *chunk = &self->chunks[i];
+
+		switch (chunk->type) {
+		case CONTAINER_ARRAY:
+			size += chunk->cardinality * sizeof(uint16_t);
+			break;
+		case CONTAINER_BITSET:
+			size += sizeof(struct bitmap) +
+				chunk->u.bitset->word_alloc * sizeof(eword_t);
+			break;
+		case CONTAINER_RUN:
+			size += sizeof(struct ewah_bitmap) +
+				chunk->u.run->alloc_size * sizeof(eword_t);
+			break;
+		}
+	}
+
+	return size;
+}
+
+void hybrid_optimize(struct hybrid_bitmap *self)
+{
+	eword_t words[CHUNK_WORDS];
+	size_t i;
+
+	for (i = 0; i < self->count; ++i) {
+		struct hybrid_chunk *chunk = &self->chunks[i], best = *chunk;
+
+		/* a chunk that cannot be moved keeps the container it has */
+		chunk_words(chunk, words);
+		if (chunk_from_words(&best, words) > 0) {
+			chunk_free(chunk);
+			*chunk = best;
+		}
+	}
+}
+
+/*
+ * Conversion from EWAH: the RLW stream is cut at chunk boundaries, the
+ * words of every chunk are gathered and stored in the best container.
+ * Runs of zeros are skipped over without touching any chunk.
+ */
+struct chunk_feed {
+	struct hybrid_bitmap *out;
+	eword_t words[CHUNK_WORDS];
+	size_t key, pos;
+	bool dirty, failed;
+};
+
+static void feed_flush(struct chunk_feed *feed)
+{
+	if (feed->dirty) {
+		struct hybrid_chunk chunk, *slot = NULL;
+		int stored;
+
+		chunk.key = feed->key;
+		stored = chunk_from_words(&chunk, feed->words);
+
+		if (stored > 0) {
+			slot = push_chunk(feed->out);
+			if (slot)
+				*slot = chunk;
+			else
+				chunk_free(&chunk);
+		}
+
+		if (stored < 0 || (stored > 0 && slot == NULL))
+			feed->failed = true;
+
+		memset(feed->words, 0x0, sizeof(feed->words));
+		feed->dirty = false;
+	}
+}
+
+static void feed_words(struct chunk_feed *feed,
+	const eword_t *src, eword_t fill, size_t len)
+{
+	while (len > 0) {
+		const size_t offset = feed->pos % CHUNK_WORDS;
+		const size_t n = min_size(len, CHUNK_WORDS - offset);
+
+		if (feed->pos / CHUNK_WORDS != feed->key) {
+			feed_flush(feed);
+			feed->key = feed->pos / CHUNK_WORDS;
+		}
+
+		if (src) {
+			memcpy(feed->words + offset, src, n * sizeof(eword_t));
+			src += n;
+			feed->dirty = true;
+		} else if (fill) {
+			memset(feed->words + offset, 0xFF, n * sizeof(eword_t));
+			feed->dirty = true;
+		}
+
+		feed->pos += n;
+		len -= n;
+	}
+}
+
+struct hybrid_bitmap *hybrid_from_ewah(struct ewah_bitmap *ewah)
+{
+	struct chunk_feed *feed = ewah_malloc(sizeof(struct chunk_feed));
+	struct hybrid_bitmap *self = hybrid_new();
+	size_t pointer = 0;
+
+	if (feed == NULL || self == NULL) {
+		ewah_dealloc(feed);
+		ewah_dealloc(self);
+		return NULL;
+	}
+
+	memset(feed, 0x0, sizeof(struct chunk_feed));
+	feed->out = self;
+
+	while (pointer < ewah->buffer_size) {
+		const eword_t *word = ewah->buffer + pointer;
+		const size_t run = rlw_get_running_len(word);
+		const size_t literals = rlw_get_literal_words(word);
+
+		if (rlw_get_run_bit(word))
+			feed_words(feed, NULL, 1, run);
+		else
+			feed->pos += run;
+
+		feed_words(feed, word + 1, 0, literals);
+		pointer += 1 + literals;
+	}
+
+	feed_flush(feed);
+
+	if (feed->failed) {
+		hybrid_free(self);
+		self = NULL;
+	}
+
+	ewah_dealloc(feed);
+	return self;
+}
+
+struct ewah_bitmap *hybrid_to_ewah(struct hybrid_bitmap *self)
+{
+	struct ewah_bitmap *ewah = ewah_new();
+	eword_t words[CHUNK_WORDS];
+	size_t i, pos = 0;
+
+	if (ewah == NULL)
+		return NULL;
+
+	for (i = 0; i < self->count; ++i) {
+		struct hybrid_chunk *chunk = &self->chunks[i];
+		size_t n = CHUNK_WORDS;
+
+		ewah_add_empty_words(ewah, false, chunk->key * CHUNK_WORDS - pos);
+
+		chunk_words(chunk, words);
+		while (n > 0 && words[n - 1] == 0)
+			n--;
+
+		ewah_add_words(ewah, words, n);
+		pos = chunk->key * CHUNK_WORDS + n;
+
+		/* the bitmap ends right after its highest bit */
+		ewah->bit_size = (pos - 1) * BITS_IN_WORD +
+			(sizeof(unsigned long long) * 8 - __builtin_clzll(words[n - 1]));
+	}
+
+	return ewah;
+}
+
+static struct hybrid_bitmap *hybrid_op(
+	struct hybrid_bitmap *a, struct hybrid_bitmap *b, enum ewah_literal_op op)
+{
+	struct hybrid_bitmap *out = hybrid_new();
+	size_t i = 0, j = 0;
+
+	if (out == NULL)
+		return NULL;
+
+	while (i < a->count || j < b->count) {
+		struct hybrid_chunk *ca = i < a->count ? &a->chunks[i] : NULL;
+		struct hybrid_chunk *cb = j < b->count ? &b->chunks[j] : NULL;
+		struct hybrid_chunk chunk, *slot;
+		int stored = 0;
+
+		if (ca && (!cb || ca->key < cb->key)) {
+			/* only in `a` */
+			if (op != EWAH_LITERAL_AND)
+				stored = chunk_copy(&chunk, ca);
+			i++;
+		} else if (cb && (!ca || cb->key < ca->key)) {
+			/* only in `b` */
+			if (op == EWAH_LITERAL_OR || op == EWAH_LITERAL_XOR)
+				stored = chunk_copy(&chunk, cb);
+			j++;
+		} else {
+			stored = chunk_combine(&chunk, ca, cb, op);
+			i++, j++;
+		}
+
+		if (stored < 0)
+			goto fail;
+
+		if (stored > 0) {
+			slot = push_chunk(out);
+			if (slot == NULL) {
+				chunk_free(&chunk);
+				goto fail;
+			}
+
+			*slot = chunk;
+		}
+	}
+
+	return out;
+
+fail:
+	hybrid_free(out);
+	return NULL;
+}
+
+struct hybrid_bitmap *hybrid_and(struct hybrid_bitmap *a, struct hybrid_bitmap *b)
+{
+	return hybrid_op(a, b, EWAH_LITERAL_AND);
+}
+
+struct hybrid_bitmap *hybrid_or(struct hybrid_bitmap *a, struct hybrid_bitmap *b)
+{
+	return hybrid_op(a, b, EWAH_LITERAL_OR);
+}
+
+struct hybrid_bitmap *hybrid_xor(struct hybrid_bitmap *a, struct hybrid_bitmap *b)
+{
+	return hybrid_op(a, b, EWAH_LITERAL_XOR);
+}
+
+struct hybrid_bitmap *hybrid_and_not(struct hybrid_bitmap *a, struct hybrid_bitmap *b)
+{
+	return hybrid_op(a, b, EWAH_LITERAL_AND_NOT);
+}
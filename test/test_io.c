@@ -0,0 +1,668 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "ewok32.h"
+
+static struct ewah_bitmap *generate_bitmap(size_t max_size)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+	size_t i = rand() % 512;
+
+	while (i < max_size) {
+		size_t end = i + rand() % 2048;
+
+		if (end > max_size)
+			end = max_size;
+
+		if (rand() % 2) {
+			for (; i < end; ++i)
+				ewah_set(bitmap, i);
+		} else {
+			for (; i < end; i += 1 + rand() % 100)
+				ewah_set(bitmap, i);
+		}
+
+		i = end + rand() % 4096;
+	}
+
+	return bitmap;
+}
+
+static void verify_same(const char *name, struct ewah_bitmap *a, struct ewah_bitmap *b)
+{
+	bool ok = a->bit_size == b->bit_size &&
+		a->buffer_size == b->buffer_size &&
+		(a->rlw - a->buffer) == (b->rlw - b->buffer) &&
+		!memcmp(a->buffer, b->buffer, a->buffer_size * sizeof(eword_t)) &&
+		ewah_cardinality(a) == ewah_cardinality(b) &&
+		a->first_bit == b->first_bit && a->last_bit == b->last_bit;
+
+	if (!ok) {
+		fprintf(stderr, "'%s' roundtrip ## FAIL\n", name);
+		exit(-1);
+	}
+}
+
+/* same bits, whatever the encoding */
+static void verify_bits(const char *name, struct ewah_bitmap *a, struct ewah_bitmap *b)
+{
+	struct ewah_bitmap *diff = ewah_new();
+
+	ewah_xor(a, b, diff);
+
+	if (a->bit_size != b->bit_size || ewah_cardinality(diff) != 0) {
+		fprintf(stderr, "'%s' roundtrip ## FAIL\n", name);
+		exit(-1);
+	}
+
+	ewah_free(diff);
+}
+
+static int serialize_v2(struct ewah_bitmap *bitmap, int fd)
+{
+	return ewah_serialize_v2(bitmap, fd, 0);
+}
+
+static int serialize_v2_checksum(struct ewah_bitmap *bitmap, int fd)
+{
+	return ewah_serialize_v2(bitmap, fd, EWAH_V2_CHECKSUM);
+}
+
+static FILE *serialized(struct ewah_bitmap *bitmap, int (*serialize)(struct ewah_bitmap *, int))
+{
+	FILE *tmp = tmpfile();
+
+	if (tmp == NULL || serialize(bitmap, fileno(tmp)) < 0) {
+		fprintf(stderr, "serialize ## FAIL\n");
+		exit(-1);
+	}
+
+	lseek(fileno(tmp), 0, SEEK_SET);
+	return tmp;
+}
+
+static void test_roundtrip(const char *name, struct ewah_bitmap *bitmap,
+	int (*serialize)(struct ewah_bitmap *, int))
+{
+	FILE *tmp = serialized(bitmap, serialize);
+	struct ewah_bitmap *loaded = ewah_new();
+
+	fprintf(stderr, "%s roundtrip in %zu bits... ", name, bitmap->bit_size);
+
+	if (ewah_deserialize(loaded, fileno(tmp)) < 0) {
+		fprintf(stderr, "deserialize ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_same(name, bitmap, loaded);
+
+	/* the loaded bitmap must still be appendable */
+	ewah_set(loaded, loaded->bit_size + 100);
+
+	fprintf(stderr, "OK\n");
+	ewah_free(loaded);
+	fclose(tmp);
+}
+
+/* a bitmap that fails to load is left as it was, and still usable */
+static void verify_rejected(const char *name, struct ewah_bitmap *bitmap,
+	struct ewah_bitmap *loaded, FILE *tmp)
+{
+	if (ewah_deserialize(loaded, fileno(tmp)) == 0) {
+		fprintf(stderr, "%s not detected ## FAIL\n", name);
+		exit(-1);
+	}
+
+	verify_same(name, bitmap, loaded);
+	fclose(tmp);
+}
+
+static void test_corruption(struct ewah_bitmap *bitmap)
+{
+	static const uint8_t empty_v1[12];
+
+	FILE *tmp = serialized(bitmap, &serialize_v2_checksum);
+	struct ewah_bitmap *loaded = ewah_new(), *clone;
+	uint8_t byte;
+	off_t at = 32 + rand() % (bitmap->buffer_size * sizeof(eword_t));
+
+	fprintf(stderr, "v2 checksum in %zu bits... ", bitmap->bit_size);
+
+	if (ewah_deserialize(loaded, fileno(tmp)) < 0) {
+		fprintf(stderr, "deserialize ## FAIL\n");
+		exit(-1);
+	}
+
+	/* the words the loaded bitmap shares stay with it */
+	clone = ewah_clone(loaded);
+
+	pread(fileno(tmp), &byte, 1, at);
+	byte ^= 0x10;
+	pwrite(fileno(tmp), &byte, 1, at);
+	lseek(fileno(tmp), 0, SEEK_SET);
+
+	verify_rejected("corruption", bitmap, loaded, tmp);
+
+	tmp = serialized(bitmap, &ewah_serialize);
+	ftruncate(fileno(tmp), 8 + rand() % (bitmap->buffer_size * sizeof(eword_t)));
+	verify_rejected("truncation", bitmap, loaded, tmp);
+
+	/* a v1 file without any words */
+	tmp = tmpfile();
+	fwrite(empty_v1, sizeof(empty_v1), 1, tmp);
+	fflush(tmp);
+	lseek(fileno(tmp), 0, SEEK_SET);
+	verify_rejected("empty file", bitmap, loaded, tmp);
+	verify_same("clone", bitmap, clone);
+
+	ewah_set(loaded, loaded->bit_size + 100);
+	verify_same("clone after write", bitmap, clone);
+	ewah_free(clone);
+
+	fprintf(stderr, "OK\n");
+	ewah_free(loaded);
+}
+
+static void test_view(struct ewah_bitmap *bitmap)
+{
+	FILE *tmp = serialized(bitmap, &serialize_v2);
+	size_t len = lseek(fileno(tmp), 0, SEEK_END);
+	void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(tmp), 0);
+	struct ewah_bitmap *view, *again, *result = ewah_new();
+
+	fprintf(stderr, "native view in %zu bits... ", bitmap->bit_size);
+
+	view = ewah_view(map, len);
+	if (view == NULL) {
+		fprintf(stderr, "view ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_same("view", bitmap, view);
+
+	ewah_or(view, bitmap, result);
+	if (ewah_cardinality(result) != ewah_cardinality(bitmap)) {
+		fprintf(stderr, "view or ## FAIL\n");
+		exit(-1);
+	}
+
+	if (ewah_view(map, len / 2) != NULL) {
+		fprintf(stderr, "truncated view ## FAIL\n");
+		exit(-1);
+	}
+
+	/* writing copies the words out of the read-only mapping */
+	ewah_set(view, view->bit_size + 100);
+
+	if (ewah_cardinality(view) != ewah_cardinality(bitmap) + 1) {
+		fprintf(stderr, "view write ## FAIL\n");
+		exit(-1);
+	}
+
+	again = ewah_view(map, len);
+	ewah_not(again);
+
+	if (ewah_compact(again) < 0) {
+		fprintf(stderr, "view compact ## FAIL\n");
+		exit(-1);
+	}
+
+	ewah_free(again);
+
+	again = ewah_view(map, len);
+	verify_same("view after writes", bitmap, again);
+	ewah_free(again);
+
+	fprintf(stderr, "OK\n");
+	ewah_free(result);
+	ewah_free(view);
+	munmap(map, len);
+	fclose(tmp);
+}
+
+static void verify_get(struct ewah_bitmap *bitmap, struct bitmap *blowup)
+{
+	size_t i;
+
+	for (i = 0; i < 1000; ++i) {
+		size_t pos = rand() % (bitmap->bit_size + 64);
+
+		if (ewah_get(bitmap, pos) != bitmap_get(blowup, pos)) {
+			fprintf(stderr, "get %zu ## FAIL\n", pos);
+			exit(-1);
+		}
+	}
+}
+
+static void test_index(struct ewah_bitmap *bitmap)
+{
+	struct bitmap *blowup = ewah_to_bitmap(bitmap);
+	FILE *tmp = tmpfile();
+	uint64_t value;
+
+	fprintf(stderr, "skip index in %zu bits... ", bitmap->bit_size);
+
+	ewah_build_index(bitmap, 4);
+	verify_get(bitmap, blowup);
+
+	if (ewah_serialize_index(bitmap, fileno(tmp)) < 0) {
+		fprintf(stderr, "serialize index ## FAIL\n");
+		exit(-1);
+	}
+
+	/* a stale index must be replaced by the loaded one */
+	ewah_build_index(bitmap, 1000);
+	lseek(fileno(tmp), 0, SEEK_SET);
+
+	if (ewah_deserialize_index(bitmap, fileno(tmp)) < 0) {
+		fprintf(stderr, "deserialize index ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_get(bitmap, blowup);
+
+	/* samples that do not sit on the RLWs of the bitmap */
+	if (pread(fileno(tmp), &value, sizeof(value), 56 + 24) == sizeof(value)) {
+		value++;
+		pwrite(fileno(tmp), &value, sizeof(value), 56 + 24);
+		lseek(fileno(tmp), 0, SEEK_SET);
+
+		if (ewah_deserialize_index(bitmap, fileno(tmp)) == 0) {
+			fprintf(stderr, "mismatched index ## FAIL\n");
+			exit(-1);
+		}
+	}
+
+	/* a sample count that overflows the allocation */
+	value = (uint64_t)1 << 62;
+	pwrite(fileno(tmp), &value, sizeof(value), 16);
+	pwrite(fileno(tmp), &value, sizeof(value), 40);
+	lseek(fileno(tmp), 0, SEEK_SET);
+
+	if (ewah_deserialize_index(bitmap, fileno(tmp)) == 0) {
+		fprintf(stderr, "oversized index ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_get(bitmap, blowup);
+
+	fprintf(stderr, "OK\n");
+	bitmap_free(blowup);
+	fclose(tmp);
+}
+
+static size_t expected_rank(const uint64_t *positions, size_t n, size_t pos)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (positions[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void verify_rank(struct ewah_bitmap *bitmap, const uint64_t *positions, size_t n)
+{
+	size_t i, pos;
+
+	for (i = 0; i < 1000; ++i) {
+		size_t k = rand() % (n + 1);
+		pos = rand() % (bitmap->bit_size + 64);
+
+		if (ewah_rank(bitmap, pos) != expected_rank(positions, n, pos)) {
+			fprintf(stderr, "rank %zu ## FAIL\n", pos);
+			exit(-1);
+		}
+
+		if (ewah_select(bitmap, k, &pos) != (k < n) || (k < n && pos != positions[k])) {
+			fprintf(stderr, "select %zu ## FAIL\n", k);
+			exit(-1);
+		}
+	}
+}
+
+static void test_rank(struct ewah_bitmap *bitmap)
+{
+	const size_t n = ewah_cardinality(bitmap);
+	uint64_t *positions = malloc((n + 1) * sizeof(uint64_t));
+	struct ewah_decode_cursor cursor;
+	FILE *tmp = tmpfile();
+	size_t pos;
+
+	fprintf(stderr, "rank and select in %zu bits... ", bitmap->bit_size);
+
+	ewah_decode_init(&cursor);
+	ewah_decode_positions(bitmap, positions, n + 1, &cursor);
+
+	/* built on first use, then extended as the bitmap grows */
+	verify_rank(bitmap, positions, n);
+
+	ewah_build_rank_index(bitmap, 4);
+	verify_rank(bitmap, positions, n);
+
+	if (ewah_serialize_index(bitmap, fileno(tmp)) < 0) {
+		fprintf(stderr, "serialize index ## FAIL\n");
+		exit(-1);
+	}
+
+	ewah_build_index(bitmap, 1000);
+	lseek(fileno(tmp), 0, SEEK_SET);
+
+	if (ewah_deserialize_index(bitmap, fileno(tmp)) < 0) {
+		fprintf(stderr, "deserialize index ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_rank(bitmap, positions, n);
+
+	/* the counts of the index must not survive a negation */
+	ewah_not(bitmap);
+	pos = rand() % (bitmap->bit_size + 1);
+	if (ewah_rank(bitmap, pos) != pos - expected_rank(positions, n, pos)) {
+		fprintf(stderr, "rank after not ## FAIL\n");
+		exit(-1);
+	}
+	ewah_not(bitmap);
+
+	fprintf(stderr, "OK\n");
+	free(positions);
+	fclose(tmp);
+}
+
+/* a stream that hands out its bytes a few at a time */
+struct trickle {
+	const uint8_t *data;
+	size_t len, pos;
+};
+
+static ssize_t trickle_read(void *payload, void *buf, size_t len)
+{
+	struct trickle *t = payload;
+	size_t n = 1 + rand() % 23;
+
+	if (n > len)
+		n = len;
+	if (n > t->len - t->pos)
+		n = t->len - t->pos;
+
+	memcpy(buf, t->data + t->pos, n);
+	t->pos += n;
+	return n;
+}
+
+static void slurp(FILE *tmp, struct trickle *t)
+{
+	size_t len = lseek(fileno(tmp), 0, SEEK_END);
+	uint8_t *data = malloc(len);
+
+	if (data == NULL || pread(fileno(tmp), data, len, 0) != (ssize_t)len) {
+		fprintf(stderr, "read ## FAIL\n");
+		exit(-1);
+	}
+
+	t->data = data;
+	t->len = len;
+	t->pos = 0;
+
+	lseek(fileno(tmp), 0, SEEK_SET);
+}
+
+static void test_stream(const char *name, struct ewah_bitmap *bitmap,
+	int (*serialize)(struct ewah_bitmap *, int))
+{
+	FILE *tmp = serialized(bitmap, serialize);
+	struct ewah_bitmap *other = generate_bitmap(bitmap->bit_size);
+	struct ewah_bitmap *loaded = ewah_new(), *expected = ewah_new();
+	struct ewah_reader *reader;
+	struct trickle t;
+	size_t len;
+	ssize_t n;
+
+	fprintf(stderr, "%s stream in %zu bits... ", name, bitmap->bit_size);
+	slurp(tmp, &t);
+
+	/* partial loads, through a buffer that cuts the long groups */
+	reader = ewah_reader_new_cb(&trickle_read, &t, 2 + rand() % 64);
+	if (reader == NULL || ewah_reader_bit_size(reader) != bitmap->bit_size) {
+		fprintf(stderr, "open ## FAIL\n");
+		exit(-1);
+	}
+
+	while ((n = ewah_reader_load(reader, loaded, 1 + rand() % 1000)) > 0)
+		;
+
+	if (n < 0) {
+		fprintf(stderr, "load ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_bits(name, bitmap, loaded);
+	ewah_reader_free(reader);
+
+	/* an operation straight from the file */
+	reader = ewah_reader_new(fileno(tmp), 0);
+	ewah_clear(loaded);
+
+	if (reader == NULL || ewah_reader_and_not(reader, other, loaded) < 0) {
+		fprintf(stderr, "and-not ## FAIL\n");
+		exit(-1);
+	}
+
+	ewah_and_not(bitmap, other, expected);
+	verify_bits(name, expected, loaded);
+	ewah_reader_free(reader);
+
+	/* a stream cut short */
+	len = t.len;
+	t.len -= 1 + rand() % 8;
+	t.pos = 0;
+	ewah_clear(loaded);
+
+	reader = ewah_reader_new_cb(&trickle_read, &t, 0);
+	if (reader != NULL && ewah_reader_or(reader, other, loaded) == 0) {
+		fprintf(stderr, "truncated ## FAIL\n");
+		exit(-1);
+	}
+	ewah_reader_free(reader);
+
+	/* a damaged word: caught by the checksum at the end, if the RLW
+	 * headers still make sense */
+	if (serialize == &serialize_v2_checksum) {
+		t.len = len;
+		t.pos = 0;
+		((uint8_t *)t.data)[t.len - 5 - rand() % (bitmap->buffer_size * sizeof(eword_t))] ^= 0x4;
+
+		reader = ewah_reader_new_cb(&trickle_read, &t, 0);
+		while ((n = ewah_reader_load(reader, loaded, 4096)) > 0)
+			;
+
+		if (n == 0 || (errno != EBADMSG && errno != EINVAL)) {
+			fprintf(stderr, "checksum ## FAIL\n");
+			exit(-1);
+		}
+		ewah_reader_free(reader);
+	}
+
+	fprintf(stderr, "OK\n");
+	free((void *)t.data);
+	ewah_free(other);
+	ewah_free(loaded);
+	ewah_free(expected);
+	fclose(tmp);
+}
+
+static void test_files(struct ewah_bitmap *bitmap)
+{
+	struct ewah_bitmap *other = generate_bitmap(bitmap->bit_size * 2);
+	struct ewah_bitmap *expected = ewah_new(), *loaded = ewah_new();
+	FILE *file_i = serialized(bitmap, &ewah_serialize);
+	FILE *file_j = serialized(other, &serialize_v2);
+	FILE *result = tmpfile();
+	size_t i;
+
+	struct {
+		int (*files)(int, int, int, int);
+		void (*op)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *);
+	} tests[] = {
+		{ &ewah_and_files, &ewah_and },
+		{ &ewah_or_files, &ewah_or },
+		{ &ewah_xor_files, &ewah_xor },
+		{ &ewah_and_not_files, &ewah_and_not }
+	};
+
+	fprintf(stderr, "out-of-core ops in %zu bits... ", bitmap->bit_size);
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i) {
+		lseek(fileno(file_i), 0, SEEK_SET);
+		lseek(fileno(file_j), 0, SEEK_SET);
+
+		if (result == NULL || ftruncate(fileno(result), 0) < 0 ||
+			lseek(fileno(result), 0, SEEK_SET) < 0 ||
+			tests[i].files(fileno(file_i), fileno(file_j),
+				fileno(result), EWAH_V2_CHECKSUM) < 0 ||
+			lseek(fileno(result), 0, SEEK_CUR) != lseek(fileno(result), 0, SEEK_END)) {
+			fprintf(stderr, "op %zu ## FAIL\n", i);
+			exit(-1);
+		}
+
+		lseek(fileno(result), 0, SEEK_SET);
+		if (ewah_deserialize(loaded, fileno(result)) < 0) {
+			fprintf(stderr, "load %zu ## FAIL\n", i);
+			exit(-1);
+		}
+
+		tests[i].op(bitmap, other, expected);
+		verify_bits("out-of-core", expected, loaded);
+
+		if (ewah_cardinality(loaded) != ewah_cardinality(expected)) {
+			fprintf(stderr, "stats %zu ## FAIL\n", i);
+			exit(-1);
+		}
+
+		ewah_clear(expected);
+	}
+
+	fprintf(stderr, "OK\n");
+
+	fclose(file_i);
+	fclose(file_j);
+	fclose(result);
+	ewah_free(other);
+	ewah_free(expected);
+	ewah_free(loaded);
+}
+
+static void test_word32(struct ewah_bitmap *bitmap)
+{
+	struct ewah32_bitmap *narrow = ewah32_new(), *loaded32 = ewah32_new();
+	struct ewah32_bitmap *tiny = ewah32_new();
+	struct ewah_bitmap *wide = ewah_new(), *loaded = ewah_new(), *clone;
+	struct bitmap *blowup = ewah_to_bitmap(bitmap);
+	struct bitmap32 *blowup32;
+	FILE *tmp = tmpfile(), *bad = tmpfile();
+	eword32_t rlw = ~0;
+	size_t i;
+
+	fprintf(stderr, "32-bit words in %zu bits... ", bitmap->bit_size);
+
+	if (ewah32_from_ewah(narrow, bitmap) < 0 ||
+		narrow->bit_size != bitmap->bit_size ||
+		ewah32_cardinality(narrow) != ewah_cardinality(bitmap)) {
+		fprintf(stderr, "convert ## FAIL\n");
+		exit(-1);
+	}
+
+	blowup32 = ewah32_to_bitmap(narrow);
+	for (i = 0; i < bitmap->bit_size; ++i) {
+		if (bitmap32_get(blowup32, i) != bitmap_get(blowup, i)) {
+			fprintf(stderr, "bit %zu ## FAIL\n", i);
+			exit(-1);
+		}
+	}
+
+	if (ewah_from_ewah32(wide, narrow) < 0) {
+		fprintf(stderr, "convert back ## FAIL\n");
+		exit(-1);
+	}
+	verify_bits("word32", bitmap, wide);
+
+	/* each variant loads the files of the other one */
+	if (tmp == NULL || ewah32_serialize_v2(narrow, fileno(tmp), EWAH_V2_CHECKSUM) < 0 ||
+		lseek(fileno(tmp), 0, SEEK_SET) < 0 ||
+		ewah_deserialize(loaded, fileno(tmp)) < 0) {
+		fprintf(stderr, "load 32-bit file ## FAIL\n");
+		exit(-1);
+	}
+	verify_bits("word32 file", bitmap, loaded);
+
+	/* malformed words of the other width leave a shared bitmap alone */
+	ewah32_set(tiny, 100);
+	if (bad == NULL || ewah32_serialize_v2(tiny, fileno(bad), 0) < 0 ||
+		pwrite(fileno(bad), &rlw, sizeof(rlw), lseek(fileno(bad), 0, SEEK_END) -
+			tiny->buffer_size * sizeof(eword32_t)) < 0 ||
+		lseek(fileno(bad), 0, SEEK_SET) < 0) {
+		fprintf(stderr, "malformed 32-bit file ## FAIL\n");
+		exit(-1);
+	}
+
+	clone = ewah_clone(loaded);
+	verify_rejected("malformed 32-bit file", clone, loaded, bad);
+	ewah_free(clone);
+
+	if (ftruncate(fileno(tmp), 0) < 0 || lseek(fileno(tmp), 0, SEEK_SET) < 0 ||
+		ewah_serialize_v2(bitmap, fileno(tmp), 0) < 0 ||
+		lseek(fileno(tmp), 0, SEEK_SET) < 0 ||
+		ewah32_deserialize(loaded32, fileno(tmp)) < 0 ||
+		loaded32->buffer_size != narrow->buffer_size ||
+		memcmp(loaded32->buffer, narrow->buffer, narrow->buffer_size * sizeof(eword32_t))) {
+		fprintf(stderr, "load 64-bit file ## FAIL\n");
+		exit(-1);
+	}
+
+	fprintf(stderr, "OK\n");
+
+	fclose(tmp);
+	bitmap_free(blowup);
+	bitmap32_free(blowup32);
+	ewah_free(wide);
+	ewah_free(loaded);
+	ewah32_free(narrow);
+	ewah32_free(loaded32);
+	ewah32_free(tiny);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+	srand(time(NULL));
+
+	for (i = 8; i < 24; ++i) {
+		struct ewah_bitmap *bitmap = generate_bitmap((size_t)1 << i);
+
+		test_roundtrip("v1", bitmap, &ewah_serialize);
+		test_roundtrip("v2", bitmap, &serialize_v2);
+		test_roundtrip("v2+crc", bitmap, &serialize_v2_checksum);
+		test_stream("v1", bitmap, &ewah_serialize);
+		test_stream("v2+crc", bitmap, &serialize_v2_checksum);
+		test_files(bitmap);
+		test_corruption(bitmap);
+		test_view(bitmap);
+		test_index(bitmap);
+		test_rank(bitmap);
+		test_word32(bitmap);
+
+		ewah_free(bitmap);
+	}
+
+	return 0;
+}
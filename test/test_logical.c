@@ -1,5 +1,8 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "ewok.h"
 
 static void cb__blowup_test(size_t pos, void *payload)
@@ -8,6 +11,58 @@ static void cb__blowup_test(size_t pos, void *payload)
 	bitmap_set(bm, pos);
 }
 
+static void verify_decode(struct ewah_bitmap *ewah, struct bitmap *blowup)
+{
+	struct ewah_decode_cursor cursor;
+	uint64_t pos[37];
+	size_t i, n, last = 0, count = 0;
+
+	ewah_decode_init(&cursor);
+
+	while ((n = ewah_decode_positions(ewah, pos, 37, &cursor)) > 0) {
+		for (i = 0; i < n; ++i) {
+			if ((count && pos[i] <= last) || !bitmap_get(blowup, pos[i])) {
+				fprintf(stderr, "decode %llu ## FAIL\n", (unsigned long long)pos[i]);
+				exit(-1);
+			}
+			last = pos[i];
+			count++;
+		}
+	}
+
+	if (count != ewah_cardinality(ewah)) {
+		fprintf(stderr, "decoded %zu bits ## FAIL\n", count);
+		exit(-1);
+	}
+}
+
+static void verify_advance(struct ewah_bitmap *ewah, struct bitmap *blowup)
+{
+	struct ewah_iterator it;
+	size_t pos = 0;
+	eword_t word;
+
+	ewah_iterator_init(&it, ewah);
+
+	while (ewah_iterator_advance_to(&it, pos)) {
+		if (!ewah_iterator_next(&word, &it) ||
+			word != blowup->words[pos / BITS_IN_WORD]) {
+			fprintf(stderr, "advance to %zu ## FAIL\n", pos);
+			exit(-1);
+		}
+
+		/* the next word at least, up to a few RLW groups away */
+		pos = (pos / BITS_IN_WORD + 1 + rand() % 512) * BITS_IN_WORD +
+			rand() % BITS_IN_WORD;
+	}
+
+	if (pos / BITS_IN_WORD < blowup->word_alloc &&
+		blowup->words[pos / BITS_IN_WORD] != 0) {
+		fprintf(stderr, "advance past %zu ## FAIL\n", pos);
+		exit(-1);
+	}
+}
+
 static void verify_blowup(struct ewah_bitmap *ewah, struct bitmap *blowup)
 {
 	struct bitmap *aux = bitmap_new();
@@ -26,6 +81,49 @@ static void verify_blowup(struct ewah_bitmap *ewah, struct bitmap *blowup)
 	}
 
 	bitmap_free(aux);
+	verify_decode(ewah, blowup);
+
+	verify_advance(ewah, blowup);
+	ewah_build_index(ewah, 4);
+	verify_advance(ewah, blowup);
+}
+
+struct bit_stats {
+	size_t count, first, last;
+};
+
+static void cb__count(size_t pos, void *payload)
+{
+	struct bit_stats *stats = payload;
+
+	if (stats->count++ == 0)
+		stats->first = pos;
+	stats->last = pos;
+}
+
+/* also checks the maintained first and last bit */
+static void verify_cardinality(struct ewah_bitmap *ewah, size_t expected)
+{
+	struct bit_stats stats = { 0, 0, 0 };
+	size_t first = 0, last = 0;
+	bool any;
+
+	ewah_each_bit(ewah, &cb__count, &stats);
+
+	if (stats.count != expected || ewah_cardinality(ewah) != expected) {
+		fprintf(stderr, "cardinality %zu / %zu vs %zu ## FAIL\n",
+			stats.count, ewah_cardinality(ewah), expected);
+		exit(-1);
+	}
+
+	any = ewah_first_bit(ewah, &first);
+
+	if (any != (expected > 0) || ewah_last_bit(ewah, &last) != any ||
+		first != stats.first || last != stats.last) {
+		fprintf(stderr, "first/last %zu-%zu vs %zu-%zu ## FAIL\n",
+			first, last, stats.first, stats.last);
+		exit(-1);
+	}
 }
 
 static size_t op_xor(size_t a, size_t b)
@@ -112,22 +210,1126 @@ static struct ewah_bitmap *generate_bitmap(size_t max_size)
 	return bitmap;
 }
 
+static struct ewah_bitmap *generate_clustered_bitmap(size_t max_size)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+	size_t i = rand() % 512;
+
+	while (i < max_size) {
+		size_t end = i + rand() % 2048;
+
+		if (end > max_size)
+			end = max_size;
+
+		switch (rand() % 3) {
+		case 0: /* run of ones */
+			for (; i < end; ++i)
+				ewah_set(bitmap, i);
+			break;
+		case 1: /* sparse */
+			for (; i < end; i += 1 + rand() % 100)
+				ewah_set(bitmap, i);
+			break;
+		}
+
+		i = end + rand() % 4096;
+	}
+
+	return bitmap;
+}
+
+static bool same_words(struct ewah_bitmap *_a, struct ewah_bitmap *_b)
+{
+	struct bitmap *a = ewah_to_bitmap(_a);
+	struct bitmap *b = ewah_to_bitmap(_b);
+	bool ok = (a->word_alloc == b->word_alloc) &&
+		!memcmp(a->words, b->words, a->word_alloc * sizeof(eword_t));
+
+	bitmap_free(a);
+	bitmap_free(b);
+	return ok;
+}
+
+static bool same_encoding(struct ewah_bitmap *a, struct ewah_bitmap *b)
+{
+	return a->bit_size == b->bit_size &&
+		a->buffer_size == b->buffer_size &&
+		!memcmp(a->buffer, b->buffer, a->buffer_size * sizeof(eword_t));
+}
+
+static void test_many(size_t size, size_t n)
+{
+	struct ewah_bitmap **bitmaps = malloc(n * sizeof(struct ewah_bitmap *));
+	struct ewah_bitmap *expected = ewah_new();
+	struct ewah_bitmap *result = ewah_new();
+	size_t i, t;
+
+	struct {
+		const char *name;
+		int (*many)(struct ewah_bitmap **, size_t, struct ewah_bitmap *);
+		void (*pairwise)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *);
+		size_t (*cardinality)(struct ewah_bitmap *, struct ewah_bitmap *);
+	} tests[] = {
+		{"or", &ewah_or_many, &ewah_or, &ewah_or_cardinality},
+		{"xor", &ewah_xor_many, &ewah_xor, &ewah_xor_cardinality},
+		{"and", &ewah_and_many, &ewah_and, &ewah_and_cardinality},
+	};
+
+	for (i = 0; i < n; ++i) {
+		bitmaps[i] = generate_clustered_bitmap(size);
+
+		/* half of the inputs leapfrog through their skip index */
+		if (i & 1)
+			ewah_build_index(bitmaps[i], 4);
+	}
+
+	for (t = 0; t < sizeof(tests)/sizeof(tests[0]); ++t) {
+		fprintf(stderr, "'%s-many' of %zu in %zu bits... ", tests[t].name, n, size);
+
+		/* or'ing against an empty bitmap yields a plain copy */
+		ewah_clear(expected);
+		ewah_clear(result);
+		ewah_or(bitmaps[0], result, expected);
+
+		for (i = 1; i < n; ++i) {
+			struct ewah_bitmap *tmp = ewah_new();
+			tests[t].pairwise(expected, bitmaps[i], tmp);
+			verify_cardinality(tmp, tests[t].cardinality(expected, bitmaps[i]));
+			ewah_free(expected);
+			expected = tmp;
+		}
+
+		tests[t].many(bitmaps, n, result);
+
+		if (!same_words(expected, result)) {
+			fprintf(stderr, "FAIL\n");
+			exit(-1);
+		}
+
+		fprintf(stderr, "OK\n");
+	}
+
+	for (i = 0; i < n; ++i)
+		ewah_free(bitmaps[i]);
+
+	free(bitmaps);
+	ewah_free(expected);
+	ewah_free(result);
+}
+
+struct shifted_blowup {
+	struct bitmap *bitmap;
+	size_t offset;
+};
+
+static void cb__shifted_blowup(size_t pos, void *payload)
+{
+	struct shifted_blowup *blowup = payload;
+	bitmap_set(blowup->bitmap, pos + blowup->offset);
+}
+
+static void test_append(size_t size, bool aligned)
+{
+	struct ewah_bitmap *global = ewah_new(), *shard, *padded;
+	struct shifted_blowup expected = { bitmap_new(), 0 };
+	struct bitmap *result;
+	size_t k, count = 0;
+
+	fprintf(stderr, "'append' of %s shards of %zu bits... ",
+		aligned ? "aligned" : "unaligned", size);
+
+	for (k = 0; k < 8; ++k) {
+		shard = generate_clustered_bitmap(size);
+
+		expected.offset = global->bit_size + rand() % 200;
+		if (aligned)
+			expected.offset -= expected.offset % BITS_IN_WORD;
+		if (expected.offset < global->bit_size)
+			expected.offset += BITS_IN_WORD;
+
+		if (ewah_append(global, shard, expected.offset) < 0 ||
+			global->bit_size != expected.offset + shard->bit_size) {
+			fprintf(stderr, "FAIL\n");
+			exit(-1);
+		}
+
+		ewah_each_bit(shard, &cb__shifted_blowup, &expected);
+		count += ewah_cardinality(shard);
+		ewah_free(shard);
+	}
+
+	/* cannot append over bits already in place */
+	shard = ewah_new();
+	if (ewah_append(global, shard, global->bit_size - 1) == 0) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+	ewah_free(shard);
+
+	/* the padding of a negated bitmap stays out of the gap */
+	padded = ewah_new();
+	ewah_set(padded, 1);
+	ewah_not(padded);
+
+	shard = ewah_new();
+	ewah_set(shard, 0);
+
+	k = aligned ? BITS_IN_WORD : 5;
+	if (ewah_append(padded, shard, k) < 0 ||
+		!ewah_get(padded, 0) || !ewah_get(padded, k)) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+
+	verify_cardinality(padded, 2);
+	ewah_free(padded);
+	ewah_free(shard);
+
+	result = ewah_to_bitmap(global);
+
+	for (k = 0; k < expected.bitmap->word_alloc; ++k) {
+		eword_t word = k < result->word_alloc ? result->words[k] : 0;
+
+		if (word != expected.bitmap->words[k]) {
+			fprintf(stderr, "word %zu ## FAIL\n", k);
+			exit(-1);
+		}
+	}
+
+	verify_cardinality(global, count);
+	fprintf(stderr, "OK\n");
+
+	bitmap_free(expected.bitmap);
+	bitmap_free(result);
+	ewah_free(global);
+}
+
+static void test_arena(size_t size)
+{
+	struct ewah_arena *arena = ewah_arena_new(4096);
+	const struct ewah_allocator *allocator = ewah_arena_allocator(arena);
+	struct ewah_bitmap *a = generate_clustered_bitmap(size);
+	struct ewah_bitmap *b = generate_clustered_bitmap(size);
+	struct ewah_bitmap *expected = ewah_new();
+	size_t round;
+
+	fprintf(stderr, "'arena' in %zu bits... ", size);
+
+	ewah_and(a, b, expected);
+
+	for (round = 0; round < 4; ++round) {
+		struct ewah_bitmap *or = ewah_new_with_allocator(allocator);
+		struct ewah_bitmap *xor = ewah_new_with_allocator(allocator);
+		struct ewah_bitmap *and = ewah_new_with_allocator(allocator);
+
+		ewah_or(a, b, or);
+		ewah_xor(a, b, xor);
+
+		/* (a | b) & ~(a ^ b) == a & b */
+		ewah_and_not(or, xor, and);
+
+		if (!same_encoding(expected, and) || !same_words(expected, and)) {
+			fprintf(stderr, "FAIL\n");
+			exit(-1);
+		}
+
+		/* freeing is optional, the reset releases everything */
+		if (round & 1) {
+			ewah_free(or);
+			ewah_free(xor);
+		}
+
+		ewah_arena_reset(arena);
+	}
+
+	fprintf(stderr, "OK\n");
+
+	ewah_free(a);
+	ewah_free(b);
+	ewah_free(expected);
+	ewah_arena_free(arena);
+}
+
+static void test_expr(size_t size)
+{
+	struct ewah_bitmap *leaves[4], *t1 = ewah_new(), *t2 = ewah_new();
+	struct ewah_bitmap *expected = ewah_new(), *result = ewah_new();
+	struct ewah_expr *expr;
+	size_t i;
+
+	fprintf(stderr, "'expr' in %zu bits... ", size);
+
+	for (i = 0; i < 4; ++i)
+		leaves[i] = generate_clustered_bitmap(size >> (rand() % 3));
+
+#define A ewah_expr_leaf(leaves[0])
+#define B ewah_expr_leaf(leaves[1])
+#define C ewah_expr_leaf(leaves[2])
+#define D ewah_expr_leaf(leaves[3])
+#define CHECK(_expr) do { \
+	expr = (_expr); \
+	if (ewah_expr_eval(expr, result) < 0 || !same_words(expected, result)) { \
+		fprintf(stderr, "%s ## FAIL\n", #_expr); \
+		exit(-1); \
+	} \
+	ewah_expr_free(expr); \
+	ewah_clear(t1); ewah_clear(t2); \
+	ewah_clear(expected); ewah_clear(result); \
+} while (0)
+
+	ewah_and(leaves[0], leaves[1], t1);
+	ewah_and_not(leaves[2], leaves[3], t2);
+	ewah_or(t1, t2, expected);
+	CHECK(ewah_expr_or(ewah_expr_and(A, B), ewah_expr_and(C, ewah_expr_not(D))));
+
+	ewah_xor(leaves[0], leaves[1], t1);
+	ewah_or(leaves[2], leaves[3], t2);
+	ewah_and_not(t1, t2, expected);
+	CHECK(ewah_expr_and_not(ewah_expr_xor(A, B), ewah_expr_or(C, D)));
+
+	ewah_or(leaves[0], t1, expected);
+	ewah_not(expected);
+	CHECK(ewah_expr_not(A));
+
+	ewah_and(leaves[0], leaves[0], expected);
+	CHECK(ewah_expr_not(ewah_expr_not(ewah_expr_and(A, A))));
+
+#undef CHECK
+#undef A
+#undef B
+#undef C
+#undef D
+
+	fprintf(stderr, "OK\n");
+
+	for (i = 0; i < 4; ++i)
+		ewah_free(leaves[i]);
+
+	ewah_free(t1);
+	ewah_free(t2);
+	ewah_free(expected);
+	ewah_free(result);
+}
+
+static void test_bulk(size_t size)
+{
+	struct ewah_bitmap *expected = ewah_new(), *result = ewah_new();
+	uint64_t *ids = malloc(1024 * sizeof(uint64_t));
+	uint32_t *ids32 = malloc(1024 * sizeof(uint32_t));
+	size_t pos = 0, i, n;
+
+	fprintf(stderr, "'bulk' in %zu bits... ", size);
+
+	while (pos < size) {
+		switch (rand() % 4) {
+		case 0: {
+			size_t end = pos + rand() % (size / 8 + 1);
+
+			ewah_set_range(result, pos, end);
+			for (; pos < end; ++pos)
+				ewah_set(expected, pos);
+			break;
+		}
+
+		case 1:
+		case 2:
+			for (n = 0; n < 1024; ++n) {
+				pos += rand() % (rand() % 2 ? 4 : 300);
+				ids[n] = ids32[n] = pos;
+			}
+
+			if (rand() % 2)
+				ewah_add_sorted(result, ids, n);
+			else
+				ewah_add_sorted32(result, ids32, n);
+
+			for (i = 0; i < n; ++i) {
+				if (i == 0 || ids[i] != ids[i - 1])
+					ewah_set(expected, ids[i]);
+			}
+			pos++;
+			break;
+
+		default:
+			ewah_set(result, pos);
+			ewah_set(expected, pos);
+			pos += 1 + rand() % 100;
+		}
+
+		if (result->bit_size != expected->bit_size) {
+			fprintf(stderr, "bit_size %zu vs %zu ## FAIL\n",
+				result->bit_size, expected->bit_size);
+			exit(-1);
+		}
+	}
+
+	if (!same_words(expected, result)) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+
+	verify_cardinality(result, ewah_cardinality(expected));
+
+	/* unsorted, or before the end of the bitmap */
+	ids[0] = pos + 10;
+	ids[1] = pos + 5;
+	if (ewah_add_sorted(result, ids, 2) == 0 ||
+		ewah_add_sorted(result, ids + 1, 1) != 0 ||
+		ewah_add_sorted(result, ids + 1, 1) == 0) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+
+	/* whole words of ones become a single run */
+	ewah_clear(result);
+	ewah_set_range(result, 0, size * BITS_IN_WORD);
+	if (result->buffer_size != 1 || ewah_cardinality(result) != size * BITS_IN_WORD) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+
+	fprintf(stderr, "OK\n");
+
+	free(ids);
+	free(ids32);
+	ewah_free(expected);
+	ewah_free(result);
+}
+
+static void test_builder(size_t size)
+{
+	struct ewah_bitmap *expected = ewah_new(), *result = ewah_new();
+	size_t *positions = malloc(size * sizeof(size_t));
+	struct ewah_builder *builder;
+	size_t i, n = 0, pos = 0;
+
+	fprintf(stderr, "'builder' in %zu bits... ", size);
+
+	/* start inside a partially filled word */
+	ewah_set(expected, 3);
+	ewah_set(result, 3);
+	pos = 4;
+
+	while ((pos += 1 + rand() % 16) < size) {
+		positions[n++] = pos;
+		ewah_set(expected, pos);
+	}
+
+	/* mostly ordered: shuffled in blocks of 64, up to 1024 bits late */
+	for (i = 0; i < n; ++i) {
+		size_t block = i - i % 64, left = (n - block < 64 ? n - block : 64);
+		size_t j = block + rand() % left;
+		size_t tmp = positions[i];
+
+		positions[i] = positions[j];
+		positions[j] = tmp;
+	}
+
+	builder = ewah_builder_new(result, 4096);
+
+	for (i = 0; i < n; ++i) {
+		if (ewah_builder_set(builder, positions[i]) < 0) {
+			fprintf(stderr, "set %zu ## FAIL\n", positions[i]);
+			exit(-1);
+		}
+
+		if (i % 512 == 511 && positions[i] > 2048)
+			ewah_builder_seal(builder, positions[i] - 2048);
+	}
+
+	if (n > 0 && ewah_builder_set(builder, 2) == 0) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+
+	ewah_builder_finish(builder);
+
+	if (result->bit_size != expected->bit_size || !same_words(expected, result)) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+
+	verify_cardinality(result, n + 1);
+	fprintf(stderr, "OK\n");
+
+	free(positions);
+	ewah_free(expected);
+	ewah_free(result);
+}
+
+static void test_bitmap_fold(size_t size)
+{
+	struct ewah_bitmap *ewah = generate_clustered_bitmap(size);
+	struct bitmap *plain = ewah_to_bitmap(ewah);
+	size_t t, i;
+
+	struct {
+		const char *name;
+		void (*fold)(struct bitmap *, struct ewah_bitmap *);
+		size_t (*check)(size_t, size_t);
+	} tests[] = {
+		{"or", &bitmap_or_ewah, &op_or},
+		{"and", &bitmap_and_ewah, &op_and},
+		{"and-not", &bitmap_andnot_ewah, &op_andnot},
+	};
+
+	for (t = 0; t < sizeof(tests)/sizeof(tests[0]); ++t) {
+		/* the uncompressed side may be shorter or longer */
+		struct ewah_bitmap *other = generate_bitmap(size >> (rand() % 3) << (rand() % 2));
+		struct bitmap *result = ewah_to_bitmap(ewah);
+		struct bitmap *folded = ewah_to_bitmap(other);
+
+		fprintf(stderr, "'bitmap-%s' in %zu bits... ", tests[t].name, size);
+
+		tests[t].fold(result, other);
+
+		if (result->word_alloc < plain->word_alloc ||
+			(tests[t].fold == &bitmap_or_ewah &&
+			 result->word_alloc < folded->word_alloc)) {
+			fprintf(stderr, "FAIL\n");
+			exit(-1);
+		}
+
+		for (i = 0; i < result->word_alloc; ++i) {
+			eword_t a = i < plain->word_alloc ? plain->words[i] : 0;
+			eword_t b = i < folded->word_alloc ? folded->words[i] : 0;
+
+			if (result->words[i] != (eword_t)tests[t].check(a, b)) {
+				fprintf(stderr, "word %zu ## FAIL\n", i);
+				exit(-1);
+			}
+		}
+
+		fprintf(stderr, "OK\n");
+
+		bitmap_free(result);
+		bitmap_free(folded);
+		ewah_free(other);
+	}
+
+	bitmap_free(plain);
+	ewah_free(ewah);
+}
+
+static struct ewah_bitmap *generate_mixed_bitmap(size_t max_size)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+	size_t i = 0;
+
+	while (i < max_size) {
+		/* a differently shaped block every 64K bits or so */
+		size_t end = i + (1 << 15) + rand() % (1 << 16);
+
+		if (end > max_size)
+			end = max_size;
+
+		switch (rand() % 4) {
+		case 0: /* sparse */
+			for (; i < end; i += 1 + rand() % 1000)
+				ewah_set(bitmap, i);
+			break;
+		case 1: /* dense */
+			for (; i < end; ++i)
+				if (rand() % 2)
+					ewah_set(bitmap, i);
+			break;
+		case 2: /* runs */
+			for (; i < end; i += rand() % 4096) {
+				size_t run = i + rand() % 2048;
+
+				for (; i < run && i < end; ++i)
+					ewah_set(bitmap, i);
+			}
+			break;
+		}
+
+		i = end;
+	}
+
+	return bitmap;
+}
+
+/* same set bits, whatever the length of the bitmaps */
+static bool same_bits(struct ewah_bitmap *_a, struct ewah_bitmap *_b)
+{
+	struct bitmap *a = ewah_to_bitmap(_a);
+	struct bitmap *b = ewah_to_bitmap(_b);
+	size_t i, n = a->word_alloc > b->word_alloc ? a->word_alloc : b->word_alloc;
+	bool ok = true;
+
+	for (i = 0; i < n && ok; ++i) {
+		eword_t wa = i < a->word_alloc ? a->words[i] : 0;
+		eword_t wb = i < b->word_alloc ? b->words[i] : 0;
+		ok = (wa == wb);
+	}
+
+	bitmap_free(a);
+	bitmap_free(b);
+	return ok;
+}
+
+static void test_hybrid(size_t size)
+{
+	struct ewah_bitmap *a = generate_mixed_bitmap(size);
+	struct ewah_bitmap *b = generate_mixed_bitmap(size >> (rand() % 2));
+	struct hybrid_bitmap *ha = hybrid_from_ewah(a);
+	struct hybrid_bitmap *hb = hybrid_from_ewah(b);
+	struct hybrid_bitmap *shuffled = hybrid_new();
+	struct ewah_bitmap *back;
+	uint64_t *pos;
+	size_t n, i, t;
+
+	struct {
+		const char *name;
+		struct hybrid_bitmap *(*hybrid)(struct hybrid_bitmap *, struct hybrid_bitmap *);
+		void (*ewah)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *);
+	} tests[] = {
+		{"and", &hybrid_and, &ewah_and},
+		{"or", &hybrid_or, &ewah_or},
+		{"xor", &hybrid_xor, &ewah_xor},
+		{"and-not", &hybrid_and_not, &ewah_and_not},
+	};
+
+	fprintf(stderr, "'hybrid' in %zu bits... ", size);
+
+	back = hybrid_to_ewah(ha);
+	if (!same_encoding(a, back) ||
+		hybrid_cardinality(ha) != ewah_cardinality(a)) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+	ewah_free(back);
+
+	/* the same bits, set in random order */
+	n = ewah_cardinality(a);
+	pos = malloc((n + 1) * sizeof(uint64_t));
+	{
+		struct ewah_decode_cursor cursor;
+		ewah_decode_init(&cursor);
+		ewah_decode_positions(a, pos, n + 1, &cursor);
+	}
+
+	for (i = n; i > 1; --i) {
+		size_t j = rand() % i;
+		uint64_t tmp = pos[i - 1];
+		pos[i - 1] = pos[j];
+		pos[j] = tmp;
+	}
+
+	for (i = 0; i < n; ++i)
+		hybrid_set(shuffled, pos[i]);
+
+	for (i = 0; i < n; ++i) {
+		if (!hybrid_get(shuffled, pos[i]) || !hybrid_get(ha, pos[i]) ||
+			hybrid_get(ha, pos[i] + 1) != ewah_get(a, pos[i] + 1)) {
+			fprintf(stderr, "get %llu ## FAIL\n", (unsigned long long)pos[i]);
+			exit(-1);
+		}
+	}
+
+	hybrid_optimize(shuffled);
+	back = hybrid_to_ewah(shuffled);
+	if (!same_encoding(a, back) || hybrid_size(shuffled) != hybrid_size(ha)) {
+		fprintf(stderr, "FAIL\n");
+		exit(-1);
+	}
+	ewah_free(back);
+
+	/* chunks found in only one input are copied as they are */
+	{
+		struct hybrid_bitmap *empty = hybrid_new();
+		struct hybrid_bitmap *copy = hybrid_or(ha, empty);
+
+		back = hybrid_to_ewah(copy);
+		if (!same_encoding(a, back) ||
+			hybrid_cardinality(copy) != hybrid_cardinality(ha)) {
+			fprintf(stderr, "copy ## FAIL\n");
+			exit(-1);
+		}
+		ewah_free(back);
+		hybrid_free(copy);
+		hybrid_free(empty);
+	}
+
+	fprintf(stderr, "OK\n");
+
+	for (t = 0; t < sizeof(tests)/sizeof(tests[0]); ++t) {
+		struct ewah_bitmap *expected = ewah_new();
+		struct hybrid_bitmap *result;
+
+		fprintf(stderr, "'hybrid-%s' in %zu bits... ", tests[t].name, size);
+
+		tests[t].ewah(a, b, expected);
+		result = tests[t].hybrid(ha, hb);
+		back = hybrid_to_ewah(result);
+
+		if (!same_bits(expected, back) ||
+			hybrid_cardinality(result) != ewah_cardinality(expected)) {
+			fprintf(stderr, "FAIL\n");
+			exit(-1);
+		}
+
+		fprintf(stderr, "OK\n");
+
+		ewah_free(back);
+		ewah_free(expected);
+		hybrid_free(result);
+	}
+
+	free(pos);
+	hybrid_free(shuffled);
+	hybrid_free(ha);
+	hybrid_free(hb);
+	ewah_free(a);
+	ewah_free(b);
+}
+
+static eword_t random_word(void)
+{
+	eword_t word = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof(eword_t); i += 2)
+		word = (word << 16) ^ rand();
+
+	return word;
+}
+
+/* appended word by word, with empty literals and split runs */
+static struct ewah_bitmap *generate_loose_bitmap(size_t max_size)
+{
+	struct ewah_bitmap *bitmap = ewah_new();
+	eword_t words[16];
+
+	while (bitmap->bit_size < max_size) {
+		size_t i, n = 1 + rand() % 16;
+
+		switch (rand() % 3) {
+		case 0:
+			ewah_add_empty_words(bitmap, rand() % 2, n);
+			break;
+		case 1:
+			ewah_add(bitmap, rand() % 2 ? 0 : (eword_t)(~0));
+			break;
+		case 2:
+			for (i = 0; i < n; ++i) {
+				switch (rand() % 3) {
+				case 0: words[i] = 0; break;
+				case 1: words[i] = (eword_t)(~0); break;
+				case 2: words[i] = random_word(); break;
+				}
+			}
+			ewah_add_dirty_words(bitmap, words, n, rand() % 2);
+			break;
+		}
+	}
+
+	return bitmap;
+}
+
+static bool is_canonical(struct ewah_bitmap *bitmap)
+{
+	const size_t run_bits = BITS_IN_WORD / 2;
+	const size_t max_run = ((size_t)1 << run_bits) - 1;
+	const size_t max_literals = ((size_t)1 << (BITS_IN_WORD - run_bits - 1)) - 1;
+	size_t pointer = 0, last_run = 0, last_literals = max_literals;
+	bool last_bit = false;
+
+	while (pointer < bitmap->buffer_size) {
+		eword_t rlw = bitmap->buffer[pointer++];
+		bool bit = rlw & 1;
+		size_t run = (rlw >> 1) & max_run;
+		size_t literals = rlw >> (1 + run_bits), k;
+
+		/* a group could have been appended to the previous one */
+		if (run == 0 && (last_literals < max_literals ||
+			(literals == 0 && bitmap->buffer_size > 1)))
+			return false;
+
+		if (pointer > 1 && last_literals == 0 && last_bit == bit &&
+			last_run < max_run)
+			return false;
+
+		for (k = 0; k < literals; ++k, ++pointer) {
+			if (bitmap->buffer[pointer] == 0 ||
+				bitmap->buffer[pointer] == (eword_t)(~0))
+				return false;
+		}
+
+		last_bit = bit;
+		last_run = run;
+		last_literals = literals;
+	}
+
+	return true;
+}
+
+/* an allocator that can be told to refuse new buffers, or shrinking one */
+struct sized_policy {
+	bool refuse_alloc;
+	bool refuse_shrink;
+};
+
+static void *sized_alloc(void *ctx, size_t size)
+{
+	size_t *block;
+
+	if (((struct sized_policy *)ctx)->refuse_alloc)
+		return NULL;
+
+	block = malloc(size + 2 * sizeof(size_t));
+	if (block == NULL)
+		return NULL;
+
+	block[0] = size;
+	return block + 2;
+}
+
+static void *sized_resize(void *ctx, void *ptr, size_t size)
+{
+	size_t *block = (size_t *)ptr - 2;
+
+	if (((struct sized_policy *)ctx)->refuse_shrink && size < block[0])
+		return NULL;
+
+	/* on failure the old block is still the caller's */
+	block = realloc(block, size + 2 * sizeof(size_t));
+	if (block == NULL)
+		return NULL;
+
+	block[0] = size;
+	return block + 2;
+}
+
+static void sized_release(void *ctx, void *ptr)
+{
+	(void)ctx;
+	free((size_t *)ptr - 2);
+}
+
+static void test_compact(size_t size)
+{
+	struct ewah_bitmap *a = generate_loose_bitmap(size);
+	struct ewah_bitmap *b = generate_loose_bitmap(size);
+	struct ewah_bitmap *result = ewah_new();
+	struct ewah_bitmap *canonical = ewah_new();
+	struct bitmap *before, *after;
+	size_t i, alloc, cardinality = ewah_cardinality(a);
+	struct sized_policy policy = { false, false };
+	struct ewah_allocator allocator = {
+		&sized_alloc, &sized_resize, &sized_release, &policy
+	};
+	struct ewah_bitmap *trimmed, *low, *high, *both[2], *both_and, *many_and;
+
+	void (*ops[])(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *) = {
+		&ewah_or, &ewah_xor, &ewah_and, &ewah_and_not
+	};
+
+	fprintf(stderr, "compacting %zu bits... ", size);
+
+	before = ewah_to_bitmap(a);
+
+	if (ewah_compact(a) < 0 || !is_canonical(a) ||
+		a->alloc_size != a->buffer_size) {
+		fprintf(stderr, "compact ## FAIL\n");
+		exit(-1);
+	}
+
+	after = ewah_to_bitmap(a);
+
+	if (before->word_alloc != after->word_alloc ||
+		memcmp(before->words, after->words, before->word_alloc * sizeof(eword_t))) {
+		fprintf(stderr, "compacted bits ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_cardinality(a, cardinality);
+
+	/* the canonical output of an operation is its compacted output */
+	canonical->canonical = true;
+
+	/* recycled through `ewah_clear`, the output never grows again */
+	ewah_reserve(canonical, canonical->buffer_size + ewah_result_words(a, b));
+	alloc = canonical->alloc_size;
+
+	for (i = 0; i < sizeof(ops)/sizeof(ops[0]); ++i) {
+		ops[i](a, b, result);
+		ops[i](a, b, canonical);
+
+		ewah_compact(result);
+
+		if (!same_encoding(result, canonical) || !is_canonical(canonical) ||
+			canonical->alloc_size != alloc) {
+			fprintf(stderr, "canonical op %zu ## FAIL\n", i);
+			exit(-1);
+		}
+
+		verify_cardinality(canonical, ewah_cardinality(result));
+
+		ewah_clear(result);
+		ewah_clear(canonical);
+	}
+
+	/* if the buffer cannot be trimmed, the words are kept untrimmed */
+	policy.refuse_shrink = true;
+	trimmed = ewah_new_with_allocator(&allocator);
+	ewah_or(a, b, trimmed);
+	ewah_or(a, b, result);
+
+	if (ewah_compact(trimmed) < 0 || !is_canonical(trimmed) ||
+		trimmed->alloc_size <= trimmed->buffer_size || !same_bits(result, trimmed)) {
+		fprintf(stderr, "untrimmed compact ## FAIL\n");
+		exit(-1);
+	}
+
+	ewah_set(trimmed, trimmed->bit_size + 100);
+
+	/* the AND of bitmaps over different words only reserves the shorter */
+	low = ewah_new();
+	high = ewah_new();
+	for (i = 0; i < size / BITS_IN_WORD; ++i)
+		ewah_add(low, (eword_t)(~0) / 3);
+	ewah_append(high, low, 2 * low->bit_size);
+
+	both[0] = low;
+	both[1] = high;
+	both_and = ewah_new();
+	many_and = ewah_new();
+
+	ewah_and(low, high, both_and);
+	if (ewah_and_many(both, 2, many_and) < 0 ||
+		both_and->alloc_size > 32 + size / BITS_IN_WORD ||
+		many_and->alloc_size > 32 + size / BITS_IN_WORD) {
+		fprintf(stderr, "'and' reservation ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_cardinality(both_and, 0);
+	verify_cardinality(many_and, 0);
+
+	fprintf(stderr, "OK\n");
+
+	ewah_free(low);
+	ewah_free(high);
+	ewah_free(both_and);
+	ewah_free(many_and);
+	ewah_free(trimmed);
+	bitmap_free(before);
+	bitmap_free(after);
+	ewah_free(a);
+	ewah_free(b);
+	ewah_free(result);
+	ewah_free(canonical);
+}
+
+struct clone_reader {
+	struct ewah_bitmap *published;
+	size_t cardinality;
+	bool ok;
+};
+
+static void *clone_reader(void *payload)
+{
+	struct clone_reader *r = payload;
+	size_t round;
+
+	for (round = 0; round < 32; ++round) {
+		struct ewah_bitmap *snapshot = ewah_clone(r->published);
+		struct bit_stats stats = { 0, 0, 0 };
+		size_t pos = 0;
+
+		ewah_each_bit(snapshot, &cb__count, &stats);
+
+		if (stats.count != r->cardinality || snapshot->index != r->published->index)
+			r->ok = false;
+
+		/* random access reads the shared index, on any of the bitmaps */
+		if (stats.count > 0 &&
+			(!ewah_get(r->published, stats.last) ||
+			 ewah_rank(snapshot, stats.last) != stats.count - 1 ||
+			 !ewah_select(r->published, stats.count - 1, &pos) ||
+			 pos != stats.last))
+			r->ok = false;
+
+		ewah_free(snapshot);
+	}
+
+	return NULL;
+}
+
+static void test_clone(size_t size)
+{
+	struct ewah_bitmap *a = generate_mixed_bitmap(size);
+	struct ewah_bitmap *clone = ewah_clone(a);
+	struct ewah_bitmap *other = ewah_clone(clone);
+	struct bitmap *before = ewah_to_bitmap(a);
+	struct bitmap *after;
+	struct clone_reader readers[4];
+	pthread_t threads[4];
+	size_t i, cardinality = ewah_cardinality(a);
+	struct sized_policy policy = { false, false };
+	struct ewah_allocator allocator = {
+		&sized_alloc, &sized_resize, &sized_release, &policy
+	};
+	struct ewah_bitmap *owner, *stuck;
+
+	fprintf(stderr, "cloning %zu bits... ", size);
+
+	if (clone->buffer != a->buffer || other->buffer != a->buffer ||
+		!same_encoding(a, clone) || !same_encoding(a, other)) {
+		fprintf(stderr, "clone ## FAIL\n");
+		exit(-1);
+	}
+
+	/* writing to a clone leaves the words it shared alone */
+	ewah_set(clone, clone->bit_size + 100);
+	ewah_not(a);
+
+	if (clone->buffer == other->buffer || a->buffer == other->buffer) {
+		fprintf(stderr, "clone not copied on write ## FAIL\n");
+		exit(-1);
+	}
+
+	after = ewah_to_bitmap(other);
+
+	if (before->word_alloc != after->word_alloc ||
+		memcmp(before->words, after->words, before->word_alloc * sizeof(eword_t))) {
+		fprintf(stderr, "clone changed by a write ## FAIL\n");
+		exit(-1);
+	}
+
+	verify_cardinality(clone, cardinality + 1);
+	verify_cardinality(other, cardinality);
+
+	/* readers keep cloning while the writer works on its own clone */
+	for (i = 0; i < 4; ++i) {
+		readers[i].published = other;
+		readers[i].cardinality = cardinality;
+		readers[i].ok = true;
+		pthread_create(&threads[i], NULL, &clone_reader, &readers[i]);
+	}
+
+	ewah_free(clone);
+	clone = ewah_clone(other);
+
+	for (i = 0; i < size; i += 1 + rand() % 1000)
+		ewah_set(clone, clone->bit_size + i);
+
+	for (i = 0; i < 4; ++i) {
+		pthread_join(threads[i], NULL);
+
+		if (!readers[i].ok) {
+			fprintf(stderr, "concurrent clone ## FAIL\n");
+			exit(-1);
+		}
+	}
+
+	/* the last bitmap holding the words takes them back */
+	ewah_free(clone);
+	ewah_set(other, other->bit_size);
+
+	if (other->shared != NULL) {
+		fprintf(stderr, "clone not released ## FAIL\n");
+		exit(-1);
+	}
+
+	/* a clone that cannot get its own copy of the words is left alone */
+	owner = ewah_new_with_allocator(&allocator);
+	ewah_or(a, other, owner);
+	stuck = ewah_clone(owner);
+
+	policy.refuse_alloc = true;
+	ewah_set(stuck, stuck->bit_size + 100);
+	ewah_not(stuck);
+	ewah_clear(stuck);
+
+	if (ewah_reserve(stuck, stuck->buffer_size + 1000) == 0 ||
+		stuck->buffer != owner->buffer || !same_encoding(stuck, owner)) {
+		fprintf(stderr, "failed copy on write ## FAIL\n");
+		exit(-1);
+	}
+
+	policy.refuse_alloc = false;
+	verify_cardinality(stuck, ewah_cardinality(owner));
+
+	ewah_free(stuck);
+	ewah_free(owner);
+
+	fprintf(stderr, "OK\n");
+
+	bitmap_free(before);
+	bitmap_free(after);
+	ewah_free(a);
+	ewah_free(other);
+}
+
+static void test_parallel(size_t size)
+{
+	struct ewah_bitmap *a = generate_clustered_bitmap(size);
+	struct ewah_bitmap *b = generate_clustered_bitmap(size >> (rand() % 2));
+	struct ewah_bitmap *result = ewah_new();
+	struct ewah_bitmap *parallel = ewah_new();
+	size_t i, canonical;
+
+	struct {
+		void (*sequential)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *);
+		void (*parallel)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *, size_t);
+	} ops[] = {
+		{ &ewah_or, &ewah_or_parallel },
+		{ &ewah_xor, &ewah_xor_parallel },
+		{ &ewah_and, &ewah_and_parallel },
+		{ &ewah_and_not, &ewah_and_not_parallel }
+	};
+
+	fprintf(stderr, "parallel ops on %zu clustered bits... ", size);
+
+	/* many small groups per partition, whose outputs are spliced */
+	for (canonical = 0; canonical < 2; ++canonical) {
+		result->canonical = parallel->canonical = canonical;
+
+		for (i = 0; i < sizeof(ops)/sizeof(ops[0]); ++i) {
+			ops[i].sequential(a, b, result);
+			ops[i].parallel(a, b, parallel, 1 + rand() % 8);
+
+			if (!same_encoding(result, parallel)) {
+				fprintf(stderr, "op %zu ## FAIL\n", i);
+				exit(-1);
+			}
+
+			verify_cardinality(parallel, ewah_cardinality(result));
+
+			ewah_clear(result);
+			ewah_clear(parallel);
+		}
+	}
+
+	fprintf(stderr, "OK\n");
+
+	ewah_free(a);
+	ewah_free(b);
+	ewah_free(result);
+	ewah_free(parallel);
+}
+
 static void test_for_size(size_t size)
 {
 	struct ewah_bitmap *a = generate_bitmap(size);
 	struct ewah_bitmap *b = generate_bitmap(size);
 	struct ewah_bitmap *result = ewah_new();
-	size_t i;
+	struct ewah_bitmap *parallel = ewah_new();
+	size_t i, unset;
 
 	struct {
 		const char *name;
 		void (*generate)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *);
 		size_t (*check)(size_t, size_t);
+		size_t (*cardinality)(struct ewah_bitmap *, struct ewah_bitmap *);
+		void (*parallel)(struct ewah_bitmap *, struct ewah_bitmap *, struct ewah_bitmap *, size_t);
 	} tests[] = {
-		{"or", &ewah_or, &op_or},
-		{"xor", &ewah_xor, &op_xor},
-		{"and", &ewah_and, &op_and},
-		{"and-not", &ewah_and_not, &op_andnot}
+		{"or", &ewah_or, &op_or, &ewah_or_cardinality, &ewah_or_parallel},
+		{"xor", &ewah_xor, &op_xor, &ewah_xor_cardinality, &ewah_xor_parallel},
+		{"and", &ewah_and, &op_and, &ewah_and_cardinality, &ewah_and_parallel},
+		{"and-not", &ewah_and_not, &op_andnot, &ewah_and_not_cardinality, &ewah_and_not_parallel}
 	};
 
 	for (i = 0; i < sizeof(tests)/sizeof(tests[0]); ++i) {
@@ -138,12 +1340,35 @@ static void test_for_size(size_t size)
 		if (verify_operation(a, b, result, tests[i].check))
 			fprintf(stderr, "OK\n");
 
+		verify_cardinality(result, tests[i].cardinality(a, b));
+
+		if (result->buffer_size > ewah_result_words(a, b)) {
+			fprintf(stderr, "'%s' size estimate ## FAIL\n", tests[i].name);
+			exit(-1);
+		}
+
+		tests[i].parallel(a, b, parallel, 8);
+
+		if (!same_encoding(result, parallel)) {
+			fprintf(stderr, "'%s' parallel ## FAIL\n", tests[i].name);
+			exit(-1);
+		}
+
+		verify_cardinality(parallel, ewah_cardinality(result));
+
+		/* every bit flips, but the padding above `bit_size` stays clear */
+		unset = result->bit_size - ewah_cardinality(result);
+		ewah_not(result);
+		verify_cardinality(result, unset);
+
 		ewah_clear(result);
+		ewah_clear(parallel);
 	}
 
 	ewah_free(a);
 	ewah_free(b);
 	ewah_free(result);
+	ewah_free(parallel);
 }
 
 int main(int argc, char *argv[])
@@ -155,5 +1380,24 @@ int main(int argc, char *argv[])
 		test_for_size((size_t)1 << i);
 	}
 
+	for (i = 6; i < 20; i += 3) {
+		test_append((size_t)1 << i, true);
+		test_append((size_t)1 << i, false);
+		test_arena((size_t)1 << i);
+		test_expr((size_t)1 << i);
+		test_bulk((size_t)1 << i);
+		test_builder((size_t)1 << i);
+		test_bitmap_fold((size_t)1 << i);
+		test_hybrid((size_t)1 << (i + 4));
+		test_compact((size_t)1 << (i + 4));
+		test_clone((size_t)1 << (i + 4));
+		test_parallel((size_t)1 << (i + 6));
+	}
+
+	for (i = 1; i < 64; i *= 2) {
+		test_many((size_t)1 << 20, i);
+		test_many((size_t)1 << 20, i + 1);
+	}
+
 	return 0;
 }